@@ -0,0 +1,502 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	World archives
+
+	Deploying a mapped building to a new robot means copying tens of thousands of page files (and their journals),
+	and opening every one of them again on the robot. An archive is the whole world in one file:
+
+	map_archive_hdr_t
+	map_archive_entry_t + page, for every page, in index order
+	map_archive_entry_t (MAP_ARCHIVE_INDEX_MAGIC) + map_archive_idx_t for every page
+	map_archive_trailer_t
+
+	The pages are exactly like .map files (with their checksums), with the journals folded in. Everything is
+	written and read front to back, so export and import work through pipes (rn1host --export-map 0 - | ssh ...).
+	The index and the trailer at the end are for random access.
+
+	Instead of importing, the archive can be installed as MAP_DIR/world_<id>.mapar (MAP_ARCHIVE_DIR_NAME). Pages
+	that have no page file are then read straight from the archive: the index is loaded the first time a page of
+	the world is missed, and a page is one seek and one read. Pages changed by the robot are written as page
+	files as usual, which then take precedence, so the archive itself is never written. The archive is looked
+	for once per world; installing one needs a restart.
+
+	Not for MAP_STORE_MMAP worlds, except as the source of pages not yet in the world store.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "mapping.h"
+#include "map_memdisk.h"
+#include "map_archive.h"
+
+extern uint32_t robot_id;
+extern double subsec_timestamp();
+
+static int check_archive_hdr(map_archive_hdr_t* hdr, const char* fname)
+{
+	if(hdr->magic != MAP_ARCHIVE_MAGIC || hdr->version != MAP_ARCHIVE_VERSION)
+	{
+		printf("ERROR: %s is not a world archive\n", fname);
+		return 1;
+	}
+	if(hdr->map_w != MAP_W || hdr->page_size != sizeof(map_page_t))
+	{
+		printf("ERROR: world archive %s is for a different map format (MAP_W %u, page size %u)\n", fname, hdr->map_w, hdr->page_size);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+	Export
+*/
+
+static int write_out(FILE* out, const void* data, int len, uint64_t* offset)
+{
+	if(len && fwrite(data, len, 1, out) != 1)
+	{
+		printf("ERROR: writing the world archive failed, errno=%d\n", errno);
+		return 1;
+	}
+	*offset += len;
+	return 0;
+}
+
+static int archive_page_idx_cmp(const void* a, const void* b)
+{
+	const map_archive_idx_t* ia = a;
+	const map_archive_idx_t* ib = b;
+	int na = ia->pagex*MAP_W + ia->pagey;
+	int nb = ib->pagex*MAP_W + ib->pagey;
+	return (na > nb) - (na < nb);
+}
+
+static int page_bit(uint8_t* bits, int x, int y)
+{
+	return bits[(x*MAP_W+y)/8] & (1<<((x*MAP_W+y)%8));
+}
+
+static void set_page_bit(uint8_t* bits, int x, int y)
+{
+	bits[(x*MAP_W+y)/8] |= 1<<((x*MAP_W+y)%8);
+}
+
+typedef struct
+{
+	uint32_t world_id;
+	int n_pages;            // 0 = no archive (or an unusable one)
+	map_archive_idx_t* idx;
+	char fname[1024];
+} served_archive_t;
+
+static served_archive_t* get_served_archive(uint32_t world_id);
+
+int export_map_archive(uint32_t world_id, const char* name, FILE* out)
+{
+	// Pages to export: page files of the world, and the pages of the installed archive.
+	static uint8_t have[MAP_W*MAP_W/8];
+	memset(have, 0, sizeof(have));
+	int n_pages = 0;
+
+	DIR* d = opendir(MAP_DIR);
+	if(!d)
+	{
+		printf("ERROR: cannot open MAP_DIR (%s), errno=%d\n", MAP_DIR, errno);
+		return 1;
+	}
+	struct dirent* e;
+	while((e = readdir(d)))
+	{
+		unsigned int rid, wid, x, y;
+		int n = 0;
+		if(sscanf(e->d_name, "%8x_%u_%u_%u.map%n", &rid, &wid, &x, &y, &n) == 4 && n > 0 && e->d_name[n] == 0 &&
+		   rid == robot_id && wid == world_id && x < MAP_W && y < MAP_W && !page_bit(have, x, y))
+		{
+			set_page_bit(have, x, y);
+			n_pages++;
+		}
+	}
+	closedir(d);
+
+	served_archive_t* served = get_served_archive(world_id);
+	for(int i=0; served && i<served->n_pages; i++)
+	{
+		int x = served->idx[i].pagex, y = served->idx[i].pagey;
+		if(!page_bit(have, x, y))
+		{
+			set_page_bit(have, x, y);
+			n_pages++;
+		}
+	}
+
+	map_page_t* page = malloc(sizeof(map_page_t));
+	map_archive_idx_t* idx = malloc((n_pages?n_pages:1)*sizeof(map_archive_idx_t));
+	if(!page || !idx)
+	{
+		printf("ERROR: out of memory exporting world %u\n", world_id);
+		free(page); free(idx);
+		return 1;
+	}
+
+	double start_time = subsec_timestamp();
+	map_io_stats_t st;
+	memset(&st, 0, sizeof(st));
+
+	map_archive_hdr_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = MAP_ARCHIVE_MAGIC;
+	hdr.version = MAP_ARCHIVE_VERSION;
+	hdr.map_w = MAP_W;
+	hdr.page_size = sizeof(map_page_t);
+	hdr.world_id = world_id;
+	hdr.robot_id = robot_id;
+	hdr.n_pages = n_pages;
+	hdr.created = time(NULL);
+	snprintf(hdr.name, WORLD_NAME_LEN, "%s", name?name:"");
+
+	uint64_t offset = 0;
+	int ret = write_out(out, &hdr, sizeof(hdr), &offset);
+	int n_idx = 0, n_errors = 0;
+
+	// In index order, so the index doesn't need sorting.
+	for(int x = 0; ret == 0 && x < MAP_W; x++)
+	{
+		for(int y = 0; ret == 0 && y < MAP_W; y++)
+		{
+			if(!page_bit(have, x, y))
+				continue;
+
+			if(read_stored_map_page(world_id, x, y, page, &st))
+			{
+				printf("ERROR: reading page (%d,%d) failed, not exported\n", x, y);
+				n_errors++;
+				continue;
+			}
+
+			int len;
+			uint8_t* buf = encode_map_page(page, 1, &len, &st);
+			if(!buf)
+			{
+				ret = 1;
+				break;
+			}
+
+			map_archive_entry_t ent = {MAP_ARCHIVE_ENTRY_MAGIC, x, y, len};
+			ret = write_out(out, &ent, sizeof(ent), &offset);
+			idx[n_idx] = (map_archive_idx_t){x, y, len, offset};
+			if(ret == 0)
+				ret = write_out(out, buf, len, &offset);
+			n_idx++;
+			free(buf);
+		}
+	}
+
+	if(ret == 0)
+	{
+		map_archive_entry_t ent = {MAP_ARCHIVE_INDEX_MAGIC, 0, 0, n_idx*sizeof(map_archive_idx_t)};
+		ret = write_out(out, &ent, sizeof(ent), &offset);
+		map_archive_trailer_t trailer = {MAP_ARCHIVE_INDEX_MAGIC, n_idx, offset};
+		if(ret == 0)
+			ret = write_out(out, idx, n_idx*sizeof(map_archive_idx_t), &offset);
+		if(ret == 0)
+			ret = write_out(out, &trailer, sizeof(trailer), &offset);
+	}
+	if(fflush(out))
+		ret = 1;
+
+	free(page);
+	free(idx);
+
+	if(ret == 0)
+	{
+		printf("Info: exported world %u: %d pages (%d journal records folded in), %.1f MB in %.2f s\n",
+			world_id, n_idx, st.jnl_replayed, (double)offset/1e6, subsec_timestamp()-start_time);
+		if(n_errors)
+			printf("WARN: %d pages couldn't be read and are missing from the archive (the header says %d pages)\n", n_errors, n_pages);
+	}
+	return ret;
+}
+
+/*
+	Import
+*/
+
+int import_map_archive(FILE* in, uint32_t* world_id)
+{
+	map_archive_hdr_t hdr;
+	if(fread(&hdr, sizeof(hdr), 1, in) != 1)
+	{
+		printf("ERROR: reading the world archive header failed\n");
+		return 1;
+	}
+	if(check_archive_hdr(&hdr, "input"))
+		return 1;
+
+	hdr.name[WORLD_NAME_LEN-1] = 0;
+	*world_id = hdr.world_id;
+	printf("Info: importing world %u (%s), %u pages, exported from robot %08x\n", hdr.world_id, hdr.name, hdr.n_pages, hdr.robot_id);
+
+	map_page_t* page = malloc(sizeof(map_page_t));
+	if(!page)
+	{
+		printf("ERROR: out of memory importing the world archive\n");
+		return 1;
+	}
+
+	double start_time = subsec_timestamp();
+	map_io_stats_t st;
+	memset(&st, 0, sizeof(st));
+
+	int ret = 0, n_imported = 0;
+	while(1)
+	{
+		map_archive_entry_t ent;
+		if(fread(&ent, sizeof(ent), 1, in) != 1)
+		{
+			printf("ERROR: world archive is truncated after %d pages\n", n_imported);
+			ret = 1;
+			break;
+		}
+
+		if(ent.magic == MAP_ARCHIVE_INDEX_MAGIC)
+			break; // The index is only for random access.
+
+		if(ent.magic != MAP_ARCHIVE_ENTRY_MAGIC || ent.pagex >= MAP_W || ent.pagey >= MAP_W)
+		{
+			printf("ERROR: world archive is corrupted after %d pages\n", n_imported);
+			ret = 1;
+			break;
+		}
+
+		// The stream position is lost if the page doesn't decode, so any error ends the import.
+		char name[64];
+		snprintf(name, sizeof(name), "archive page (%u,%u)", ent.pagex, ent.pagey);
+		map_page_hdr_t page_hdr;
+		int dret = decode_map_page(in, ent.size, page, &page_hdr, name, &st);
+		if(dret)
+		{
+			if(dret == 3)
+				printf("ERROR: %s is corrupted (checksum mismatch)\n", name);
+			ret = 1;
+			break;
+		}
+
+		if(write_stored_map_page(hdr.world_id, ent.pagex, ent.pagey, page, &st))
+		{
+			ret = 1;
+			break;
+		}
+		n_imported++;
+	}
+
+	free(page);
+
+	printf("Info: imported %d pages (%.1f MB of page files) in %.2f s\n", n_imported, (double)st.bytes_written/1e6, subsec_timestamp()-start_time);
+	return ret;
+}
+
+/*
+	Command line
+*/
+
+int export_map_archive_file(uint32_t world_id, const char* name, const char* fname)
+{
+	FILE* out;
+	if(strcmp(fname, "-") == 0)
+	{
+		// The archive goes to the original stdout, everything printed to stderr.
+		fflush(stdout);
+		int fd = dup(STDOUT_FILENO);
+		if(fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 || !(out = fdopen(fd, "wb")))
+		{
+			fprintf(stderr, "ERROR: redirecting stdout failed, errno=%d\n", errno);
+			return 1;
+		}
+	}
+	else if(!(out = fopen(fname, "wb")))
+	{
+		printf("ERROR: opening %s for write failed, errno=%d\n", fname, errno);
+		return 1;
+	}
+
+	int ret = export_map_archive(world_id, name, out);
+	if(fclose(out))
+		ret = 1;
+	return ret;
+}
+
+int import_map_archive_file(const char* fname)
+{
+	FILE* in = (strcmp(fname, "-") == 0)?stdin:fopen(fname, "rb");
+	if(!in)
+	{
+		printf("ERROR: opening %s failed, errno=%d\n", fname, errno);
+		return 1;
+	}
+
+	uint32_t world_id;
+	int ret = import_map_archive(in, &world_id);
+	if(in != stdin)
+		fclose(in);
+	return ret;
+}
+
+/*
+	Serving pages from an installed archive
+*/
+
+static served_archive_t served[MAX_WORLDS];
+static int n_served;
+static pthread_mutex_t served_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Loads the index. Returns the number of pages, 0 if there is no usable archive.
+static int load_archive_index(served_archive_t* a)
+{
+	FILE* f = fopen(a->fname, "rb");
+	if(!f)
+	{
+		if(errno != ENOENT)
+			printf("WARN: opening world archive %s failed, errno=%d\n", a->fname, errno);
+		return 0;
+	}
+
+	map_archive_hdr_t hdr;
+	map_archive_trailer_t trailer;
+	int ok = fread(&hdr, sizeof(hdr), 1, f) == 1 && check_archive_hdr(&hdr, a->fname) == 0;
+	if(ok && hdr.world_id != a->world_id)
+	{
+		printf("ERROR: world archive %s is of world %u\n", a->fname, hdr.world_id);
+		ok = 0;
+	}
+
+	if(ok && (fseek(f, -(long)sizeof(trailer), SEEK_END) || fread(&trailer, sizeof(trailer), 1, f) != 1 ||
+	          trailer.magic != MAP_ARCHIVE_INDEX_MAGIC || trailer.n_pages > MAP_W*MAP_W))
+	{
+		printf("ERROR: world archive %s has no index (truncated?)\n", a->fname);
+		ok = 0;
+	}
+
+	if(ok && trailer.n_pages)
+	{
+		a->idx = malloc(trailer.n_pages*sizeof(map_archive_idx_t));
+		if(!a->idx || fseek(f, trailer.index_offset, SEEK_SET) || fread(a->idx, sizeof(map_archive_idx_t), trailer.n_pages, f) != trailer.n_pages)
+		{
+			printf("ERROR: reading the index of world archive %s failed\n", a->fname);
+			ok = 0;
+		}
+		for(int i=1; ok && i<trailer.n_pages; i++)
+		{
+			if(archive_page_idx_cmp(&a->idx[i-1], &a->idx[i]) >= 0)
+			{
+				printf("ERROR: the index of world archive %s is not sorted\n", a->fname);
+				ok = 0;
+			}
+		}
+	}
+	fclose(f);
+
+	if(!ok || !trailer.n_pages)
+	{
+		free(a->idx);
+		a->idx = NULL;
+		return 0;
+	}
+
+	hdr.name[WORLD_NAME_LEN-1] = 0;
+	printf("Info: serving world %u (%s) from archive %s, %u pages\n", a->world_id, hdr.name, a->fname, trailer.n_pages);
+	return trailer.n_pages;
+}
+
+// The archive of the world; n_pages is 0 if it has none. Entries are never changed after they are made.
+static served_archive_t* get_served_archive(uint32_t world_id)
+{
+	pthread_mutex_lock(&served_mutex);
+	served_archive_t* a = NULL;
+	for(int i=0; i<n_served; i++)
+	{
+		if(served[i].world_id == world_id)
+		{
+			a = &served[i];
+			break;
+		}
+	}
+
+	if(!a && n_served < MAX_WORLDS)
+	{
+		a = &served[n_served];
+		a->world_id = world_id;
+		snprintf(a->fname, sizeof(a->fname), MAP_ARCHIVE_DIR_NAME, world_id);
+		a->n_pages = load_archive_index(a);
+		n_served++;
+	}
+	pthread_mutex_unlock(&served_mutex);
+	return a;
+}
+
+int archive_read_page(uint32_t world_id, int pagex, int pagey, map_page_t* page, map_io_stats_t* st)
+{
+	served_archive_t* a = get_served_archive(world_id);
+	if(!a || !a->n_pages)
+		return 2;
+
+	map_archive_idx_t key = {pagex, pagey, 0, 0};
+	map_archive_idx_t* ent = bsearch(&key, a->idx, a->n_pages, sizeof(map_archive_idx_t), archive_page_idx_cmp);
+	if(!ent)
+		return 2;
+
+	FILE* f = fopen(a->fname, "rb");
+	if(!f)
+	{
+		printf("ERROR: opening world archive %s failed, errno=%d\n", a->fname, errno);
+		return 1;
+	}
+
+	map_page_hdr_t hdr;
+	int ret = 1;
+	if(fseek(f, ent->offset, SEEK_SET) == 0)
+		ret = decode_map_page(f, ent->size, page, &hdr, a->fname, st);
+	fclose(f);
+
+	if(ret == 3)
+	{
+		// Not set aside like a page file: the rest of the archive is fine.
+		st->crc_errors++;
+		printf("WARN: page (%d,%d) in world archive %s is corrupted\n", pagex, pagey, a->fname);
+		ret = 1;
+	}
+
+	if(ret == 0)
+	{
+		st->pages_read++;
+		st->archive_reads++;
+		st->bytes_read += ent->size;
+	}
+	return ret;
+}
@@ -0,0 +1,96 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	World archives: all pages of a world in one indexed file, for deploying maps
+
+*/
+
+#ifndef MAP_ARCHIVE_H
+#define MAP_ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "mapping.h"
+#include "map_memdisk.h"
+
+#define MAP_ARCHIVE_MAGIC       0x4131524e // "NR1A"
+#define MAP_ARCHIVE_ENTRY_MAGIC 0x4531524e // "NR1E"
+#define MAP_ARCHIVE_INDEX_MAGIC 0x5831524e // "NR1X"
+#define MAP_ARCHIVE_VERSION     1
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t map_w;     // MAP_W
+	uint32_t page_size; // sizeof(map_page_t)
+	uint32_t world_id;
+	uint32_t robot_id;  // robot the world was exported from, for information
+	uint32_t n_pages;
+	int64_t  created;   // Unix time
+	char     name[WORLD_NAME_LEN];
+} map_archive_hdr_t;
+
+// Precedes each page, and the index (magic = MAP_ARCHIVE_INDEX_MAGIC, size = size of the index).
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint16_t pagex;
+	uint16_t pagey;
+	uint32_t size;      // bytes following: the page exactly as in a .map file (map_page_hdr_t + payload)
+} map_archive_entry_t;
+
+// Index entries are sorted by pagex*MAP_W+pagey.
+typedef struct __attribute__((packed))
+{
+	uint16_t pagex;
+	uint16_t pagey;
+	uint32_t size;
+	uint64_t offset;    // of the page contents from the start of the file
+} map_archive_idx_t;
+
+// Last bytes of the file
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;     // MAP_ARCHIVE_INDEX_MAGIC
+	uint32_t n_pages;
+	uint64_t index_offset;
+} map_archive_trailer_t;
+
+// An archive installed here is used for the pages of the world that have no page file in MAP_DIR.
+#define MAP_ARCHIVE_DIR_NAME MAP_DIR"/world_%u.mapar"
+
+// Writes all pages of the world in MAP_DIR (page files with their journals applied, and the pages of the installed
+// archive) to out, which can be a pipe. name is stored in the archive for the humans. Returns 0 if ok.
+int export_map_archive(uint32_t world_id, const char* name, FILE* out);
+
+// Writes all pages in the archive (which can be a pipe) to MAP_DIR as page files. Pages in MAP_DIR which are not
+// in the archive are left as they are. Sets *world_id to the world of the archive. Returns 0 if ok.
+int import_map_archive(FILE* in, uint32_t* world_id);
+
+// The above, for the command line: fname "-" is stdout or stdin. The messages go to stderr when writing to stdout.
+// Must not be used while the mapping is running.
+int export_map_archive_file(uint32_t world_id, const char* name, const char* fname);
+int import_map_archive_file(const char* fname);
+
+// Reads the page from the archive installed for the world, if any. Returns 0 if ok, 1 on errors, 2 if the page
+// (or the archive) doesn't exist. Thread-safe.
+int archive_read_page(uint32_t world_id, int pagex, int pagey, map_page_t* page, map_io_stats_t* st);
+
+#endif
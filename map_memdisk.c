@@ -26,111 +26,2347 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "mapping.h"
 #include "map_memdisk.h"
+#include "map_mmstore.h"
+#include "map_archive.h"
+#include "page_pool.h"
+#include "routing.h"
 
 extern uint32_t robot_id;
+extern double subsec_timestamp();
+
+map_io_stats_t map_io_stats;
+
+page_pool_t map_page_pool = PAGE_POOL_INIT("map page", map_page_t, 4, MAP_PAGE_POOL_MAX);
+page_pool_t routing_page_pool = PAGE_POOL_INIT("routing page", routing_page_t, 16, MAP_PAGE_POOL_MAX);
+
+/*
+	Worlds in memory
+
+	The registry of the worlds get_world() has created. Worlds are never freed: there are only a few (one per floor,
+	typically), and their directories only take the memory of the blocks they've used.
+*/
+
+static world_t* worlds[MAX_WORLDS];
+static int n_worlds;
+
+world_t* get_world(uint32_t id, const char* name)
+{
+	for(int i=0; i<n_worlds; i++)
+	{
+		if(worlds[i]->id == id)
+			return worlds[i];
+	}
+
+	if(n_worlds >= MAX_WORLDS)
+	{
+		printf("ERROR: can't have more than %d worlds in memory\n", MAX_WORLDS);
+		return NULL;
+	}
+
+	world_t* w = calloc(1, sizeof(world_t));
+	if(!w)
+	{
+		printf("ERROR: out of memory for world %u\n", id);
+		return NULL;
+	}
+	w->id = id;
+	snprintf(w->name, WORLD_NAME_LEN, "%s", name?name:"");
+	worlds[n_worlds++] = w;
+	printf("Info: world %u (%s) created, %d worlds in memory\n", id, w->name, n_worlds);
+	return w;
+}
+
+world_page_t* get_world_page(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	if(wp || (unsigned)pagex >= MAP_W || (unsigned)pagey >= MAP_W)
+		return wp;
+
+	world_block_t* b = calloc(1, sizeof(world_block_t));
+	if(!b)
+	{
+		printf("ERROR: out of memory for the page directory\n");
+		exit(1);
+	}
+	w->blocks[pagex/WORLD_BLOCK_W][pagey/WORLD_BLOCK_W] = b;
+	w->n_blocks++;
+	return &b->p[pagex%WORLD_BLOCK_W][pagey%WORLD_BLOCK_W];
+}
+
+/*
+	Resident page index
+
+	Every loaded page is on the resident list, in least-recently-used order, and every changed page is also on
+	the dirty list, so syncing and unloading don't need to go through the page directory. The lists are
+	intrusive, linked through the world_page_t entries (page number = x*MAP_W+y, -1 = end of list).
+
+	Every load_*page*() call is a new epoch: it moves the pages it asks for to the most-recently-used end of
+	the list and stamps them with the epoch. Pages used within the last LRU_PROTECT_EPOCHS epochs are never
+	evicted, so the pages a caller just asked for (even with a few separate calls) stay in memory.
+
+	After each load_*page*() call, least recently used pages are unloaded until the map pages and their routing
+	pages fit in MAP_RAM_BUDGET. Eviction is also done if the map page pool runs out. The other worlds in memory
+	are not in use, so their pages go first, without the epoch protection.
+*/
+
+#define LRU_PROTECT_EPOCHS 4
+
+struct page_index_t
+{
+	int32_t lru_head, lru_tail; // head = least recently used
+	int32_t dirty_head;
+	int n_resident;
+	int n_dirty;
+
+	uint32_t epoch;
+};
+
+page_index_stats_t page_index_stats;
+
+static page_index_t* get_index(world_t* w)
+{
+	if(!w->index)
+	{
+		w->index = calloc(1, sizeof(page_index_t));
+		if(!w->index)
+		{
+			printf("ERROR: out of memory for the page index\n");
+			exit(1);
+		}
+		w->index->lru_head = w->index->lru_tail = w->index->dirty_head = -1;
+		w->index->epoch = 1;
+	}
+	return w->index;
+}
+
+// Directory entry of page number n; only for pages on the lists, which always have one.
+static world_page_t* index_page(world_t* w, int32_t n)
+{
+	return find_world_page(w, n/MAP_W, n%MAP_W);
+}
+
+static void lru_unlink(world_t* w, int32_t n)
+{
+	page_index_t* idx = w->index;
+	world_page_t* wp = index_page(w, n);
+	if(wp->lru_prev >= 0) index_page(w, wp->lru_prev)->lru_next = wp->lru_next; else idx->lru_head = wp->lru_next;
+	if(wp->lru_next >= 0) index_page(w, wp->lru_next)->lru_prev = wp->lru_prev; else idx->lru_tail = wp->lru_prev;
+}
+
+static void lru_push_tail(world_t* w, int32_t n)
+{
+	page_index_t* idx = w->index;
+	world_page_t* wp = index_page(w, n);
+	wp->lru_prev = idx->lru_tail;
+	wp->lru_next = -1;
+	if(idx->lru_tail >= 0) index_page(w, idx->lru_tail)->lru_next = n; else idx->lru_head = n;
+	idx->lru_tail = n;
+}
+
+static void dirty_unlink(world_t* w, int32_t n)
+{
+	page_index_t* idx = w->index;
+	world_page_t* wp = index_page(w, n);
+	if(wp->dirty_prev >= 0) index_page(w, wp->dirty_prev)->dirty_next = wp->dirty_next; else idx->dirty_head = wp->dirty_next;
+	if(wp->dirty_next >= 0) index_page(w, wp->dirty_next)->dirty_prev = wp->dirty_prev;
+}
+
+static void index_add_resident(world_t* w, int pagex, int pagey)
+{
+	page_index_t* idx = get_index(w);
+	lru_push_tail(w, pagex*MAP_W+pagey);
+	idx->n_resident++;
+
+	int total = 0;
+	for(int i=0; i<n_worlds; i++)
+		total += worlds[i]->index ? worlds[i]->index->n_resident : 0;
+	if(total > page_index_stats.peak_resident)
+		page_index_stats.peak_resident = total;
+
+	// Page summary lives as long as the page is resident.
+	page_summary_t* s = calloc(1, sizeof(page_summary_t));
+	if(!s)
+	{
+		printf("ERROR: out of memory for the page summary\n");
+		exit(1);
+	}
+	s->stale = ~0ULL;
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	wp->summary = s;
+	wp->routing_stale = ~0ULL;
+	wp->map_gen++;
+}
+
+static void index_remove_resident(world_t* w, int pagex, int pagey)
+{
+	page_index_t* idx = get_index(w);
+	lru_unlink(w, pagex*MAP_W+pagey);
+	idx->n_resident--;
+
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	free(wp->summary);
+	wp->summary = NULL;
+	wp->map_gen++; // the routing page above this one loses its last column
+}
+
+void refresh_page_summary(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	page_summary_t* s = wp->summary;
+	map_page_t* page = wp->page;
+
+	uint64_t stale = s->stale;
+	for(int t=0; stale; t++, stale>>=1)
+	{
+		if(!(stale&1))
+			continue;
+
+		int x0 = (t/MAP_TILES_PER_ROW)*MAP_TILE_W, y0 = (t%MAP_TILES_PER_ROW)*MAP_TILE_W;
+		uint8_t or_res = 0, and_res = 0xff, or_constr = 0;
+		uint8_t max_obst = 0, max_3d = 0, max_seen = 0, max_visited = 0;
+		for(int x=x0; x<x0+MAP_TILE_W; x++)
+		{
+			for(int y=y0; y<y0+MAP_TILE_W; y++)
+			{
+				uint8_t r = PAGE_UNIT(page,x,y,result);
+				or_res |= r;
+				and_res &= r;
+				or_constr |= PAGE_UNIT(page,x,y,constraints);
+				if(PAGE_UNIT(page,x,y,num_obstacles) > max_obst) max_obst = PAGE_UNIT(page,x,y,num_obstacles);
+				if(PAGE_UNIT(page,x,y,num_3d_obstacles) > max_3d) max_3d = PAGE_UNIT(page,x,y,num_3d_obstacles);
+				if(PAGE_UNIT(page,x,y,num_seen) > max_seen) max_seen = PAGE_UNIT(page,x,y,num_seen);
+				if(PAGE_UNIT(page,x,y,num_visited) > max_visited) max_visited = PAGE_UNIT(page,x,y,num_visited);
+			}
+		}
+		s->or_result[t] = or_res;
+		s->and_result[t] = and_res;
+		s->or_constraints[t] = or_constr;
+		s->max_num_obstacles[t] = max_obst;
+		s->max_num_3d_obstacles[t] = max_3d;
+		s->max_num_seen[t] = max_seen;
+		s->max_num_visited[t] = max_visited;
+	}
+	s->stale = 0;
+	map_io_stats.summary_refreshes++;
+}
+
+void page_index_add_dirty(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	if(!wp || !wp->page)
+	{
+		printf("WARN: marking unloaded page (%d,%d) changed\n", pagex, pagey);
+		return;
+	}
+
+	page_index_t* idx = get_index(w);
+	int32_t n = pagex*MAP_W+pagey;
+	wp->dirty_prev = -1;
+	wp->dirty_next = idx->dirty_head;
+	if(idx->dirty_head >= 0) index_page(w, idx->dirty_head)->dirty_prev = n;
+	idx->dirty_head = n;
+	idx->n_dirty++;
+	wp->changed = 1;
+}
+
+static void clear_page_changed(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	if(!wp)
+		return;
+
+	wp->changed_tiles = 0;
+	if(!wp->changed)
+		return;
+
+	page_index_t* idx = get_index(w);
+	dirty_unlink(w, pagex*MAP_W+pagey);
+	idx->n_dirty--;
+	wp->changed = 0;
+}
+
+// The page was (re)read: its summary and routing page need to be recomputed.
+static void page_replaced(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	if(!wp)
+		return;
+	if(wp->summary)
+		wp->summary->stale = ~0ULL;
+	wp->routing_stale = ~0ULL;
+	wp->map_gen++;
+}
+
+// Marks the page as used in this epoch (see above).
+static void touch_page(world_t* w, int pagex, int pagey)
+{
+	page_index_t* idx = get_index(w);
+	world_page_t* wp = get_world_page(w, pagex, pagey);
+	wp->stamp = idx->epoch;
+	wp->accesses++;
+	page_index_stats.requests++;
+	if(wp->page)
+	{
+		page_index_stats.hits++;
+		lru_unlink(w, pagex*MAP_W+pagey);
+		lru_push_tail(w, pagex*MAP_W+pagey);
+	}
+}
+
+uint32_t page_access_count(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	return wp ? wp->accesses : 0;
+}
+
+int n_resident_pages(world_t* w)
+{
+	return get_index(w)->n_resident;
+}
+
+int n_dirty_pages(world_t* w)
+{
+	return get_index(w)->n_dirty;
+}
+
+int64_t resident_page_bytes(world_t* w)
+{
+	return (int64_t)get_index(w)->n_resident*sizeof(map_page_t) + (int64_t)routing_page_pool.in_use*sizeof(routing_page_t);
+}
+
+// All worlds together
+static int64_t total_resident_page_bytes()
+{
+	int n = 0;
+	for(int i=0; i<n_worlds; i++)
+		n += worlds[i]->index ? worlds[i]->index->n_resident : 0;
+	return (int64_t)n*sizeof(map_page_t) + (int64_t)routing_page_pool.in_use*sizeof(routing_page_t);
+}
+
+// Unloads the least recently used page of the world, if not protected. Returns 0 if a page was evicted.
+static int evict_lru_page_of(world_t* w, int protect)
+{
+	page_index_t* idx = get_index(w);
+	for(int32_t n = idx->lru_head; n >= 0; n = index_page(w, n)->lru_next)
+	{
+		if(protect && idx->epoch - index_page(w, n)->stamp < LRU_PROTECT_EPOCHS)
+			continue;
+
+		int x = n/MAP_W, y = n%MAP_W;
+		//printf("Info: evicting page (%d,%d), unused for %u page loads\n", x, y, idx->epoch - index_page(w, n)->stamp);
+		unload_map_page(w, x, y);
+		page_index_stats.evictions++;
+		return 0;
+	}
+	return 1;
+}
+
+// Unloads a page of another world, or the least recently used page of w. Returns 0 if a page was evicted.
+static int evict_lru_page(world_t* w)
+{
+	for(int i=0; i<n_worlds; i++)
+	{
+		if(worlds[i] != w && worlds[i]->index && worlds[i]->index->n_resident > 0 && evict_lru_page_of(worlds[i], 0) == 0)
+			return 0;
+	}
+	return evict_lru_page_of(w, 1);
+}
+
+static void enforce_ram_budget(world_t* w)
+{
+	while(total_resident_page_bytes() > MAP_RAM_BUDGET)
+	{
+		if(evict_lru_page(w))
+			break;
+		page_index_stats.budget_evictions++;
+	}
+}
+
+/*
+	Page file format
+
+	Pages are stored compressed, behind a small versioned header. Most of a page is unknown or uniform, and
+	of the 8 bytes of map_unit_t, most are zero even on the mapped areas. The page is first split into
+	byte planes (all .result bytes, then all .latest bytes, and so on), so that each plane is
+	long runs of the same value, then the planes are run-length coded:
+
+	Control byte c < 0x80:  c+1 literal bytes follow.
+	Control byte c >= 0x80: a run of one value; length = (c&0x7f) + MAP_RLE_MIN_RUN. If (c&0x7f) == 0x7f,
+	                        a little-endian uint16 follows and is added to the length. The value byte comes last.
+
+	An empty page compresses into a few dozen bytes, so the load time is dominated by the fopen(), and a
+	typical mapped page into a few tens of kilobytes. Decoding is a memset() per run and a memcpy() per
+	literal, which is much faster than reading the raw 512 KB from an SD card.
+
+	Old raw pages (the plain map_page_t, without the header) are still read; they are rewritten in the new
+	format the next time they change.
+
+	The files are the same for both page layouts (see mapping.h): with MAP_PAGE_PLANAR, the page in memory already
+	is the byte planes, and raw pages are stored as the map_unit_t array.
+
+	The robot is restarted often, and loses power, so a page file is never written in place: the new file is
+	written as <page>.map.tmp, fsync()ed and renamed over the old one. After a crash, there is either the old or the
+	new page, never a mix (and maybe a leftover .tmp, removed by recover_map_dir()). The header carries a CRC-32
+	of the payload (version 3 ->), checked on every read; a page failing it is renamed to <page>.map.bad, and the
+	robot starts that page over, instead of mapping on top of garbage.
+*/
+
+#define MAP_RLE_MIN_RUN 3
+#define MAP_RLE_MAX_LITERAL 128
+#define MAP_RLE_MAX_RUN (MAP_RLE_MIN_RUN + 0x7f + 0xffff)
+
+#define PAGE_N_UNITS (MAP_PAGE_W*MAP_PAGE_W)
+#define PAGE_N_PLANES ((int)sizeof(map_unit_t))
+
+// Worst case: all literals, one control byte per MAP_RLE_MAX_LITERAL bytes.
+#define MAP_RLE_MAX_SIZE (sizeof(map_page_t) + sizeof(map_page_t)/MAP_RLE_MAX_LITERAL + 16)
+
+#ifdef MAP_PAGE_PLANAR
+
+// A planar page (see mapping.h) already is the byte planes.
+static void page_to_planes(map_page_t* page, uint8_t* planes)
+{
+	memcpy(planes, page, sizeof(map_page_t));
+}
+
+static void planes_to_page(uint8_t* planes, map_page_t* page)
+{
+	memcpy(page, planes, sizeof(map_page_t));
+}
+
+void map_page_to_units(map_page_t* page, map_unit_t* units)
+{
+	uint8_t* out = (uint8_t*)units;
+	for(int i=0; i<PAGE_N_UNITS; i++)
+	{
+		for(int b=0; b<PAGE_N_PLANES; b++)
+			out[i*PAGE_N_PLANES + b] = ((uint8_t*)page)[b*PAGE_N_UNITS + i];
+	}
+}
+
+static void units_to_page(map_unit_t* units, map_page_t* page)
+{
+	uint8_t* in = (uint8_t*)units;
+	for(int i=0; i<PAGE_N_UNITS; i++)
+	{
+		for(int b=0; b<PAGE_N_PLANES; b++)
+			((uint8_t*)page)[b*PAGE_N_UNITS + i] = in[i*PAGE_N_PLANES + b];
+	}
+}
+
+#else
+
+static void page_to_planes(map_page_t* page, uint8_t* planes)
+{
+	uint8_t* in = (uint8_t*)page;
+	for(int i=0; i<PAGE_N_UNITS; i++)
+	{
+		for(int b=0; b<PAGE_N_PLANES; b++)
+			planes[b*PAGE_N_UNITS + i] = in[i*PAGE_N_PLANES + b];
+	}
+}
+
+static void planes_to_page(uint8_t* planes, map_page_t* page)
+{
+	uint8_t* out = (uint8_t*)page;
+	for(int i=0; i<PAGE_N_UNITS; i++)
+	{
+		for(int b=0; b<PAGE_N_PLANES; b++)
+			out[i*PAGE_N_PLANES + b] = planes[b*PAGE_N_UNITS + i];
+	}
+}
+
+void map_page_to_units(map_page_t* page, map_unit_t* units)
+{
+	memcpy(units, page, sizeof(map_page_t));
+}
+
+#endif
+
+// Returns the number of bytes written to out, which must hold MAP_RLE_MAX_SIZE bytes.
+static int rle_encode(uint8_t* in, int len, uint8_t* out)
+{
+	int o = 0;
+	int lit_start = 0;
+	int i = 0;
+	while(i < len)
+	{
+		int run = 1;
+		while(i+run < len && run < MAP_RLE_MAX_RUN && in[i+run] == in[i])
+			run++;
+
+		if(run < MAP_RLE_MIN_RUN)
+		{
+			i += run;
+			continue;
+		}
+
+		// Flush the pending literals first.
+		while(lit_start < i)
+		{
+			int n = i - lit_start;
+			if(n > MAP_RLE_MAX_LITERAL) n = MAP_RLE_MAX_LITERAL;
+			out[o++] = n-1;
+			memcpy(&out[o], &in[lit_start], n);
+			o += n;
+			lit_start += n;
+		}
+
+		int l = run - MAP_RLE_MIN_RUN;
+		if(l < 0x7f)
+		{
+			out[o++] = 0x80 | l;
+		}
+		else
+		{
+			l -= 0x7f;
+			out[o++] = 0xff;
+			out[o++] = l&0xff;
+			out[o++] = (l>>8)&0xff;
+		}
+		out[o++] = in[i];
+
+		i += run;
+		lit_start = i;
+	}
+
+	while(lit_start < len)
+	{
+		int n = len - lit_start;
+		if(n > MAP_RLE_MAX_LITERAL) n = MAP_RLE_MAX_LITERAL;
+		out[o++] = n-1;
+		memcpy(&out[o], &in[lit_start], n);
+		o += n;
+		lit_start += n;
+	}
+
+	return o;
+}
+
+// Returns 0 if exactly out_len bytes were decoded.
+static int rle_decode(uint8_t* in, int in_len, uint8_t* out, int out_len)
+{
+	int i = 0, o = 0;
+	while(i < in_len)
+	{
+		int c = in[i++];
+		if(c < 0x80)
+		{
+			int n = c+1;
+			if(i+n > in_len || o+n > out_len)
+				return 1;
+			memcpy(&out[o], &in[i], n);
+			i += n;
+			o += n;
+		}
+		else
+		{
+			int n = (c&0x7f) + MAP_RLE_MIN_RUN;
+			if((c&0x7f) == 0x7f)
+			{
+				if(i+2 > in_len)
+					return 1;
+				n += in[i] | (in[i+1]<<8);
+				i += 2;
+			}
+			if(i+1 > in_len || o+n > out_len)
+				return 1;
+			memset(&out[o], in[i++], n);
+			o += n;
+		}
+	}
+
+	return (o == out_len)?0:1;
+}
+
+static void page_file_name(char* fname, uint32_t world_id, int pagex, int pagey, const char* ext)
+{
+	if(snprintf(fname, 1024, MAP_DIR"/%08x_%u_%u_%u.%s", robot_id, world_id, pagex, pagey, ext) > 1022)
+		fname[1023] = 0;
+}
+
+// CRC-32 (IEEE 802.3, as in zlib), four bits at a time to keep the table small. Start with crc = 0.
+static uint32_t crc32_update(uint32_t crc, const void* data, int len)
+{
+	static const uint32_t tbl[16] =
+	{
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+
+	const uint8_t* p = data;
+	crc = ~crc;
+	for(int i=0; i<len; i++)
+	{
+		crc ^= p[i];
+		crc = (crc >> 4) ^ tbl[crc & 15];
+		crc = (crc >> 4) ^ tbl[crc & 15];
+	}
+	return ~crc;
+}
+
+// Makes renames and removals in MAP_DIR durable.
+static void sync_map_dir()
+{
+	int fd = open(MAP_DIR, O_RDONLY);
+	if(fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+// A page file that fails its checksum is set aside, so that it isn't used as the base of new writes.
+static void set_aside_bad_page(const char* fname)
+{
+	char bad_name[1024+8];
+	snprintf(bad_name, sizeof(bad_name), "%s.bad", fname);
+	if(rename(fname, bad_name) < 0)
+		printf("WARN: renaming %s failed, errno=%d\n", fname, errno);
+	else
+		printf("WARN: map page %s is corrupted, moved it to %s\n", fname, bad_name);
+}
+
+uint8_t* encode_map_page(map_page_t* page, uint32_t generation, int* len, map_io_stats_t* st)
+{
+	double start_time = subsec_timestamp();
+
+	uint8_t* planes = malloc(sizeof(map_page_t));
+	uint8_t* buf = malloc(sizeof(map_page_hdr_t) + MAP_RLE_MAX_SIZE);
+	if(!planes || !buf)
+	{
+		printf("Error: out of memory writing map page\n");
+		free(planes); free(buf);
+		return NULL;
+	}
+
+	map_page_hdr_t* hdr = (map_page_hdr_t*)buf;
+	uint8_t* payload = buf + sizeof(map_page_hdr_t);
+
+	page_to_planes(page, planes);
+	int payload_len = rle_encode(planes, sizeof(map_page_t), payload);
+
+	hdr->magic = MAP_PAGE_MAGIC;
+	hdr->version = MAP_PAGE_VERSION;
+	hdr->codec = MAP_PAGE_CODEC_PLANAR_RLE;
+	hdr->raw_size = sizeof(map_page_t);
+	hdr->payload_size = payload_len;
+	hdr->generation = generation;
+
+	if(payload_len >= (int)sizeof(map_page_t))
+	{
+		// Incompressible - store as is.
+		hdr->codec = MAP_PAGE_CODEC_RAW;
+		hdr->payload_size = sizeof(map_page_t);
+		map_page_to_units(page, (map_unit_t*)payload);
+	}
+	hdr->crc = crc32_update(0, payload, hdr->payload_size);
+	st->encode_time += subsec_timestamp() - start_time;
+
+	free(planes);
+
+	*len = sizeof(map_page_hdr_t) + hdr->payload_size;
+	return buf;
+}
+
+static int write_page_file(uint32_t world_id, int pagex, int pagey, map_page_t* page, uint32_t generation, map_io_stats_t* st)
+{
+	char fname[1024], tmp_name[1024];
+	page_file_name(fname, world_id, pagex, pagey, "map");
+	page_file_name(tmp_name, world_id, pagex, pagey, "map.tmp");
+
+	printf("Info: writing map page %s\n", fname);
+
+	double start_time = subsec_timestamp();
+
+	int file_len;
+	uint8_t* buf = encode_map_page(page, generation, &file_len, st);
+	if(!buf)
+		return 1;
+
+	FILE *f = fopen(tmp_name, "w");
+	if(!f)
+	{
+		fprintf(stderr, "Error %d opening %s for write\n", errno, tmp_name);
+		free(buf);
+		return 1;
+	}
+
+	int ret = 0;
+	if(fwrite(buf, file_len, 1, f) != 1 || fflush(f) || fsync(fileno(f)) < 0)
+	{
+		printf("Error: Writing map data failed, errno=%d\n", errno);
+		ret = 1;
+	}
+	if(fclose(f))
+		ret = 1;
+	free(buf);
+
+	if(ret == 0 && rename(tmp_name, fname) < 0)
+	{
+		printf("Error: renaming %s failed, errno=%d\n", tmp_name, errno);
+		ret = 1;
+	}
+
+	if(ret)
+		unlink(tmp_name);
+	else
+	{
+		// The rename must be on the disk before the journal of the old generation is removed.
+		sync_map_dir();
+		st->pages_written++;
+		st->bytes_written += file_len;
+	}
+	st->write_time += subsec_timestamp() - start_time;
+
+	return ret;
+}
+
+// Reads the page file header. Returns 0 if ok, 1 if there is no valid header (old raw page, or a torn file).
+// Version 1 headers have no generation; they are generation 0. Versions 1 and 2 have no checksum.
+static int read_page_hdr(FILE* f, long file_len, map_page_hdr_t* hdr)
+{
+	memset(hdr, 0, sizeof(map_page_hdr_t));
+	if(file_len < MAP_PAGE_HDR_V1_SIZE || fread(hdr, MAP_PAGE_HDR_V1_SIZE, 1, f) != 1 || hdr->magic != MAP_PAGE_MAGIC)
+		return 1;
+
+	long hdr_size = MAP_PAGE_HDR_V1_SIZE;
+	if(hdr->version >= 2)
+	{
+		hdr_size = (hdr->version == 2)?MAP_PAGE_HDR_V2_SIZE:sizeof(map_page_hdr_t);
+		if(fread(&hdr->generation, hdr_size-MAP_PAGE_HDR_V1_SIZE, 1, f) != 1)
+			return 1;
+	}
+
+	return (file_len == hdr_size + (long)hdr->payload_size)?0:1;
+}
+
+// Returns 0 and the generation of the page file, or 2 if there is no page file.
+static int page_file_generation(uint32_t world_id, int pagex, int pagey, uint32_t* generation)
+{
+	char fname[1024];
+	page_file_name(fname, world_id, pagex, pagey, "map");
+
+	*generation = 0;
+	FILE* f = fopen(fname, "r");
+	if(!f)
+		return (errno == ENOENT)?2:1;
+
+	fseek(f, 0, SEEK_END);
+	long file_len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	map_page_hdr_t hdr;
+	if(read_page_hdr(f, file_len, &hdr) == 0)
+		*generation = hdr.generation;
+	// else: old raw page, generation 0
+
+	fclose(f);
+	return 0;
+}
+
+/*
+	Page journal
+
+	Mapping usually changes a few spots of a page at a time, but writing the page means encoding and writing
+	the whole 512 KB (tens of kB compressed) again. Instead, a sync appends only the changed tiles
+	(world_page_t.changed_tiles) to the page journal, <page>.jnl next to the .map file. The .map file is the checkpoint;
+	reading a page reads it and applies the journal records in order.
+
+	Records are the changed tiles, split into byte planes and run-length coded like the pages (a typical
+	record is a few hundred bytes). Records carry a CRC-32 (journal version 2 ->); a record cut short or garbled
+	by a crash or power loss ends the journal, and recover_map_dir() truncates it away at the next start, so
+	that new records don't end up behind it. Appends are not fsync()ed: a crash may lose the last records, but
+	never leaves the page inconsistent.
+
+	When the journal has grown over MAP_JNL_MAX_SIZE (or most of the page changed anyway), the whole page is
+	written as a new checkpoint with the next generation number, and the journal is removed. This compaction is
+	done by the persistence thread, like all writes. The journal header carries the generation of the checkpoint
+	it was written against; if the journal removal didn't happen (crash right after the checkpoint), the old
+	journal has the wrong generation and is ignored, instead of rolling the tiles back.
+
+	Clients fetching map files can fetch the journal too, to avoid downloading the whole page again.
+
+	-DMAP_NO_JOURNAL writes whole pages on every sync, as before.
+*/
+
+// Changing more tiles than this writes the whole page.
+#define MAP_JNL_MAX_TILES (3*MAP_TILES_PER_PAGE/4)
+
+#define TILE_N_UNITS (MAP_TILE_W*MAP_TILE_W)
+
+// Gathers the tiles in the mask into byte planes, like page_to_planes(); planes holds n_tiles*TILE_N_UNITS units.
+static void tiles_to_planes(map_page_t* page, uint64_t tiles, int n_tiles, uint8_t* planes)
+{
+	int n_units = n_tiles*TILE_N_UNITS;
+	int i = 0;
+	for(int t=0; t<MAP_TILES_PER_PAGE; t++)
+	{
+		if(!(tiles & (1ULL<<t)))
+			continue;
+
+		int tx = (t/MAP_TILES_PER_ROW)*MAP_TILE_W;
+		int ty = (t%MAP_TILES_PER_ROW)*MAP_TILE_W;
+		for(int x=tx; x<tx+MAP_TILE_W; x++)
+		{
+			for(int y=ty; y<ty+MAP_TILE_W; y++)
+			{
+				for(int b=0; b<PAGE_N_PLANES; b++)
+					planes[b*n_units + i] = PAGE_UNIT_BYTE(page, x, y, b);
+				i++;
+			}
+		}
+	}
+}
+
+static void planes_to_tiles(uint8_t* planes, uint64_t tiles, int n_tiles, map_page_t* page)
+{
+	int n_units = n_tiles*TILE_N_UNITS;
+	int i = 0;
+	for(int t=0; t<MAP_TILES_PER_PAGE; t++)
+	{
+		if(!(tiles & (1ULL<<t)))
+			continue;
+
+		int tx = (t/MAP_TILES_PER_ROW)*MAP_TILE_W;
+		int ty = (t%MAP_TILES_PER_ROW)*MAP_TILE_W;
+		for(int x=tx; x<tx+MAP_TILE_W; x++)
+		{
+			for(int y=ty; y<ty+MAP_TILE_W; y++)
+			{
+				for(int b=0; b<PAGE_N_PLANES; b++)
+					PAGE_UNIT_BYTE(page, x, y, b) = planes[b*n_units + i];
+				i++;
+			}
+		}
+	}
+}
+
+// Appends the tiles to the journal of the checkpoint base_generation.
+// Returns 0 if done, 2 if the page needs to be written in full instead (stale or too long journal), 1 on error.
+static int append_page_journal(uint32_t world_id, int pagex, int pagey, map_page_t* page, uint64_t tiles, uint32_t base_generation, map_io_stats_t* st)
+{
+	char fname[1024];
+	page_file_name(fname, world_id, pagex, pagey, "jnl");
+
+	double start_time = subsec_timestamp();
+
+	FILE* f = fopen(fname, "a+");
+	if(!f)
+	{
+		fprintf(stderr, "Error %d opening %s for append\n", errno, fname);
+		return 1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long jnl_len = ftell(f);
+	if(jnl_len >= MAP_JNL_MAX_SIZE)
+	{
+		fclose(f);
+		return 2;
+	}
+
+	long hdr_len = 0;
+	if(jnl_len == 0)
+	{
+		map_jnl_hdr_t jhdr = {.magic = MAP_JNL_MAGIC, .version = MAP_JNL_VERSION, .tile_w = MAP_TILE_W, .base_generation = base_generation};
+		if(fwrite(&jhdr, sizeof(jhdr), 1, f) != 1)
+		{
+			fclose(f);
+			return 1;
+		}
+		hdr_len = sizeof(jhdr);
+	}
+	else
+	{
+		map_jnl_hdr_t jhdr;
+		fseek(f, 0, SEEK_SET);
+		if(fread(&jhdr, sizeof(jhdr), 1, f) != 1 || jhdr.magic != MAP_JNL_MAGIC || jhdr.version != MAP_JNL_VERSION ||
+		   jhdr.base_generation != base_generation)
+		{
+			fclose(f);
+			return 2;
+		}
+	}
+
+	int n_tiles = __builtin_popcountll(tiles);
+	int raw_len = n_tiles*TILE_N_UNITS*PAGE_N_PLANES;
+	uint8_t* planes = malloc(raw_len);
+	uint8_t* buf = malloc(sizeof(map_jnl_rec_t) + MAP_RLE_MAX_SIZE);
+	if(!planes || !buf)
+	{
+		printf("Error: out of memory writing the map page journal\n");
+		free(planes); free(buf);
+		fclose(f);
+		return 1;
+	}
+
+	map_jnl_rec_t* rec = (map_jnl_rec_t*)buf;
+	uint8_t* payload = buf + sizeof(map_jnl_rec_t);
+
+	tiles_to_planes(page, tiles, n_tiles, planes);
+	int payload_len = rle_encode(planes, raw_len, payload);
+
+	rec->magic = MAP_JNL_REC_MAGIC;
+	rec->n_tiles = n_tiles;
+	rec->codec = MAP_PAGE_CODEC_PLANAR_RLE;
+	rec->tiles = tiles;
+	rec->payload_size = payload_len;
+	if(payload_len >= raw_len)
+	{
+		rec->codec = MAP_PAGE_CODEC_RAW;
+		rec->payload_size = raw_len;
+		memcpy(payload, planes, raw_len);
+	}
+	rec->crc = crc32_update(crc32_update(0, &rec->tiles, sizeof(rec->tiles)), payload, rec->payload_size);
+	st->encode_time += subsec_timestamp() - start_time;
+	free(planes);
+
+	int rec_len = sizeof(map_jnl_rec_t) + rec->payload_size;
+	int ret = 0;
+	if(fwrite(buf, rec_len, 1, f) != 1 || fflush(f))
+	{
+		printf("Error: Writing the map page journal failed, errno=%d\n", errno);
+		// Don't leave a partial record for the next appends to go after.
+		if(ftruncate(fileno(f), jnl_len) < 0)
+			printf("WARN: truncating %s failed, errno=%d\n", fname, errno);
+		ret = 1;
+	}
+	else
+	{
+		st->jnl_records++;
+		st->jnl_tiles += n_tiles;
+		st->jnl_bytes += hdr_len + rec_len;
+		st->bytes_written += hdr_len + rec_len;
+	}
+	if(fclose(f))
+		ret = 1;
+	free(buf);
+	st->write_time += subsec_timestamp() - start_time;
+	return ret;
+}
+
+// Reads the next journal record and its payload (MAP_RLE_MAX_SIZE bytes).
+// Returns 0 if ok, 1 at the end of the journal, 2 at a torn or corrupted record.
+static int read_jnl_rec(FILE* f, int version, map_jnl_rec_t* rec, uint8_t* payload, map_io_stats_t* st)
+{
+	memset(rec, 0, sizeof(map_jnl_rec_t));
+	int rec_size = (version >= 2)?sizeof(map_jnl_rec_t):MAP_JNL_REC_V1_SIZE;
+	size_t got = fread(rec, 1, rec_size, f);
+	if(got == 0)
+		return 1;
+
+	if(got != (size_t)rec_size || rec->magic != MAP_JNL_REC_MAGIC || rec->n_tiles != __builtin_popcountll(rec->tiles) ||
+	   rec->payload_size > MAP_RLE_MAX_SIZE || (rec->codec != MAP_PAGE_CODEC_RAW && rec->codec != MAP_PAGE_CODEC_PLANAR_RLE))
+		return 2;
+
+	if(rec->payload_size && fread(payload, rec->payload_size, 1, f) != 1)
+		return 2;
+
+	if(version >= 2 && rec->crc != crc32_update(crc32_update(0, &rec->tiles, sizeof(rec->tiles)), payload, rec->payload_size))
+	{
+		st->crc_errors++;
+		return 2;
+	}
+
+	return 0;
+}
+
+// Applies the journal records on a page just read from its checkpoint.
+static void apply_page_journal(uint32_t world_id, int pagex, int pagey, map_page_t* page, uint32_t base_generation, map_io_stats_t* st)
+{
+	char fname[1024];
+	page_file_name(fname, world_id, pagex, pagey, "jnl");
+
+	FILE* f = fopen(fname, "r");
+	if(!f)
+		return;
+
+	map_jnl_hdr_t jhdr;
+	if(fread(&jhdr, sizeof(jhdr), 1, f) != 1 || jhdr.magic != MAP_JNL_MAGIC || jhdr.version > MAP_JNL_VERSION || jhdr.tile_w != MAP_TILE_W)
+	{
+		printf("WARN: ignoring invalid map page journal %s\n", fname);
+		fclose(f);
+		return;
+	}
+
+	if(jhdr.base_generation != base_generation)
+	{
+		printf("Info: ignoring stale map page journal %s (generation %u, page is %u)\n", fname, jhdr.base_generation, base_generation);
+		fclose(f);
+		return;
+	}
+
+	uint8_t* payload = malloc(MAP_RLE_MAX_SIZE);
+	uint8_t* planes = malloc(sizeof(map_page_t));
+	if(!payload || !planes)
+	{
+		printf("Error: out of memory reading the map page journal\n");
+		free(payload); free(planes);
+		fclose(f);
+		return;
+	}
+
+	long bytes = sizeof(jhdr);
+	map_jnl_rec_t rec;
+	int rec_ret;
+	while((rec_ret = read_jnl_rec(f, jhdr.version, &rec, payload, st)) == 0)
+	{
+		int raw_len = rec.n_tiles*TILE_N_UNITS*PAGE_N_PLANES;
+
+		double decode_start = subsec_timestamp();
+		if(rec.codec == MAP_PAGE_CODEC_RAW)
+		{
+			if(rec.payload_size != raw_len)
+			{
+				printf("WARN: corrupted record in map page journal %s, ignoring the rest\n", fname);
+				break;
+			}
+			memcpy(planes, payload, raw_len);
+		}
+		else if(rle_decode(payload, rec.payload_size, planes, raw_len))
+		{
+			printf("WARN: corrupted record in map page journal %s, ignoring the rest\n", fname);
+			break;
+		}
+		planes_to_tiles(planes, rec.tiles, rec.n_tiles, page);
+		st->decode_time += subsec_timestamp() - decode_start;
+
+		st->jnl_replayed++;
+		bytes = ftell(f);
+	}
+
+	if(rec_ret == 2)
+		printf("WARN: map page journal %s ends in a torn or corrupted record, ignoring it\n", fname);
+
+	st->bytes_read += bytes;
+	free(payload);
+	free(planes);
+	fclose(f);
+}
+
+// Writes the changed tiles of a page to the journal, or the whole page, see above. Statistics go to st.
+// Writes the whole page with the generation, replacing the journal.
+static int write_checkpoint(uint32_t world_id, int pagex, int pagey, map_page_t* page, uint32_t generation, map_io_stats_t* st)
+{
+	if(write_page_file(world_id, pagex, pagey, page, generation, st))
+		return 1;
+
+	// The journal has been folded into the new checkpoint.
+	char fname[1024];
+	page_file_name(fname, world_id, pagex, pagey, "jnl");
+	if(unlink(fname) < 0 && errno != ENOENT)
+		printf("WARN: removing map page journal %s failed, errno=%d\n", fname, errno);
+
+	return 0;
+}
+
+static int persist_page(uint32_t world_id, int pagex, int pagey, map_page_t* page, uint64_t tiles, map_io_stats_t* st)
+{
+	if(!tiles)
+		return 0;
+
+	st->page_syncs++;
+
+	uint32_t base_generation;
+	int have_base = (page_file_generation(world_id, pagex, pagey, &base_generation) == 0);
+
+#ifndef MAP_NO_JOURNAL
+	if(have_base && __builtin_popcountll(tiles) <= MAP_JNL_MAX_TILES)
+	{
+		int ret = append_page_journal(world_id, pagex, pagey, page, tiles, base_generation, st);
+		if(ret == 0)
+			return 0;
+		if(ret == 2)
+			st->jnl_compactions++;
+	}
+#endif
+
+	return write_checkpoint(world_id, pagex, pagey, page, have_base?(base_generation+1):1, st);
+}
+
+static int read_page_data(uint32_t world_id, int pagex, int pagey, map_page_t* page, map_io_stats_t* st);
+
+int read_stored_map_page(uint32_t world_id, int pagex, int pagey, map_page_t* page, map_io_stats_t* st)
+{
+	return read_page_data(world_id, pagex, pagey, page, st);
+}
+
+int write_stored_map_page(uint32_t world_id, int pagex, int pagey, map_page_t* page, map_io_stats_t* st)
+{
+	uint32_t base_generation;
+	int have_base = (page_file_generation(world_id, pagex, pagey, &base_generation) == 0);
+	return write_checkpoint(world_id, pagex, pagey, page, have_base?(base_generation+1):1, st);
+}
 
 int write_map_page(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	uint64_t tiles = wp->changed ? wp->changed_tiles : ~0ULL;
+	int ret = persist_page(w->id, pagex, pagey, map_page(w, pagex, pagey), tiles, &map_io_stats);
+	clear_page_changed(w, pagex, pagey);
+	return ret;
+}
+
+/*
+	Startup recovery
+
+	Called once at startup, before any page is loaded. With the atomic page writes, a crash can leave behind:
+	- <page>.map.tmp files of interrupted writes: removed; the .map file is the previous, intact version.
+	- Journals with a torn or garbled last record: truncated after the last good record.
+	- Journals of an older generation (crash between a full write and the journal removal) or without a page: removed.
+	- Page files from before the atomic writes, cut short: set aside as .map.bad.
+
+	Only the page headers (24 bytes) and the journals (at most MAP_JNL_MAX_SIZE) are read, so this takes a
+	fraction of a second even with thousands of pages. The page checksums are checked when the pages are read.
+*/
+
+// Checks the page file header and size. Returns 0 if valid, 2 if there is no page file, 1 if it's broken.
+static int check_page_file(uint32_t world_id, int pagex, int pagey, uint32_t* generation)
+{
+	char fname[1024];
+	page_file_name(fname, world_id, pagex, pagey, "map");
+
+	*generation = 0;
+	FILE* f = fopen(fname, "r");
+	if(!f)
+		return (errno == ENOENT)?2:1;
+
+	fseek(f, 0, SEEK_END);
+	long file_len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	map_page_hdr_t hdr;
+	int ret = 1;
+	if(read_page_hdr(f, file_len, &hdr) == 0)
+	{
+		if(hdr.version <= MAP_PAGE_VERSION && hdr.raw_size == sizeof(map_page_t))
+		{
+			*generation = hdr.generation;
+			ret = 0;
+		}
+	}
+	else if(file_len == sizeof(map_page_t))
+		ret = 0; // old raw page
+
+	fclose(f);
+	return ret;
+}
+
+// Returns 0 if the journal is fine, 1 if it was removed, 2 if truncated.
+static int check_page_journal(uint32_t world_id, int pagex, int pagey, uint8_t* payload)
+{
+	char fname[1024];
+	page_file_name(fname, world_id, pagex, pagey, "jnl");
+
+	uint32_t generation;
+	int base_ok = (check_page_file(world_id, pagex, pagey, &generation) == 0);
+
+	FILE* f = fopen(fname, "r+");
+	if(!f)
+		return 0;
+
+	map_jnl_hdr_t jhdr;
+	if(!base_ok || fread(&jhdr, sizeof(jhdr), 1, f) != 1 || jhdr.magic != MAP_JNL_MAGIC || jhdr.version > MAP_JNL_VERSION ||
+	   jhdr.tile_w != MAP_TILE_W || jhdr.base_generation != generation)
+	{
+		fclose(f);
+		printf("Info: removing stale or invalid map page journal %s\n", fname);
+		if(unlink(fname) < 0)
+			printf("WARN: removing %s failed, errno=%d\n", fname, errno);
+		return 1;
+	}
+
+	map_jnl_rec_t rec;
+	map_io_stats_t st = {0};
+	long good_len = sizeof(jhdr);
+	int rec_ret;
+	while((rec_ret = read_jnl_rec(f, jhdr.version, &rec, payload, &st)) == 0)
+		good_len = ftell(f);
+
+	if(rec_ret == 2)
+	{
+		printf("Info: map page journal %s has a torn or corrupted tail, truncating to %ld bytes\n", fname, good_len);
+		if(ftruncate(fileno(f), good_len) < 0)
+			printf("WARN: truncating %s failed, errno=%d\n", fname, errno);
+	}
+	fclose(f);
+	return (rec_ret == 2)?2:0;
+}
+
+int recover_map_dir()
+{
+	double start_time = subsec_timestamp();
+
+	DIR* d = opendir(MAP_DIR);
+	if(!d)
+	{
+		printf("ERROR: cannot open MAP_DIR (%s), errno=%d\n", MAP_DIR, errno);
+		return 0;
+	}
+
+	uint8_t* payload = malloc(MAP_RLE_MAX_SIZE);
+	if(!payload)
+	{
+		printf("Error: out of memory checking the map directory\n");
+		closedir(d);
+		return 0;
+	}
+
+	int n_pages = 0, n_journals = 0;
+	int n_tmp_removed = 0, n_pages_bad = 0, n_jnl_removed = 0, n_jnl_truncated = 0;
+	struct dirent* e;
+	while((e = readdir(d)))
+	{
+		uint32_t id, world_id;
+		int pagex, pagey;
+		char ext[16];
+		if(sscanf(e->d_name, "%x_%u_%d_%d.%15s", &id, &world_id, &pagex, &pagey, ext) != 5 || id != robot_id ||
+		   pagex < 0 || pagex >= MAP_W || pagey < 0 || pagey >= MAP_W)
+			continue;
+
+		char fname[1024];
+		if(strcmp(ext, "map.tmp") == 0)
+		{
+			page_file_name(fname, world_id, pagex, pagey, "map.tmp");
+			if(unlink(fname) == 0)
+				n_tmp_removed++;
+		}
+		else if(strcmp(ext, "map") == 0)
+		{
+			n_pages++;
+			uint32_t generation;
+			if(check_page_file(world_id, pagex, pagey, &generation) == 1)
+			{
+				page_file_name(fname, world_id, pagex, pagey, "map");
+				set_aside_bad_page(fname);
+				n_pages_bad++;
+			}
+		}
+		else if(strcmp(ext, "jnl") == 0)
+		{
+			n_journals++;
+			int ret = check_page_journal(world_id, pagex, pagey, payload);
+			if(ret == 1) n_jnl_removed++;
+			if(ret == 2) n_jnl_truncated++;
+		}
+	}
+	closedir(d);
+	free(payload);
+
+	int n_repaired = n_tmp_removed + n_pages_bad + n_jnl_removed + n_jnl_truncated;
+	if(n_repaired)
+		sync_map_dir();
+
+	printf("Info: map directory check: %d pages, %d journals in %.0f ms; removed %d temporary files, set aside %d broken pages, "
+		"removed %d stale journals, truncated %d journals\n", n_pages, n_journals, 1000.0*(subsec_timestamp()-start_time),
+		n_tmp_removed, n_pages_bad, n_jnl_removed, n_jnl_truncated);
+
+	return n_repaired;
+}
+
+/*
+	Write-behind persistence and batched I/O
+
+	Writing a page (encoding + fopen/fwrite/fclose on an SD card) can take tens of milliseconds, and a sync
+	may write dozens of pages. With the persistence threads running, the main thread only copies the page into
+	a snapshot slot of the queue, and mapping can continue to modify the live page right away.
+
+	Memory use is bounded by MAP_PERSIST_QUEUE_LEN snapshots: if the queue is full, the main thread waits for
+	a free slot. A page which is already waiting in the queue is overwritten in place, instead of queuing it
+	twice. Reads check the queue first, so that a page unloaded and then loaded again before it hit the disk
+	comes from the newest snapshot.
+
+	There are MAP_IO_THREADS worker threads, so that the SD card and the kernel see several requests at once,
+	and the encoding and decoding runs on several cores. The same workers serve read batches: load_9pages()
+	and load_25pages() hand all the pages they need from the disk over at once (read_map_pages_batch()), and
+	wait until all are read. Reads go before the queued writes, as the main thread is waiting for them.
+	Two writes of the same page are never in flight at the same time, so that the writes of a page stay in order.
+
+	flush_map_pages() is the barrier: when it returns, everything queued so far is on disk. Without the threads
+	(init_map_persistence() not called), reads and writes are done synchronously, as before.
+
+	The workers collect their statistics per page and add them to map_io_stats under the mutex.
+*/
+
+#define MAP_PERSIST_QUEUE_LEN 8
+
+#define SLOT_FREE      0
+#define SLOT_PENDING   1
+#define SLOT_IN_FLIGHT 2
+
+typedef struct
+{
+	int state;
+	uint32_t seq; // FIFO order
+	uint32_t world_id;
+	int pagex;
+	int pagey;
+	uint64_t tiles; // changed tiles
+	map_page_t* snapshot; // allocated on first use, kept
+} persist_slot_t;
+
+typedef struct
+{
+	uint32_t world_id;
+	int pagex;
+	int pagey;
+	map_page_t* page;
+	int ret;
+	map_io_stats_t st;
+} read_job_t;
+
+static persist_slot_t persist_queue[MAP_PERSIST_QUEUE_LEN];
+static int persist_running, persist_quit; // persist_running = number of worker threads
+static pthread_t persist_threads[MAP_IO_THREADS];
+static pthread_mutex_t persist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t persist_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t persist_done_cond = PTHREAD_COND_INITIALIZER;
+
+// Read batch being worked on, if any
+static read_job_t* read_batch;
+static int read_batch_len, read_batch_next, read_batch_done;
+
+static int persist_n_busy()
+{
+	int n = 0;
+	for(int i=0; i<MAP_PERSIST_QUEUE_LEN; i++)
+		if(persist_queue[i].state != SLOT_FREE) n++;
+	return n;
+}
+
+static int persist_page_in_flight(persist_slot_t* s)
+{
+	for(int i=0; i<MAP_PERSIST_QUEUE_LEN; i++)
+	{
+		persist_slot_t* q = &persist_queue[i];
+		if(q->state == SLOT_IN_FLIGHT && q->world_id == s->world_id && q->pagex == s->pagex && q->pagey == s->pagey)
+			return 1;
+	}
+	return 0;
+}
+
+static void add_write_stats(map_io_stats_t* st)
+{
+	map_io_stats.pages_written += st->pages_written;
+	map_io_stats.bytes_written += st->bytes_written;
+	map_io_stats.write_time += st->write_time;
+	map_io_stats.encode_time += st->encode_time;
+	map_io_stats.page_syncs += st->page_syncs;
+	map_io_stats.jnl_records += st->jnl_records;
+	map_io_stats.jnl_tiles += st->jnl_tiles;
+	map_io_stats.jnl_bytes += st->jnl_bytes;
+	map_io_stats.jnl_compactions += st->jnl_compactions;
+}
+
+static void* persist_thread_func(void* arg)
+{
+	pthread_mutex_lock(&persist_mutex);
+	while(1)
+	{
+		if(read_batch_next < read_batch_len)
+		{
+			read_job_t* j = &read_batch[read_batch_next++];
+			pthread_mutex_unlock(&persist_mutex);
+
+			j->ret = read_page_data(j->world_id, j->pagex, j->pagey, j->page, &j->st);
+
+			pthread_mutex_lock(&persist_mutex);
+			read_batch_done++;
+			pthread_cond_broadcast(&persist_done_cond);
+			continue;
+		}
+
+		int oldest = -1;
+		for(int i=0; i<MAP_PERSIST_QUEUE_LEN; i++)
+		{
+			if(persist_queue[i].state == SLOT_PENDING && (oldest < 0 || (int32_t)(persist_queue[i].seq - persist_queue[oldest].seq) < 0) &&
+			   !persist_page_in_flight(&persist_queue[i]))
+				oldest = i;
+		}
+
+		if(oldest < 0)
+		{
+			if(persist_quit)
+				break;
+			pthread_cond_wait(&persist_work_cond, &persist_mutex);
+			continue;
+		}
+
+		persist_slot_t* s = &persist_queue[oldest];
+		s->state = SLOT_IN_FLIGHT;
+		pthread_mutex_unlock(&persist_mutex);
+
+		map_io_stats_t st = {0};
+		if(persist_page(s->world_id, s->pagex, s->pagey, s->snapshot, s->tiles, &st))
+			printf("Error: writing map page (%d,%d) to disk failed\n", s->pagex, s->pagey);
+
+		pthread_mutex_lock(&persist_mutex);
+		add_write_stats(&st);
+		s->state = SLOT_FREE;
+		pthread_cond_broadcast(&persist_done_cond);
+		// A write of the same page may have been waiting for this one.
+		pthread_cond_broadcast(&persist_work_cond);
+	}
+	pthread_mutex_unlock(&persist_mutex);
+	return NULL;
+}
+
+int init_map_persistence()
+{
+	if(persist_running)
+		return 0;
+
+	persist_quit = 0;
+	for(int i=0; i<MAP_IO_THREADS; i++)
+	{
+		int ret;
+		if( (ret = pthread_create(&persist_threads[i], NULL, persist_thread_func, NULL)) )
+		{
+			printf("ERROR: map I/O thread creation, ret = %d - %s\n", ret, persist_running?"running with fewer threads":"writing map pages synchronously");
+			return persist_running?0:1;
+		}
+		persist_running++;
+	}
+	return 0;
+}
+
+#ifndef MAP_STORE_MMAP
+static void add_read_stats(map_io_stats_t* st)
+{
+	map_io_stats.pages_read += st->pages_read;
+	map_io_stats.bytes_read += st->bytes_read;
+	map_io_stats.read_time += st->read_time;
+	map_io_stats.decode_time += st->decode_time;
+	map_io_stats.jnl_replayed += st->jnl_replayed;
+	map_io_stats.crc_errors += st->crc_errors;
+	map_io_stats.archive_reads += st->archive_reads;
+}
+
+// Reads the pages with the worker threads, or one by one if they are not running. Fills in job->ret.
+static void read_map_pages_batch(read_job_t* jobs, int n_jobs)
+{
+	if(!persist_running || n_jobs < 2)
+	{
+		for(int i=0; i<n_jobs; i++)
+		{
+			jobs[i].ret = read_page_data(jobs[i].world_id, jobs[i].pagex, jobs[i].pagey, jobs[i].page, &map_io_stats);
+		}
+		return;
+	}
+
+	for(int i=0; i<n_jobs; i++)
+		memset(&jobs[i].st, 0, sizeof(map_io_stats_t));
+
+	pthread_mutex_lock(&persist_mutex);
+	read_batch = jobs;
+	read_batch_len = n_jobs;
+	read_batch_next = read_batch_done = 0;
+	pthread_cond_broadcast(&persist_work_cond);
+	while(read_batch_done < n_jobs)
+		pthread_cond_wait(&persist_done_cond, &persist_mutex);
+	read_batch = NULL;
+	read_batch_len = read_batch_next = read_batch_done = 0;
+	pthread_mutex_unlock(&persist_mutex);
+
+	for(int i=0; i<n_jobs; i++)
+		add_read_stats(&jobs[i].st);
+}
+#endif
+
+void flush_map_pages()
+{
+	double start_time = subsec_timestamp();
+
+#ifdef MAP_STORE_MMAP
+	mmstore_flush();
+#endif
+
+	if(persist_running)
+	{
+		pthread_mutex_lock(&persist_mutex);
+		while(persist_n_busy() > 0)
+			pthread_cond_wait(&persist_done_cond, &persist_mutex);
+		pthread_mutex_unlock(&persist_mutex);
+	}
+	map_io_stats.queue_wait_time += subsec_timestamp() - start_time;
+}
+
+void stop_map_persistence()
+{
+	flush_map_pages();
+
+	if(!persist_running)
+		return;
+
+	pthread_mutex_lock(&persist_mutex);
+	persist_quit = 1;
+	pthread_cond_broadcast(&persist_work_cond);
+	pthread_mutex_unlock(&persist_mutex);
+
+	for(int i=0; i<persist_running; i++)
+		pthread_join(persist_threads[i], NULL);
+	persist_running = 0;
+
+	for(int i=0; i<MAP_PERSIST_QUEUE_LEN; i++)
+	{
+		free(persist_queue[i].snapshot);
+		persist_queue[i].snapshot = NULL;
+	}
+}
+
+#ifndef MAP_STORE_MMAP
+static uint32_t persist_seq;
+
+// Copies the page to the write queue, or writes it right away if the persistence thread is not running.
+static int queue_map_page(world_t* w, int pagex, int pagey)
+{
+	if(!persist_running)
+		return write_map_page(w, pagex, pagey);
+
+	double start_time = subsec_timestamp();
+	pthread_mutex_lock(&persist_mutex);
+
+	persist_slot_t* s = NULL;
+	while(1)
+	{
+		// Page already waiting (not yet being written)? Overwrite it.
+		for(int i=0; i<MAP_PERSIST_QUEUE_LEN; i++)
+		{
+			persist_slot_t* q = &persist_queue[i];
+			if(q->state == SLOT_PENDING && q->world_id == w->id && q->pagex == pagex && q->pagey == pagey)
+			{
+				s = q;
+				map_io_stats.pages_coalesced++;
+				break;
+			}
+		}
+
+		if(!s)
+		{
+			for(int i=0; i<MAP_PERSIST_QUEUE_LEN; i++)
+			{
+				if(persist_queue[i].state == SLOT_FREE)
+				{
+					s = &persist_queue[i];
+					break;
+				}
+			}
+		}
+
+		if(s)
+			break;
+
+		pthread_cond_wait(&persist_done_cond, &persist_mutex);
+	}
+
+	if(!s->snapshot)
+	{
+		s->snapshot = malloc(sizeof(map_page_t));
+		if(!s->snapshot)
+		{
+			pthread_mutex_unlock(&persist_mutex);
+			printf("Error: out of memory for the map page write queue - writing synchronously\n");
+			return write_map_page(w, pagex, pagey);
+		}
+	}
+
+	memcpy(s->snapshot, map_page(w, pagex, pagey), sizeof(map_page_t));
+	if(s->state == SLOT_FREE)
+	{
+		s->world_id = w->id;
+		s->pagex = pagex;
+		s->pagey = pagey;
+		s->tiles = 0;
+		s->seq = persist_seq++;
+		s->state = SLOT_PENDING;
+		map_io_stats.pages_queued++;
+	}
+	s->tiles |= find_world_page(w, pagex, pagey)->changed_tiles;
+	clear_page_changed(w, pagex, pagey);
+
+	pthread_cond_signal(&persist_work_cond);
+	pthread_mutex_unlock(&persist_mutex);
+	map_io_stats.queue_wait_time += subsec_timestamp() - start_time;
+	return 0;
+}
+#endif
+
+// If the page is still in the write queue, copies the newest snapshot instead of reading the disk. Returns 1 if found.
+static int read_from_persist_queue(world_t* w, int pagex, int pagey)
+{
+	if(!persist_running)
+		return 0;
+
+	pthread_mutex_lock(&persist_mutex);
+	persist_slot_t* newest = NULL;
+	for(int i=0; i<MAP_PERSIST_QUEUE_LEN; i++)
+	{
+		persist_slot_t* q = &persist_queue[i];
+		if(q->state != SLOT_FREE && q->world_id == w->id && q->pagex == pagex && q->pagey == pagey &&
+		   (!newest || (int32_t)(q->seq - newest->seq) > 0))
+			newest = q;
+	}
+
+	if(newest)
+		memcpy(map_page(w, pagex, pagey), newest->snapshot, sizeof(map_page_t));
+	pthread_mutex_unlock(&persist_mutex);
+
+	return newest?1:0;
+}
+
+// Reads the page file and its journal into page. Statistics go to st, so that this can be used from any thread.
+#ifndef MAP_STORE_MMAP
+// Returns 1 if the page is in the write queue (pending or being written).
+static int page_in_persist_queue(uint32_t world_id, int pagex, int pagey)
+{
+	int found = 0;
+	pthread_mutex_lock(&persist_mutex);
+	for(int i=0; i<MAP_PERSIST_QUEUE_LEN; i++)
+	{
+		persist_slot_t* q = &persist_queue[i];
+		if(q->state != SLOT_FREE && q->world_id == world_id && q->pagex == pagex && q->pagey == pagey)
+			found = 1;
+	}
+	pthread_mutex_unlock(&persist_mutex);
+	return found;
+}
+#endif
+
+// Reads a page stored as is (the map_unit_t array) into the page. Returns 0 if ok, and the CRC-32 of the data.
+static int read_raw_page(FILE* f, map_page_t* page, uint32_t* crc)
+{
+#ifdef MAP_PAGE_PLANAR
+	map_unit_t* units = malloc(sizeof(map_page_t));
+	if(!units)
+		return 1;
+	int ret = (fread(units, sizeof(map_page_t), 1, f) != 1);
+	if(ret == 0)
+	{
+		*crc = crc32_update(0, units, sizeof(map_page_t));
+		units_to_page(units, page);
+	}
+	free(units);
+	return ret;
+#else
+	if(fread(page, sizeof(map_page_t), 1, f) != 1)
+		return 1;
+	*crc = crc32_update(0, page, sizeof(map_page_t));
+	return 0;
+#endif
+}
+
+int decode_map_page(FILE* f, long len, map_page_t* page, map_page_hdr_t* hdr, const char* name, map_io_stats_t* st)
+{
+	long start = ftell(f);
+	int is_compressed = 0;
+	if(read_page_hdr(f, len, hdr) == 0)
+		is_compressed = 1;
+	else
+	{
+		hdr->generation = 0;
+		fseek(f, start, SEEK_SET);
+	}
+
+	int ret = 0;
+	if(!is_compressed)
+	{
+		// Old raw page
+		uint32_t crc;
+		if(len != sizeof(map_page_t) || read_raw_page(f, page, &crc))
+		{
+			printf("Error: Reading map data failed\n");
+			ret = 1;
+		}
+	}
+	else if(hdr->version > MAP_PAGE_VERSION || hdr->raw_size != sizeof(map_page_t) ||
+	        (hdr->codec != MAP_PAGE_CODEC_RAW && hdr->codec != MAP_PAGE_CODEC_PLANAR_RLE))
+	{
+		printf("Error: Unsupported map page format (version %u, codec %u, raw_size %u) in %s\n", hdr->version, hdr->codec, hdr->raw_size, name);
+		ret = 1;
+	}
+	else if(hdr->codec == MAP_PAGE_CODEC_RAW)
+	{
+		uint32_t crc;
+		if(hdr->payload_size != sizeof(map_page_t) || read_raw_page(f, page, &crc))
+		{
+			printf("Error: Reading map data failed\n");
+			ret = 1;
+		}
+		else if(hdr->version >= 3 && hdr->crc != crc)
+		{
+			memset(page, 0, sizeof(map_page_t));
+			ret = 3;
+		}
+	}
+	else
+	{
+		uint8_t* payload = malloc(hdr->payload_size);
+		uint8_t* planes = malloc(sizeof(map_page_t));
+		if(!payload || !planes)
+		{
+			printf("Error: out of memory reading map page\n");
+			ret = 1;
+		}
+		else if(hdr->payload_size && fread(payload, hdr->payload_size, 1, f) != 1)
+		{
+			printf("Error: Reading map data failed\n");
+			ret = 1;
+		}
+		else if(hdr->version >= 3 && hdr->crc != crc32_update(0, payload, hdr->payload_size))
+		{
+			ret = 3;
+		}
+		else
+		{
+			double decode_start = subsec_timestamp();
+			if(rle_decode(payload, hdr->payload_size, planes, sizeof(map_page_t)))
+			{
+				printf("Error: Corrupted map page %s\n", name);
+				ret = 1;
+			}
+			else
+				planes_to_page(planes, page);
+			st->decode_time += subsec_timestamp() - decode_start;
+		}
+		free(payload);
+		free(planes);
+	}
+
+	return ret;
+}
+
+static int read_page_data(uint32_t world_id, int pagex, int pagey, map_page_t* page, map_io_stats_t* st)
 {
 	char fname[1024];
+	page_file_name(fname, world_id, pagex, pagey, "map");
 
-	if(snprintf(fname, 1024, MAP_DIR"/%08x_%u_%u_%u.map", robot_id, w->id, pagex, pagey) > 1022)
-		fname[1023] = 0;
-
-	printf("Info: writing map page %s\n", fname);
+	//printf("Info: Attempting to read map page %s\n", fname);
 
-	FILE *f = fopen(fname, "w");
+	double start_time = subsec_timestamp();
+	FILE *f = fopen(fname, "r");
 	if(!f)
 	{
-		fprintf(stderr, "Error %d opening %s for write\n", errno, fname);
+		if(errno == ENOENT)
+		{
+			// Not changed since the world was deployed - or new.
+			int ret = archive_read_page(world_id, pagex, pagey, page, st);
+			st->read_time += subsec_timestamp() - start_time;
+			return ret;
+		}
+		fprintf(stderr, "Error %d opening %s for read\n", errno, fname);
 		return 1;
 	}
 
-	if(fwrite(w->pages[pagex][pagey], sizeof(map_page_t), 1, f) != 1)
+	fseek(f, 0, SEEK_END);
+	long file_len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	map_page_hdr_t hdr;
+	int ret = decode_map_page(f, file_len, page, &hdr, fname, st);
+	fclose(f);
+
+	if(ret == 3)
 	{
-		printf("Error: Writing map data failed\n");
+		st->crc_errors++;
+		set_aside_bad_page(fname);
+		ret = 1;
 	}
-	fclose(f);
-	w->changed[pagex][pagey] = 0;
 
-	return 0;
+	if(ret == 0)
+	{
+		st->pages_read++;
+		st->bytes_read += file_len;
+		apply_page_journal(world_id, pagex, pagey, page, hdr.generation, st);
+	}
+
+	st->read_time += subsec_timestamp() - start_time;
+	return ret;
 }
 
-int read_map_page(world_t* w, int pagex, int pagey)
+/*
+	Page prefetching
+
+	load_25pages() is called for every lidar scan, and when the robot crosses into a new page, it reads a whole
+	row of new pages from the disk, stalling the main loop. prefetch_ahead() predicts where the robot will be
+	in the next MAP_PREFETCH_HORIZON seconds, from the speed along the heading and from the route being followed,
+	and asks the prefetch thread to read the pages the load_25pages() window will need there. Reading a page
+	then finds it already decoded in a prefetch slot, and only copies it.
+
+	Only pages which are not loaded and not waiting in the write queue are prefetched; a page can't change on
+	disk while it's in a prefetch slot, because changing it needs loading it first, which takes it from the slot.
+	If the page is still being read when it's needed, the main thread waits for it - that's still a head start.
+
+	Prefetching is off until init_map_prefetch(). With MAP_STORE_MMAP, the kernel does the reading: the page
+	slots are given to posix_fadvise(POSIX_FADV_WILLNEED) instead, and there is no thread.
+*/
+
+#define MAP_PREFETCH_SLOTS 12
+
+typedef struct
 {
-	char fname[1024];
-	if(snprintf(fname, 1024, MAP_DIR"/%08x_%u_%u_%u.map", robot_id, w->id, pagex, pagey) > 1022)
-		fname[1023] = 0;
+	int state;
+	uint32_t seq;
+	uint32_t world_id;
+	int pagex;
+	int pagey;
+	int ret; // read_page_data() result
+	map_page_t* page; // allocated on first use, kept
+} prefetch_slot_t;
 
-	//printf("Info: Attempting to read map page %s\n", fname);
+map_prefetch_stats_t map_prefetch_stats;
 
-	w->changed[pagex][pagey] = 0;
+#ifndef MAP_STORE_MMAP
+#define PREFETCH_FREE      0
+#define PREFETCH_REQUESTED 1
+#define PREFETCH_IN_FLIGHT 2
+#define PREFETCH_READY     3
 
-	FILE *f = fopen(fname, "r");
-	if(!f)
+static prefetch_slot_t prefetch_slots[MAP_PREFETCH_SLOTS];
+static int prefetch_running, prefetch_quit;
+static uint32_t prefetch_seq;
+static pthread_t prefetch_thread;
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t prefetch_done_cond = PTHREAD_COND_INITIALIZER;
+
+static void* prefetch_thread_func(void* arg)
+{
+	pthread_mutex_lock(&prefetch_mutex);
+	while(1)
 	{
-		if(errno == ENOENT)
-			return 2;
-		fprintf(stderr, "Error %d opening %s for read\n", errno, fname);
+		int oldest = -1;
+		for(int i=0; i<MAP_PREFETCH_SLOTS; i++)
+		{
+			if(prefetch_slots[i].state == PREFETCH_REQUESTED && (oldest < 0 || (int32_t)(prefetch_slots[i].seq - prefetch_slots[oldest].seq) < 0))
+				oldest = i;
+		}
+
+		if(oldest < 0)
+		{
+			if(prefetch_quit)
+				break;
+			pthread_cond_wait(&prefetch_work_cond, &prefetch_mutex);
+			continue;
+		}
+
+		prefetch_slot_t* s = &prefetch_slots[oldest];
+		s->state = PREFETCH_IN_FLIGHT;
+		pthread_mutex_unlock(&prefetch_mutex);
+
+		map_io_stats_t st = {0};
+		int skip = page_in_persist_queue(s->world_id, s->pagex, s->pagey);
+		if(!skip)
+		{
+			memset(s->page, 0, sizeof(map_page_t));
+			s->ret = read_page_data(s->world_id, s->pagex, s->pagey, s->page, &st);
+		}
+
+		pthread_mutex_lock(&prefetch_mutex);
+		if(skip)
+		{
+			// Newer data in the write queue; the normal read path will get it.
+			s->state = PREFETCH_FREE;
+			map_prefetch_stats.skipped++;
+		}
+		else
+		{
+			s->state = PREFETCH_READY;
+			map_prefetch_stats.reads++;
+			map_prefetch_stats.bytes_read += st.bytes_read;
+			map_prefetch_stats.read_time += st.read_time;
+		}
+		pthread_cond_broadcast(&prefetch_done_cond);
+	}
+	pthread_mutex_unlock(&prefetch_mutex);
+	return NULL;
+}
+
+int init_map_prefetch()
+{
+	if(prefetch_running)
+		return 0;
+
+	for(int i=0; i<MAP_PREFETCH_SLOTS; i++)
+	{
+		if(!prefetch_slots[i].page && !(prefetch_slots[i].page = malloc(sizeof(map_page_t))))
+		{
+			printf("ERROR: out of memory for the map prefetch slots - not prefetching\n");
+			return 1;
+		}
+	}
+
+	prefetch_quit = 0;
+	int ret;
+	if( (ret = pthread_create(&prefetch_thread, NULL, prefetch_thread_func, NULL)) )
+	{
+		printf("ERROR: map prefetch thread creation, ret = %d - not prefetching\n", ret);
 		return 1;
 	}
+	prefetch_running = 1;
+	return 0;
+}
+
+void stop_map_prefetch()
+{
+	if(!prefetch_running)
+		return;
 
-	if(fread(w->pages[pagex][pagey], sizeof(map_page_t), 1, f) != 1)
+	pthread_mutex_lock(&prefetch_mutex);
+	for(int i=0; i<MAP_PREFETCH_SLOTS; i++)
 	{
-		printf("Error: Reading map data failed\n");
+		if(prefetch_slots[i].state == PREFETCH_REQUESTED)
+			prefetch_slots[i].state = PREFETCH_FREE;
 	}
+	prefetch_quit = 1;
+	pthread_cond_signal(&prefetch_work_cond);
+	pthread_mutex_unlock(&prefetch_mutex);
 
-	fclose(f);
+	pthread_join(prefetch_thread, NULL);
+	prefetch_running = 0;
+
+	for(int i=0; i<MAP_PREFETCH_SLOTS; i++)
+	{
+		if(prefetch_slots[i].state == PREFETCH_READY)
+			map_prefetch_stats.wasted++;
+		prefetch_slots[i].state = PREFETCH_FREE;
+		free(prefetch_slots[i].page);
+		prefetch_slots[i].page = NULL;
+	}
+}
+
+void prefetch_map_page(world_t* w, int pagex, int pagey)
+{
+	if(!prefetch_running || pagex < 0 || pagex >= MAP_W || pagey < 0 || pagey >= MAP_W || map_page(w, pagex, pagey))
+		return;
+
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_slot_t* s = NULL;
+	for(int i=0; i<MAP_PREFETCH_SLOTS; i++)
+	{
+		prefetch_slot_t* q = &prefetch_slots[i];
+		if(q->state != PREFETCH_FREE && q->world_id == w->id && q->pagex == pagex && q->pagey == pagey)
+		{
+			// Still wanted; replace others first.
+			q->seq = prefetch_seq++;
+			pthread_mutex_unlock(&prefetch_mutex);
+			return;
+		}
+
+		// Free slot, or else the oldest prefetched page nobody asked for.
+		if(q->state == PREFETCH_FREE && (!s || s->state != PREFETCH_FREE))
+			s = q;
+		else if(q->state == PREFETCH_READY && (!s || (s->state == PREFETCH_READY && (int32_t)(q->seq - s->seq) < 0)))
+			s = q;
+	}
+
+	if(s)
+	{
+		if(s->state == PREFETCH_READY)
+			map_prefetch_stats.wasted++;
+		s->world_id = w->id;
+		s->pagex = pagex;
+		s->pagey = pagey;
+		s->seq = prefetch_seq++;
+		s->state = PREFETCH_REQUESTED;
+		map_prefetch_stats.requests++;
+		pthread_cond_signal(&prefetch_work_cond);
+	}
+	else
+		map_prefetch_stats.dropped++;
+	pthread_mutex_unlock(&prefetch_mutex);
+}
+
+// Takes the page from the prefetch slots, waiting for it if it's being read. Returns the read_page_data() result,
+// or -1 if the page wasn't prefetched.
+static int read_from_prefetch(world_t* w, int pagex, int pagey)
+{
+	if(!prefetch_running)
+		return -1;
+
+	int ret = -1;
+	pthread_mutex_lock(&prefetch_mutex);
+	for(int i=0; i<MAP_PREFETCH_SLOTS; i++)
+	{
+		prefetch_slot_t* q = &prefetch_slots[i];
+		if(q->state == PREFETCH_FREE || q->world_id != w->id || q->pagex != pagex || q->pagey != pagey)
+			continue;
+
+		if(q->state == PREFETCH_REQUESTED)
+		{
+			// Not started yet; no use waiting.
+			q->state = PREFETCH_FREE;
+			break;
+		}
+
+		if(q->state == PREFETCH_IN_FLIGHT)
+		{
+			double start_time = subsec_timestamp();
+			while(q->state == PREFETCH_IN_FLIGHT)
+				pthread_cond_wait(&prefetch_done_cond, &prefetch_mutex);
+			map_prefetch_stats.wait_time += subsec_timestamp() - start_time;
+			if(q->state != PREFETCH_READY)
+				break; // skipped
+			map_prefetch_stats.late_hits++;
+		}
+
+		if(q->ret == 0)
+			memcpy(map_page(w, pagex, pagey), q->page, sizeof(map_page_t));
+		if(q->ret != 1)
+		{
+			ret = q->ret;
+			map_prefetch_stats.hits++;
+		}
+		q->state = PREFETCH_FREE;
+		break;
+	}
+	pthread_mutex_unlock(&prefetch_mutex);
+
+	if(ret < 0)
+		map_prefetch_stats.misses++;
+	return ret;
+}
+
+#else
+
+int init_map_prefetch()
+{
 	return 0;
 }
 
+void stop_map_prefetch()
+{
+}
+
+void prefetch_map_page(world_t* w, int pagex, int pagey)
+{
+	if(pagex < 0 || pagex >= MAP_W || pagey < 0 || pagey >= MAP_W || map_page(w, pagex, pagey))
+		return;
+
+	if(mmstore_prefetch_page(w->id, pagex, pagey) == 0)
+		map_prefetch_stats.requests++;
+}
+
+#endif
+
+/*
+	Prediction: the speed along the heading is estimated from the poses given to prefetch_ahead(), and the path
+	ahead is the straight line along the heading, plus the route points given. The path is sampled every quarter
+	page up to the distance covered in MAP_PREFETCH_HORIZON seconds (at least half a page, at most
+	MAP_PREFETCH_MAX_DIST). Every time the path enters a new page, the pages its load_25pages() window adds
+	to the previous window are prefetched, so the requests are in the order they will be needed.
+*/
+
+#define MAP_PREFETCH_HORIZON 3.0 // seconds
+#define MAP_PREFETCH_MIN_DIST (MAP_PAGE_W*MAP_UNIT_W/2) // mm
+#define MAP_PREFETCH_MAX_DIST (MAP_PAGE_W*MAP_UNIT_W) // mm
+#define MAP_PREFETCH_STEP (MAP_PAGE_W*MAP_UNIT_W/4) // mm
+
+// If the point is on a new page, prefetches the pages of its window which were not in the previous page's window.
+static void prefetch_window_at(world_t* w, int32_t x, int32_t y, int* prev_px, int* prev_py)
+{
+	int px, py, ox, oy;
+	page_coords(x, y, &px, &py, &ox, &oy);
+	if(px == *prev_px && py == *prev_py)
+		return;
+
+	for(int ix=-2; ix<=2; ix++)
+	{
+		for(int iy=-2; iy<=2; iy++)
+		{
+			if(abs(px+ix - *prev_px) > 2 || abs(py+iy - *prev_py) > 2)
+				prefetch_map_page(w, px+ix, py+iy);
+		}
+	}
+	*prev_px = px; *prev_py = py;
+}
+
+// Samples the line from (x1,y1) to (x2,y2), until *dist_left runs out.
+static void prefetch_along_line(world_t* w, int32_t x1, int32_t y1, int32_t x2, int32_t y2, float* dist_left, int* prev_px, int* prev_py)
+{
+	float len = sqrt((float)(x2-x1)*(float)(x2-x1) + (float)(y2-y1)*(float)(y2-y1));
+	float dx = 0.0, dy = 0.0;
+	if(len > 1.0)
+	{
+		dx = (float)(x2-x1)/len;
+		dy = (float)(y2-y1)/len;
+	}
+
+	for(float d = 0.0; d <= len && d <= *dist_left; d += MAP_PREFETCH_STEP)
+		prefetch_window_at(w, x1 + dx*d, y1 + dy*d, prev_px, prev_py);
+
+	*dist_left -= len;
+}
+
+void prefetch_ahead(world_t* w, int32_t x, int32_t y, int32_t ang, int n_route, const int32_t route[][2])
+{
+	static double prev_t;
+	static int32_t prev_x, prev_y;
+	static float speed; // mm/s, along the heading; negative = reversing
+
+	double t = subsec_timestamp();
+	double dt = t - prev_t;
+	float ca = cos(ANG32TORAD(ang)), sa = sin(ANG32TORAD(ang));
+	if(dt > 0.0 && dt < 2.0)
+	{
+		float v = ((float)(x-prev_x)*ca + (float)(y-prev_y)*sa)/dt;
+		speed = 0.5*speed + 0.5*v;
+	}
+	else
+		speed = 0.0;
+	prev_t = t; prev_x = x; prev_y = y;
+
+	float dist = fabs(speed)*MAP_PREFETCH_HORIZON;
+	if(dist < MAP_PREFETCH_MIN_DIST) dist = MAP_PREFETCH_MIN_DIST;
+	if(dist > MAP_PREFETCH_MAX_DIST) dist = MAP_PREFETCH_MAX_DIST;
+
+	int cur_px, cur_py, ox, oy;
+	page_coords(x, y, &cur_px, &cur_py, &ox, &oy);
+
+	if(n_route > 0)
+	{
+		int prev_px = cur_px, prev_py = cur_py;
+		float dist_left = dist;
+		int32_t fx = x, fy = y;
+		for(int i=0; i<n_route && dist_left > 0.0; i++)
+		{
+			prefetch_along_line(w, fx, fy, route[i][0], route[i][1], &dist_left, &prev_px, &prev_py);
+			fx = route[i][0]; fy = route[i][1];
+		}
+	}
+
+	if(fabs(speed) > 50.0)
+	{
+		int prev_px = cur_px, prev_py = cur_py;
+		float dir = (speed < 0.0)?-1.0:1.0;
+		float dist_left = dist;
+		prefetch_along_line(w, x, y, x + dir*ca*dist, y + dir*sa*dist, &dist_left, &prev_px, &prev_py);
+	}
+}
+
+// Gets the page from the write queue or the prefetch slots. Returns the read result, or -1 if it needs to be read from the disk.
+static int read_page_cached(world_t* w, int pagex, int pagey)
+{
+	clear_page_changed(w, pagex, pagey);
+	page_replaced(w, pagex, pagey);
+
+	if(read_from_persist_queue(w, pagex, pagey))
+	{
+		map_io_stats.queue_hits++;
+		return 0;
+	}
+
+#ifndef MAP_STORE_MMAP
+	return read_from_prefetch(w, pagex, pagey);
+#else
+	return -1;
+#endif
+}
+
+static int read_page_file(world_t* w, int pagex, int pagey)
+{
+	int ret = read_page_cached(w, pagex, pagey);
+	if(ret >= 0)
+		return ret;
+
+	return read_page_data(w->id, pagex, pagey, map_page(w, pagex, pagey), &map_io_stats);
+}
+
+#ifdef MAP_STORE_MMAP
+/*
+	With the single-file world store, loaded pages are normally mappings of the store file (mmapped set).
+	If mapping fails, the page falls back to an ordinary allocation, written with pwrite() on sync.
+	Pages not found in the store are imported from the old per-page files, if any.
+*/
+#endif
+
+int read_map_page(world_t* w, int pagex, int pagey)
+{
+#ifdef MAP_STORE_MMAP
+	double start_time = subsec_timestamp();
+	int ret = mmstore_read_page(w->id, pagex, pagey, map_page(w, pagex, pagey));
+	if(ret != 2)
+	{
+		clear_page_changed(w, pagex, pagey);
+		page_replaced(w, pagex, pagey);
+		if(ret == 0)
+		{
+			map_io_stats.pages_read++;
+			map_io_stats.bytes_read += sizeof(map_page_t);
+		}
+		map_io_stats.read_time += subsec_timestamp() - start_time;
+		return ret;
+	}
+#endif
+	return read_page_file(w, pagex, pagey);
+}
+
+// Starts writing a changed page to disk.
+static int sync_map_page(world_t* w, int pagex, int pagey)
+{
+#ifdef MAP_STORE_MMAP
+	double start_time = subsec_timestamp();
+	int ret;
+	if(find_world_page(w, pagex, pagey)->mmapped)
+		ret = mmstore_sync_page(map_page(w, pagex, pagey));
+	else
+		ret = mmstore_write_page(w->id, pagex, pagey, map_page(w, pagex, pagey));
+
+	if(ret == 0)
+	{
+		map_io_stats.pages_written++;
+		map_io_stats.bytes_written += sizeof(map_page_t);
+	}
+	map_io_stats.write_time += subsec_timestamp() - start_time;
+	clear_page_changed(w, pagex, pagey);
+	return ret;
+#else
+	return queue_map_page(w, pagex, pagey);
+#endif
+}
+
+// Allocates a zeroed page and adds it to the resident list.
+static void alloc_map_page(world_t* w, int pagex, int pagey)
+{
+//	printf("Info: Allocating mem for page %d,%d\n", pagex, pagey);
+	map_page_t* p;
+	while(!(p = pool_alloc(&map_page_pool, 1)))
+	{
+		if(evict_lru_page(w))
+		{
+			printf("WARN: map page pool exhausted and nothing to evict, allocating page %d,%d outside the pool\n", pagex, pagey);
+			p = calloc(1, sizeof(map_page_t));
+			map_page_pool.outside++;
+			break;
+		}
+	}
+	get_world_page(w, pagex, pagey)->page = p;
+	index_add_resident(w, pagex, pagey);
+	map_io_stats.pages_allocated++;
+}
+
 int load_map_page(world_t* w, int pagex, int pagey)
 {
-	if(w->pages[pagex][pagey])
+	if(map_page(w, pagex, pagey))
 	{
 		printf("Info: reloading already allocated map page %d,%d\n", pagex, pagey);
 	}
 	else
 	{
-//		printf("Info: Allocating mem for page %d,%d\n", pagex, pagey);
-		w->pages[pagex][pagey] = calloc(1, sizeof(map_page_t));
+#ifdef MAP_STORE_MMAP
+		int is_new;
+		map_page_t* mp = mmstore_map_page(w->id, pagex, pagey, &is_new);
+		if(mp)
+		{
+			world_page_t* wp = get_world_page(w, pagex, pagey);
+			wp->page = mp;
+			wp->mmapped = 1;
+			index_add_resident(w, pagex, pagey);
+			map_io_stats.pages_allocated++;
+
+			if(is_new && read_page_file(w, pagex, pagey) == 0)
+			{
+				// Imported from an old per-page file
+				mark_page_changed(w, pagex, pagey);
+			}
+			return 0;
+		}
+		printf("WARN: mapping page %d,%d from the world store failed, using a memory page\n", pagex, pagey);
+#endif
+		alloc_map_page(w, pagex, pagey);
 	}
 
 	int ret = read_map_page(w, pagex, pagey);
 	if(ret == 2)
 	{
 //		printf("Info: map page file didn't exist, initializing empty map page\n");
-//		memset(w->pages[pagex][pagey], 0, sizeof(map_page_t));
+//		memset(map_page(w, pagex, pagey), 0, sizeof(map_page_t));
 	}
 	else if(ret)
 	{
 		printf("Error: Reading map page file failed. Initializing empty map page\n");
-//		memset(w->pages[pagex][pagey], 0, sizeof(map_page_t));
+//		memset(map_page(w, pagex, pagey), 0, sizeof(map_page_t));
 		return 1;
 	}
 	return 0;
 }
 
+// Loads the listed pages which are not loaded yet, reading them from the disk in one batch.
+static void load_map_pages(world_t* w, int n, int* xs, int* ys)
+{
+#ifdef MAP_STORE_MMAP
+	for(int i=0; i<n; i++)
+	{
+		if(!map_page(w, xs[i], ys[i]))
+			load_map_page(w, xs[i], ys[i]);
+	}
+#else
+	read_job_t jobs[25];
+	int n_jobs = 0;
+	for(int i=0; i<n && n_jobs < 25; i++)
+	{
+		int x = xs[i], y = ys[i];
+		if(map_page(w, x, y))
+			continue;
+
+		alloc_map_page(w, x, y);
+		if(read_page_cached(w, x, y) >= 0)
+			continue;
+
+		jobs[n_jobs].world_id = w->id;
+		jobs[n_jobs].pagex = x;
+		jobs[n_jobs].pagey = y;
+		jobs[n_jobs].page = map_page(w, x, y);
+		n_jobs++;
+	}
+
+	read_map_pages_batch(jobs, n_jobs);
+
+	for(int i=0; i<n_jobs; i++)
+	{
+		if(jobs[i].ret == 1)
+			printf("Error: Reading map page file (%d,%d) failed. Initializing empty map page\n", jobs[i].pagex, jobs[i].pagey);
+	}
+#endif
+}
+
 int unload_map_page(world_t* w, int pagex, int pagey)
 {
-	if(w->pages[pagex][pagey])
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	if(wp && wp->page)
 	{
-		if(w->changed[pagex][pagey])
+		if(wp->changed)
 		{
-			if(write_map_page(w, pagex, pagey))
+			if(sync_map_page(w, pagex, pagey))
 			{
 				printf("Error: writing map page (%d,%d) to disk failed\n", pagex, pagey);
 			}
 		}
 //		printf("Info: Freeing mem for page %d,%d\n", pagex, pagey);
-		free(w->pages[pagex][pagey]);
-		w->pages[pagex][pagey] = 0;
-		w->changed[pagex][pagey] = 0;
+#ifdef MAP_STORE_MMAP
+		if(wp->mmapped)
+		{
+			mmstore_unmap_page(wp->page);
+			wp->mmapped = 0;
+		}
+		else
+#endif
+		pool_free(&map_page_pool, wp->page);
+		clear_page_changed(w, pagex, pagey);
+		index_remove_resident(w, pagex, pagey);
+		wp->page = 0;
+		map_io_stats.pages_freed++;
 
-		free(w->rpages[pagex][pagey]);
-		w->rpages[pagex][pagey] = 0;
+		pool_free(&routing_page_pool, wp->rpage);
+		wp->rpage = 0;
+		cspace_page_unloaded(w, pagex, pagey);
 	}
 	else
 	{
@@ -141,15 +2377,15 @@ int unload_map_page(world_t* w, int pagex, int pagey)
 
 int unload_map_pages(world_t* w, int cur_pagex, int cur_pagey)
 {
-	for(int x = 0; x < MAP_W; x++)
+	page_index_t* idx = get_index(w);
+	int32_t next;
+	for(int32_t n = idx->lru_head; n >= 0; n = next)
 	{
-		for(int y = 0; y < MAP_W; y++)
+		next = index_page(w, n)->lru_next;
+		int x = n/MAP_W, y = n%MAP_W;
+		if(abs(cur_pagex - x) > 3 || abs(cur_pagey - y) > 3)
 		{
-			if(w->pages[x][y] && (abs(cur_pagex - x) > 3 || abs(cur_pagey - y) > 3))
-			{
-				unload_map_page(w, x, y);
-			}
-
+			unload_map_page(w, x, y);
 		}
 	}
 	return 0;
@@ -157,17 +2393,14 @@ int unload_map_pages(world_t* w, int cur_pagex, int cur_pagey)
 
 int save_map_pages(world_t* w)  // returns number of changed pages
 {
+	page_index_t* idx = get_index(w);
 	int ret = 0;
-	for(int x = 0; x < MAP_W; x++)
+	int32_t next;
+	for(int32_t n = idx->dirty_head; n >= 0; n = next)
 	{
-		for(int y = 0; y < MAP_W; y++)
-		{
-			if(w->pages[x][y] && w->changed[x][y])
-			{
-				ret++;
-				write_map_page(w, x, y);
-			}
-		}
+		next = index_page(w, n)->dirty_next;
+		ret++;
+		sync_map_page(w, n/MAP_W, n%MAP_W);
 	}
 	return ret;
 }
@@ -181,18 +2414,24 @@ void load_9pages(world_t* w, int pagex, int pagey)
 		return;
 	}
 
+	get_index(w)->epoch++;
+	for(int x=-1; x<=1; x++)
+		for(int y=-1; y<=1; y++)
+			touch_page(w, pagex+x, pagey+y);
+
+	int xs[9], ys[9], n = 0;
 	for(int x=-1; x<=1; x++)
 	{
 		for(int y=-1; y<=1; y++)
 		{
-			int xx = pagex+x;
-			int yy = pagey+y;
-			if(!w->pages[xx][yy])
-			{
-				load_map_page(w, xx, yy);
-			}
+			xs[n] = pagex+x;
+			ys[n] = pagey+y;
+			n++;
 		}
 	}
+	load_map_pages(w, n, xs, ys);
+
+	enforce_ram_budget(w);
 }
 
 void load_25pages(world_t* w, int pagex, int pagey)
@@ -203,25 +2442,36 @@ void load_25pages(world_t* w, int pagex, int pagey)
 		return;
 	}
 
+	get_index(w)->epoch++;
+	for(int x=-2; x<=2; x++)
+		for(int y=-2; y<=2; y++)
+			touch_page(w, pagex+x, pagey+y);
+
+	int xs[25], ys[25], n = 0;
 	for(int x=-2; x<=2; x++)
 	{
 		for(int y=-2; y<=2; y++)
 		{
-			int xx = pagex+x;
-			int yy = pagey+y;
-			if(!w->pages[xx][yy])
-			{
-				load_map_page(w, xx, yy);
-			}
+			xs[n] = pagex+x;
+			ys[n] = pagey+y;
+			n++;
 		}
 	}
+	load_map_pages(w, n, xs, ys);
+
+	enforce_ram_budget(w);
 }
 
 void load_1page(world_t* w, int pagex, int pagey)
 {
-	if(!w->pages[pagex][pagey])
+	get_index(w)->epoch++;
+	touch_page(w, pagex, pagey);
+
+	if(!map_page(w, pagex, pagey))
 	{
 		load_map_page(w, pagex, pagey);
 	}
+
+	enforce_ram_budget(w);
 }
 
@@ -23,7 +23,227 @@
 #define MAP_MEMDISK_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include "mapping.h"
+#include "page_pool.h"
+
+// Maximum number of map pages (512 KB each) in memory; least recently used pages are evicted to stay within.
+// There is a routing page pool of the same size.
+#ifndef MAP_PAGE_POOL_MAX
+#define MAP_PAGE_POOL_MAX 64
+#endif
+
+extern page_pool_t map_page_pool;
+extern page_pool_t routing_page_pool;
+
+// Soft limit for the memory used by loaded map pages and their routing pages, in bytes.
+// Least recently used pages are unloaded to stay within, after each load_*page*() call.
+#ifndef MAP_RAM_BUDGET
+#define MAP_RAM_BUDGET (32*1024*1024)
+#endif
+
+// Resident page index (see map_memdisk.c). Statistics for tuning the budget:
+typedef struct
+{
+	int requests;         // pages asked for by load_*page*()
+	int hits;             // ... of which were already loaded
+	int evictions;        // pages unloaded as least recently used
+	int budget_evictions; // ... of which due to MAP_RAM_BUDGET
+	int peak_resident;
+} page_index_stats_t;
+
+extern page_index_stats_t page_index_stats;
+
+int n_resident_pages(world_t* w);
+int n_dirty_pages(world_t* w);
+int64_t resident_page_bytes(world_t* w); // map pages + routing pages
+uint32_t page_access_count(world_t* w, int pagex, int pagey);
+
+void page_index_add_dirty(world_t* w, int pagex, int pagey);
+
+/*
+	Worlds in memory
+
+	get_world() returns the world with the id, creating it empty (no pages loaded) the first time; name is just for
+	the humans, and only used when the world is created. Up to MAX_WORLDS worlds can be in memory at once. Their
+	loaded pages share the page pools and MAP_RAM_BUDGET: when memory runs out, pages are evicted from the other
+	worlds as well, least recently used first.
+*/
+#define MAX_WORLDS 16
+
+world_t* get_world(uint32_t id, const char* name); // NULL if MAX_WORLDS are already in memory
+
+// Directory entry of the page, allocating its block if needed.
+world_page_t* get_world_page(world_t* w, int pagex, int pagey);
+
+/*
+	Dirty tracking is done per tile of MAP_TILE_W*MAP_TILE_W units, one bit per tile in world_page_t.changed_tiles,
+	so that a sync only needs to write the tiles that changed (see the page journal in map_memdisk.c).
+*/
+#define MAP_TILE_W 32
+#define MAP_TILES_PER_ROW (MAP_PAGE_W/MAP_TILE_W)
+#define MAP_TILES_PER_PAGE (MAP_TILES_PER_ROW*MAP_TILES_PER_ROW) // 64, fits in the uint64_t mask
+
+static inline int map_tile_idx(int offsx, int offsy)
+{
+	return (offsx/MAP_TILE_W)*MAP_TILES_PER_ROW + offsy/MAP_TILE_W;
+}
+
+static inline uint64_t map_tile_bit(int offsx, int offsy)
+{
+	return 1ULL << map_tile_idx(offsx, offsy);
+}
+
+/*
+	Page summaries
+
+	For every tile of a loaded page, a summary of its units: the result and constraint bits set anywhere in the
+	tile, and the largest counters. Whole-area scans (routing page generation, the scoremap, unfamiliarity) look at
+	the summary first, and skip the tiles with nothing to find - the unknown and the free areas, which are most of
+	any map. The tile size is the same as for the dirty tracking; 32 units is also one word of a routing page.
+
+	The summaries are updated lazily: every change to a page goes through the functions below, which mark the tile
+	stale, and get_page_summary() recomputes the stale tiles. Code changing units without marking the tile must only
+	clear bits or decrease counters; the summary is then too pessimistic, but never wrong.
+*/
+struct page_summary_t
+{
+	uint64_t stale; // tiles to recompute
+	uint8_t or_result[MAP_TILES_PER_PAGE];  // 0 = all unknown
+	uint8_t and_result[MAP_TILES_PER_PAGE];
+	uint8_t or_constraints[MAP_TILES_PER_PAGE];
+	uint8_t max_num_obstacles[MAP_TILES_PER_PAGE];
+	uint8_t max_num_3d_obstacles[MAP_TILES_PER_PAGE];
+	uint8_t max_num_seen[MAP_TILES_PER_PAGE];
+	uint8_t max_num_visited[MAP_TILES_PER_PAGE];
+};
+
+#define UNIT_OBSTACLE_BITS (UNIT_ITEM | UNIT_WALL | UNIT_INVISIBLE_WALL | UNIT_3D_WALL | UNIT_DROP)
+
+void refresh_page_summary(world_t* w, int pagex, int pagey);
+
+// Up-to-date summary of a loaded page; NULL if the page is not loaded.
+static inline page_summary_t* get_page_summary(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	page_summary_t* s = wp ? wp->summary : NULL;
+	if(s && s->stale)
+		refresh_page_summary(w, pagex, pagey);
+	return s;
+}
+
+static inline int tile_all_unknown(page_summary_t* s, int tile)
+{
+	return s->or_result[tile] == 0;
+}
+
+static inline int tile_all_free(page_summary_t* s, int tile)
+{
+	return (s->and_result[tile] & UNIT_MAPPED) && !(s->or_result[tile] & UNIT_OBSTACLE_BITS);
+}
+
+static inline int tile_has_obstacles(page_summary_t* s, int tile)
+{
+	return (s->or_result[tile] & UNIT_OBSTACLE_BITS) || s->max_num_obstacles[tile] || s->max_num_3d_obstacles[tile];
+}
+
+static inline void page_tiles_changed(world_t* w, int pagex, int pagey, uint64_t tiles, int make_dirty)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	if(!wp || !wp->page)
+	{
+		if(make_dirty)
+			page_index_add_dirty(w, pagex, pagey); // warns
+		return;
+	}
+
+	wp->changed_tiles |= tiles;
+	wp->routing_stale |= tiles;
+	wp->map_gen++;
+	if(wp->summary)
+		wp->summary->stale |= tiles;
+	if(make_dirty && !wp->changed)
+		page_index_add_dirty(w, pagex, pagey);
+}
+
+// Records that a unit changed, without making the page dirty: the tile is written the next time the page is
+// synced for some other reason. For things like counters which don't need to hit the disk on their own.
+static inline void note_unit_changed(world_t* w, int pagex, int pagey, int offsx, int offsy)
+{
+	page_tiles_changed(w, pagex, pagey, map_tile_bit(offsx, offsy), 0);
+}
+
+// Use these instead of setting the changed flag directly, to keep the page on the dirty list.
+static inline void mark_unit_changed(world_t* w, int pagex, int pagey, int offsx, int offsy)
+{
+	page_tiles_changed(w, pagex, pagey, map_tile_bit(offsx, offsy), 1);
+}
+
+// Whole page changed (or unknown which units)
+static inline void mark_page_changed(world_t* w, int pagex, int pagey)
+{
+	page_tiles_changed(w, pagex, pagey, ~0ULL, 1);
+}
+
+// Page file header. Files without the header are old raw map_page_t dumps.
+#define MAP_PAGE_MAGIC   0x5031524e // "NR1P"
+#define MAP_PAGE_VERSION 3
+
+#define MAP_PAGE_CODEC_RAW        0
+#define MAP_PAGE_CODEC_PLANAR_RLE 1
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t codec;
+	uint32_t raw_size;     // sizeof(map_page_t), to catch struct changes
+	uint32_t payload_size; // bytes following the header
+	// Version 2 ->
+	uint32_t generation;   // incremented on every full write; the journal must have the same generation
+	// Version 3 ->
+	uint32_t crc;          // CRC-32 of the payload
+} map_page_hdr_t;
+
+#define MAP_PAGE_HDR_V1_SIZE 16
+#define MAP_PAGE_HDR_V2_SIZE 20
+
+// Page journal (.jnl next to the .map file): a header, then records of changed tiles, appended on each sync.
+#define MAP_JNL_MAGIC     0x4a31524e // "NR1J"
+#define MAP_JNL_REC_MAGIC 0x5231524e // "NR1R"
+#define MAP_JNL_VERSION   2
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t tile_w;          // MAP_TILE_W
+	uint32_t base_generation; // generation of the .map file the records apply to
+} map_jnl_hdr_t;
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint16_t n_tiles;
+	uint16_t codec;        // MAP_PAGE_CODEC_*
+	uint64_t tiles;        // bit mask, tiles in the payload in bit order
+	uint32_t payload_size; // bytes following the record header
+	// Journal version 2 ->
+	uint32_t crc;          // CRC-32 of the tile mask and the payload
+} map_jnl_rec_t;
+
+#define MAP_JNL_REC_V1_SIZE 20
+
+// A journal longer than this is compacted: the whole page is written, and the journal removed.
+#ifndef MAP_JNL_MAX_SIZE
+#define MAP_JNL_MAX_SIZE (64*1024)
+#endif
+
+// Copies the page into a map_unit_t array (the default layout), whatever the page layout is.
+void map_page_to_units(map_page_t* page, map_unit_t* units);
+
+// Startup check of MAP_DIR after a crash or power loss, see map_memdisk.c. Returns the number of files repaired or removed.
+int recover_map_dir();
 
 // Disk access; file name is generated and the page is stored/read.
 int write_map_page(world_t* w, int pagex, int pagey);
@@ -46,8 +266,96 @@ void load_1page(world_t* w, int pagex, int pagey);
 // Scans through the world and unloads any loaded pages farther than 2 pages away from cur_pagex, cur_pagey.
 int unload_map_pages(world_t* w, int cur_pagex, int cur_pagey);
 
-// Scans through the world and syncs any loaded pages to disk.
+// Scans through the world and syncs any loaded pages to disk (through the write queue, if running).
 int save_map_pages(world_t* w);
 
+// Number of threads doing the page reads and writes in the background
+#ifndef MAP_IO_THREADS
+#define MAP_IO_THREADS 4
+#endif
+
+// Starts the background threads which write the pages queued by save_map_pages() and unload_map_page(s)(),
+// and read the page batches of load_9pages() and load_25pages().
+int init_map_persistence();
+
+// Barrier: returns when all queued pages are on disk.
+void flush_map_pages();
+
+// Flushes and stops the persistence threads; further reads and writes are synchronous.
+void stop_map_persistence();
+
+// Starts the background thread which reads the pages asked for by prefetch_*().
+int init_map_prefetch();
+void stop_map_prefetch();
+
+// Asks for the page to be read in the background, if it's not loaded. Doesn't block.
+void prefetch_map_page(world_t* w, int pagex, int pagey);
+
+// Predicts the pages load_25pages() will need in the next few seconds, from the robot pose (x, y, ang) and the
+// speed estimated from the earlier calls, and from the next route points (route[i][0] = x, route[i][1] = y, in mm),
+// and prefetches them. Call after every pose update.
+void prefetch_ahead(world_t* w, int32_t x, int32_t y, int32_t ang, int n_route, const int32_t route[][2]);
+
+typedef struct
+{
+	int requests;     // pages queued for prefetching
+	int reads;        // ... read by the prefetch thread
+	int skipped;      // ... not read because the page was in the write queue
+	int dropped;      // not queued because all slots were busy
+	int hits;         // page loads served from a prefetch slot
+	int late_hits;    // ... of which had to wait for the read to finish
+	int misses;       // page loads which had to read the disk themselves
+	int wasted;       // prefetched pages thrown away unused
+	int64_t bytes_read;
+	double read_time; // in the prefetch thread
+	double wait_time; // main thread time spent waiting for late prefetches
+} map_prefetch_stats_t;
+
+extern map_prefetch_stats_t map_prefetch_stats;
+
+// Disk traffic counters, for performance monitoring. Never reset by map_memdisk itself.
+typedef struct
+{
+	int pages_read;
+	int pages_written;
+	int pages_allocated;
+	int pages_freed;
+	int64_t bytes_read;    // bytes on disk, i.e., compressed
+	int64_t bytes_written;
+	double read_time;  // in seconds, including decoding/encoding
+	double write_time;
+	double decode_time;
+	double encode_time;
+	int pages_queued;    // snapshots given to the persistence thread
+	int pages_coalesced; // page overwritten in the queue before it was written
+	int queue_hits;      // page read back from the queue instead of the disk
+	double queue_wait_time; // main thread time spent copying snapshots and waiting for free slots or flushes
+	int page_syncs;        // changed pages synced (written in full or to the journal)
+	int jnl_records;       // of which written as journal records
+	int jnl_tiles;         // tiles in those records
+	int64_t jnl_bytes;     // ... and their bytes on disk, also counted in bytes_written
+	int jnl_compactions;   // full writes because the journal grew over MAP_JNL_MAX_SIZE
+	int jnl_replayed;      // journal records applied when reading pages
+	int crc_errors;        // pages or journal records with a bad checksum (the page file is set aside as .bad)
+	int summary_refreshes; // page summaries recomputed after changes
+	int archive_reads;     // pages read from the world archive (no page file), also counted in pages_read
+} map_io_stats_t;
+
+extern map_io_stats_t map_io_stats;
+
+// Page file contents (header + payload) in memory, as also stored in the world archives (map_archive.h).
+// Returns a malloc()ed buffer of *len bytes, NULL if out of memory.
+uint8_t* encode_map_page(map_page_t* page, uint32_t generation, int* len, map_io_stats_t* st);
+
+// Reads and decodes len bytes of page file contents from the current position of f; name is for the messages.
+// Returns 0 if ok, 1 on errors, 3 if the checksum doesn't match.
+int decode_map_page(FILE* f, long len, map_page_t* page, map_page_hdr_t* hdr, const char* name, map_io_stats_t* st);
+
+// Reads or writes a page of the world in MAP_DIR directly, bypassing the pages in memory and the write queue:
+// only for the tools working on MAP_DIR when the mapping is not running. Reading applies the journal; writing
+// writes the whole page and removes the journal. Read returns 2 if the page doesn't exist.
+int read_stored_map_page(uint32_t world_id, int pagex, int pagey, map_page_t* page, map_io_stats_t* st);
+int write_stored_map_page(uint32_t world_id, int pagex, int pagey, map_page_t* page, map_io_stats_t* st);
+
 
 #endif
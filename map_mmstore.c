@@ -0,0 +1,283 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Single-file memory-mapped world store
+
+	Instead of one file per map page, all pages of a world live in one sparse file,
+	MAP_DIR/<robot_id>_<world_id>.world:
+
+	0        mmstore_hdr_t, padded to MMSTORE_HDR_SIZE
+	4096     page directory: uint32_t per page index (x*MAP_W+y); 0 = no page, otherwise slot+1
+	266240   page slots, sizeof(map_page_t) each, in allocation order
+
+	The file is extended with ftruncate(), so a new slot costs no disk space until
+	something is written to it, and the unknown parts of a page (whole 4 KB blocks of zeroes
+	that were never written) stay as holes.
+
+	Loaded pages are the file itself: load_map_page() maps the slot, unload_map_page()
+	unmaps it. Syncing is msync(MS_ASYNC): the kernel tracks the dirty 4 KB blocks itself
+	and writes only those back, in the background, so a page-level dirty flag is enough on
+	our side. There is no per-page open/close or directory churn, and the kernel page cache
+	decides what stays resident.
+
+	Pages are stored raw (not compressed); the sparse file takes care of the empty areas. Raw means the in-memory
+	page layout, so a store made with MAP_PAGE_PLANAR can only be opened by a MAP_PAGE_PLANAR build, and vice versa.
+
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mapping.h"
+#include "map_mmstore.h"
+
+extern uint32_t robot_id;
+
+#define MMSTORE_HDR_SIZE  4096
+#define MMSTORE_DIR_SIZE  (MAP_W*MAP_W*sizeof(uint32_t))
+#define MMSTORE_DATA_OFFS ((off_t)MMSTORE_HDR_SIZE + (off_t)MMSTORE_DIR_SIZE)
+
+static int store_fd = -1;
+static uint32_t store_world_id;
+static uint8_t* store_meta; // header + directory, mapped
+static mmstore_hdr_t* store_hdr;
+static uint32_t* store_dir;
+
+static void close_store()
+{
+	if(store_fd < 0)
+		return;
+
+	munmap(store_meta, MMSTORE_DATA_OFFS);
+	close(store_fd);
+	store_fd = -1;
+}
+
+static int open_store(uint32_t world_id)
+{
+	if(store_fd >= 0 && store_world_id == world_id)
+		return 0;
+
+	close_store();
+
+	char fname[1024];
+	if(snprintf(fname, 1024, MAP_DIR"/%08x_%u.world", robot_id, world_id) > 1022)
+		fname[1023] = 0;
+
+	int fd = open(fname, O_RDWR | O_CREAT, 0644);
+	if(fd < 0)
+	{
+		printf("ERROR: opening world store %s failed, errno=%d\n", fname, errno);
+		return 1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0)
+	{
+		printf("ERROR: fstat on %s failed, errno=%d\n", fname, errno);
+		close(fd);
+		return 1;
+	}
+
+	int is_new = 0;
+	if(st.st_size < MMSTORE_DATA_OFFS)
+	{
+		if(st.st_size != 0)
+			printf("WARN: world store %s is truncated, starting over\n", fname);
+		if(ftruncate(fd, 0) < 0 || ftruncate(fd, MMSTORE_DATA_OFFS) < 0)
+		{
+			printf("ERROR: ftruncate on %s failed, errno=%d\n", fname, errno);
+			close(fd);
+			return 1;
+		}
+		is_new = 1;
+	}
+
+	uint8_t* meta = mmap(NULL, MMSTORE_DATA_OFFS, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(meta == MAP_FAILED)
+	{
+		printf("ERROR: mmap on %s failed, errno=%d\n", fname, errno);
+		close(fd);
+		return 1;
+	}
+
+	mmstore_hdr_t* hdr = (mmstore_hdr_t*)meta;
+	if(is_new)
+	{
+		hdr->magic = MMSTORE_MAGIC;
+		hdr->version = MMSTORE_VERSION;
+		hdr->map_w = MAP_W;
+		hdr->page_size = sizeof(map_page_t);
+		hdr->n_slots = 0;
+		hdr->planar = MMSTORE_PLANAR;
+	}
+	else if(hdr->magic != MMSTORE_MAGIC || hdr->version != MMSTORE_VERSION || hdr->map_w != MAP_W || hdr->page_size != sizeof(map_page_t) ||
+	        hdr->planar != MMSTORE_PLANAR ||
+	        MMSTORE_DATA_OFFS + (off_t)hdr->n_slots*sizeof(map_page_t) > st.st_size)
+	{
+		printf("ERROR: %s is not a compatible world store\n", fname);
+		munmap(meta, MMSTORE_DATA_OFFS);
+		close(fd);
+		return 1;
+	}
+
+	store_fd = fd;
+	store_world_id = world_id;
+	store_meta = meta;
+	store_hdr = hdr;
+	store_dir = (uint32_t*)(meta + MMSTORE_HDR_SIZE);
+	return 0;
+}
+
+static off_t slot_offs(uint32_t slot)
+{
+	return MMSTORE_DATA_OFFS + (off_t)slot*sizeof(map_page_t);
+}
+
+// Returns the slot of the page, allocating it if alloc is set. Returns -1 if not found or failed.
+static int64_t page_slot(int pagex, int pagey, int alloc, int* is_new)
+{
+	uint32_t* d = &store_dir[pagex*MAP_W+pagey];
+	if(*d)
+		return *d - 1;
+
+	if(!alloc)
+		return -1;
+
+	uint32_t slot = store_hdr->n_slots;
+	if(ftruncate(store_fd, slot_offs(slot+1)) < 0)
+	{
+		printf("ERROR: extending the world store failed, errno=%d\n", errno);
+		return -1;
+	}
+	store_hdr->n_slots = slot+1;
+	*d = slot+1;
+	if(is_new) *is_new = 1;
+	return slot;
+}
+
+map_page_t* mmstore_map_page(uint32_t world_id, int pagex, int pagey, int* is_new)
+{
+	*is_new = 0;
+	if(open_store(world_id))
+		return NULL;
+
+	int64_t slot = page_slot(pagex, pagey, 1, is_new);
+	if(slot < 0)
+		return NULL;
+
+	void* p = mmap(NULL, sizeof(map_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, slot_offs(slot));
+	if(p == MAP_FAILED)
+	{
+		printf("ERROR: mmap of page (%d,%d) failed, errno=%d\n", pagex, pagey, errno);
+		return NULL;
+	}
+	return p;
+}
+
+int mmstore_sync_page(map_page_t* page)
+{
+	if(msync(page, sizeof(map_page_t), MS_ASYNC) < 0)
+	{
+		printf("ERROR: msync failed, errno=%d\n", errno);
+		return 1;
+	}
+	return 0;
+}
+
+int mmstore_unmap_page(map_page_t* page)
+{
+	int ret = mmstore_sync_page(page);
+	if(munmap(page, sizeof(map_page_t)) < 0)
+	{
+		printf("ERROR: munmap failed, errno=%d\n", errno);
+		return 1;
+	}
+	return ret;
+}
+
+int mmstore_read_page(uint32_t world_id, int pagex, int pagey, map_page_t* page)
+{
+	if(open_store(world_id))
+		return 1;
+
+	int64_t slot = page_slot(pagex, pagey, 0, NULL);
+	if(slot < 0)
+		return 2;
+
+	if(pread(store_fd, page, sizeof(map_page_t), slot_offs(slot)) != sizeof(map_page_t))
+	{
+		printf("ERROR: reading page (%d,%d) from the world store failed, errno=%d\n", pagex, pagey, errno);
+		return 1;
+	}
+	return 0;
+}
+
+int mmstore_write_page(uint32_t world_id, int pagex, int pagey, map_page_t* page)
+{
+	if(open_store(world_id))
+		return 1;
+
+	int64_t slot = page_slot(pagex, pagey, 1, NULL);
+	if(slot < 0)
+		return 1;
+
+	if(pwrite(store_fd, page, sizeof(map_page_t), slot_offs(slot)) != sizeof(map_page_t))
+	{
+		printf("ERROR: writing page (%d,%d) to the world store failed, errno=%d\n", pagex, pagey, errno);
+		return 1;
+	}
+	return 0;
+}
+
+int mmstore_prefetch_page(uint32_t world_id, int pagex, int pagey)
+{
+	if(open_store(world_id))
+		return 1;
+
+	int64_t slot = page_slot(pagex, pagey, 0, NULL);
+	if(slot < 0)
+		return 1;
+
+	return posix_fadvise(store_fd, slot_offs(slot), sizeof(map_page_t), POSIX_FADV_WILLNEED)?1:0;
+}
+
+int mmstore_flush()
+{
+	if(store_fd < 0)
+		return 0;
+
+	if(msync(store_meta, MMSTORE_DATA_OFFS, MS_SYNC) < 0 || fsync(store_fd) < 0)
+	{
+		printf("ERROR: flushing the world store failed, errno=%d\n", errno);
+		return 1;
+	}
+	return 0;
+}
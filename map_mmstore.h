@@ -0,0 +1,69 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Single-file memory-mapped world store (enabled with -DMAP_STORE_MMAP)
+
+*/
+
+#ifndef MAP_MMSTORE_H
+#define MAP_MMSTORE_H
+
+#include <stdint.h>
+#include "mapping.h"
+
+#define MMSTORE_MAGIC   0x5731524e // "NR1W"
+#define MMSTORE_VERSION 1
+
+typedef struct __attribute__((packed))
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t map_w;     // MAP_W
+	uint32_t page_size; // sizeof(map_page_t)
+	uint32_t n_slots;   // number of page slots allocated in the file
+	uint32_t planar;    // 1 if the pages are in the MAP_PAGE_PLANAR layout (0 in stores from before the option)
+} mmstore_hdr_t;
+
+#ifdef MAP_PAGE_PLANAR
+#define MMSTORE_PLANAR 1
+#else
+#define MMSTORE_PLANAR 0
+#endif
+
+// Maps the page into memory, allocating a zeroed slot in the file if the page didn't exist (*is_new is set).
+// Returns NULL on failure.
+map_page_t* mmstore_map_page(uint32_t world_id, int pagex, int pagey, int* is_new);
+
+// Schedules writeback of a mapped page (non-blocking).
+int mmstore_sync_page(map_page_t* page);
+
+// Writes back and unmaps a mapped page.
+int mmstore_unmap_page(map_page_t* page);
+
+// Copies between the store and unmapped memory. Read returns 2 if the page is not in the store.
+int mmstore_read_page(uint32_t world_id, int pagex, int pagey, map_page_t* page);
+int mmstore_write_page(uint32_t world_id, int pagex, int pagey, map_page_t* page);
+
+// Starts reading the page into the page cache in the background, if it is in the store. Returns 0 if started.
+int mmstore_prefetch_page(uint32_t world_id, int pagex, int pagey);
+
+// Blocks until everything written or synced so far is on disk.
+int mmstore_flush();
+
+#endif
@@ -0,0 +1,967 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Recording of mapping inputs, and headless replay of recorded sessions.
+
+	While recording, every input that changes the map is appended to the file as it
+	enters the mapping code: lidar batches to map_lidars() (with the state vector that
+	decides what map_lidars() does), 3DTOF scans to fuse_3dtof(), fusion buffer resets,
+	robot positions used for page loading and clear_within_robot(), and the periodic
+	disk syncs.
+
+	Replay (rn1host --replay <file>) runs the same calls in the same order without any
+	threads, hardware or TCP client, so the result only depends on the recording and the
+	mapping code. The resulting pages are checksummed: any change to the mapping code that
+	is supposed to be an optimization only must give the same checksum.
+
+	Records are raw structs of this architecture - replay on the same kind of machine the
+	recording was made on.
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <math.h>
+
+#include "datatypes.h"
+#include "mapping.h"
+#include "map_memdisk.h"
+#include "routing.h"
+#include "utlist.h"
+#include "hwdata.h"
+#include "uart.h"
+#include "map_replay.h"
+
+extern double subsec_timestamp();
+extern uint32_t robot_id;
+
+static FILE* rec_f;
+
+static void write_record(uint32_t type, int n_parts, const void** parts, const uint32_t* lens)
+{
+	replay_rec_hdr_t hdr;
+	hdr.type = type;
+	hdr.len = 0;
+	for(int i=0; i<n_parts; i++)
+		hdr.len += lens[i];
+
+	if(fwrite(&hdr, sizeof(hdr), 1, rec_f) != 1)
+		goto WRITE_FAIL;
+
+	for(int i=0; i<n_parts; i++)
+	{
+		if(lens[i] && fwrite(parts[i], lens[i], 1, rec_f) != 1)
+			goto WRITE_FAIL;
+	}
+	return;
+
+	WRITE_FAIL:
+	printf("ERROR: writing the replay record failed, recording stopped.\n");
+	replay_stop_recording();
+}
+
+int replay_start_recording(const char* fname)
+{
+	if(rec_f)
+		replay_stop_recording();
+
+	rec_f = fopen(fname, "wb");
+	if(!rec_f)
+	{
+		printf("ERROR: opening %s for recording failed, errno=%d\n", fname, errno);
+		return 1;
+	}
+
+	uint32_t hdr[2] = {REPLAY_MAGIC, REPLAY_VERSION};
+	if(fwrite(hdr, sizeof(hdr), 1, rec_f) != 1)
+	{
+		printf("ERROR: writing %s failed\n", fname);
+		fclose(rec_f);
+		rec_f = NULL;
+		return 1;
+	}
+
+	printf("Info: recording mapping inputs to %s\n", fname);
+	return 0;
+}
+
+void replay_stop_recording()
+{
+	if(!rec_f)
+		return;
+
+	fclose(rec_f);
+	rec_f = NULL;
+	printf("Info: mapping input recording stopped\n");
+}
+
+int replay_is_recording()
+{
+	return rec_f != NULL;
+}
+
+void replay_record_lidars(int n_lidars, lidar_scan_t** lidar_list)
+{
+	if(!rec_f)
+		return;
+
+	int32_t n = n_lidars;
+	const void* parts[2+32];
+	uint32_t lens[2+32];
+
+	if(n > 32)
+		return;
+
+	parts[0] = &state_vect; lens[0] = sizeof(state_vect_t);
+	parts[1] = &n;          lens[1] = sizeof(n);
+	for(int i=0; i<n; i++)
+	{
+		parts[2+i] = lidar_list[i];
+		lens[2+i] = sizeof(lidar_scan_t);
+	}
+
+	write_record(REPLAY_LIDARS, 2+n, parts, lens);
+}
+
+void replay_record_tof(tof3d_scan_t* tof)
+{
+	if(!rec_f)
+		return;
+
+	const void* parts[2] = {&tof->robot_pos, tof->objmap};
+	uint32_t lens[2] = {sizeof(pos_t), sizeof(tof->objmap)};
+	write_record(REPLAY_TOF, 2, parts, lens);
+}
+
+void replay_record_tof_reset()
+{
+	if(!rec_f)
+		return;
+
+	write_record(REPLAY_TOF_RESET, 0, NULL, NULL);
+}
+
+void replay_record_robot_pos(pos_t pos)
+{
+	if(!rec_f)
+		return;
+
+	const void* parts[2] = {&state_vect, &pos};
+	uint32_t lens[2] = {sizeof(state_vect_t), sizeof(pos_t)};
+	write_record(REPLAY_ROBOT_POS, 2, parts, lens);
+}
+
+void replay_record_sync(int32_t x, int32_t y)
+{
+	if(!rec_f)
+		return;
+
+	int32_t xy[2] = {x, y};
+	const void* parts[1] = {xy};
+	uint32_t lens[1] = {sizeof(xy)};
+	write_record(REPLAY_SYNC, 1, parts, lens);
+
+	fflush(rec_f);
+}
+
+
+/*
+	Replay
+*/
+
+static const char* phase_names[6] = {"", "map_lidars", "fuse_3dtof", "3dtof reset", "page load & clear", "sync"};
+
+static int map_dir_has_pages()
+{
+	DIR* d = opendir(MAP_DIR);
+	if(!d)
+	{
+		printf("ERROR: cannot open MAP_DIR (%s), errno=%d\n", MAP_DIR, errno);
+		return -1;
+	}
+
+	int ret = 0;
+	struct dirent* e;
+	while((e = readdir(d)))
+	{
+		int len = strlen(e->d_name);
+		if((len > 4 && strcmp(&e->d_name[len-4], ".map") == 0) || (len > 4 && strcmp(&e->d_name[len-4], ".jnl") == 0) ||
+		   (len > 6 && strcmp(&e->d_name[len-6], ".world") == 0) || (len > 6 && strcmp(&e->d_name[len-6], ".mapar") == 0))
+		{
+			ret = 1;
+			break;
+		}
+	}
+	closedir(d);
+	return ret;
+}
+
+static uint64_t fnv1a(uint64_t h, const void* data, int len)
+{
+	const uint8_t* p = data;
+	for(int i=0; i<len; i++)
+	{
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static int page_is_empty(map_page_t* page)
+{
+	uint8_t* p = (uint8_t*)page;
+	for(int i=0; i<sizeof(map_page_t); i++)
+		if(p[i]) return 0;
+	return 1;
+}
+
+/*
+	Checksum of all map pages on disk, as seen through read_map_page(), so that it doesn't depend on the file format.
+	Per-page hashes are XORed, so the order the pages were written doesn't matter. All-zero pages are the same as
+	nonexisting pages (depending on the store, they may or may not be on the disk), and are not included.
+*/
+static uint64_t map_pages_checksum(world_t* w, int* n_pages)
+{
+	uint64_t sum = 0;
+	map_page_t* scratch = malloc(sizeof(map_page_t));
+	map_unit_t* units = malloc(sizeof(map_page_t));
+	if(!scratch || !units)
+	{
+		printf("ERROR: out of memory\n");
+		free(scratch); free(units);
+		return 0;
+	}
+
+	*n_pages = 0;
+	for(int x = 0; x < MAP_W; x++)
+	{
+		for(int y = 0; y < MAP_W; y++)
+		{
+			if(map_page(w, x, y))
+			{
+				printf("ERROR: map_pages_checksum: page (%d,%d) still loaded\n", x, y);
+				continue;
+			}
+
+			memset(scratch, 0, sizeof(map_page_t));
+			world_page_t* wp = get_world_page(w, x, y);
+			wp->page = scratch;
+			int ret = read_map_page(w, x, y);
+			wp->page = 0;
+
+			if(ret == 0 && !page_is_empty(scratch))
+			{
+				int32_t xy[2] = {x, y};
+				uint64_t h = 0xcbf29ce484222325ULL;
+				h = fnv1a(h, xy, sizeof(xy));
+				map_page_to_units(scratch, units); // same checksum for both page layouts
+				h = fnv1a(h, units, sizeof(map_page_t));
+				sum ^= h;
+				(*n_pages)++;
+			}
+		}
+	}
+
+	free(scratch);
+	free(units);
+	return sum;
+}
+
+/*
+	Timings of the kernels that read the map, on the final map around the last robot position: routing page
+	generation, the localization scoremap, the exploration unfamiliarity score, and the direct route checks the route
+	following does, on lines from the robot to spots around it. They mostly depend on the page layout
+	(MAP_PAGE_PLANAR) and the memory system, not on the disk.
+*/
+
+#define KERNEL_REPS 10
+
+typedef struct
+{
+	double routing_page; // seconds per call
+	double routing_page_scalar; // the same with the scalar routing word code
+	int routing_mismatches; // pages where the two differ
+	double scoremap;
+	double unfamiliarity;
+	double direct_route; // check_direct_route_non_turning_mm()
+	double direct_route_hitcnt; // check_direct_route_non_turning_hitcnt_mm()
+	int direct_routes, direct_routes_clear;
+	int direct_route_hits; // sum of the hit counts
+} kernel_times_t;
+
+// Full regeneration of the 3*3 routing pages around (px,py): unchanged pages would be skipped otherwise.
+static double time_routing_pages(world_t* w, int px, int py)
+{
+	double t = subsec_timestamp();
+	for(int rep=0; rep<KERNEL_REPS; rep++)
+	{
+		for(int ix=-1; ix<=1; ix++)
+		{
+			for(int iy=-1; iy<=1; iy++)
+			{
+				world_page_t* wp = find_world_page(w, px+ix, py+iy);
+				if(wp)
+					wp->routing_stale = ~0ULL;
+				gen_routing_page(w, px+ix, py+iy, 0);
+			}
+		}
+	}
+	return (subsec_timestamp()-t)/(KERNEL_REPS*9);
+}
+
+static void time_map_kernels(world_t* w, int32_t x, int32_t y, kernel_times_t* kt)
+{
+	static int8_t scoremap[TEMP_MAP_W*TEMP_MAP_W];
+	static routing_page_t simd_pages[9];
+
+	int px, py, ox, oy;
+	page_coords(x, y, &px, &py, &ox, &oy);
+	load_25pages(w, px, py);
+
+	// The SIMD kernel against the scalar code, which it has to match bit for bit. The first round brings the page
+	// summaries up to date.
+	time_routing_pages(w, px, py);
+	kt->routing_page = time_routing_pages(w, px, py);
+	for(int i=0; i<9; i++)
+	{
+		routing_page_t* rp = routing_page(w, px+i/3-1, py+i%3-1);
+		if(rp)
+			simd_pages[i] = *rp;
+	}
+	routing_scalar_kernel = 1;
+	kt->routing_page_scalar = time_routing_pages(w, px, py);
+	routing_scalar_kernel = 0;
+	kt->routing_mismatches = 0;
+	for(int i=0; i<9; i++)
+	{
+		routing_page_t* rp = routing_page(w, px+i/3-1, py+i%3-1);
+		if(rp && memcmp(rp, &simd_pages[i], sizeof(routing_page_t)))
+			kt->routing_mismatches++;
+	}
+
+	double t = subsec_timestamp();
+	for(int rep=0; rep<KERNEL_REPS; rep++)
+		gen_scoremap_for_small_steps(w, scoremap, x, y);
+	kt->scoremap = (subsec_timestamp()-t)/KERNEL_REPS;
+
+	// Like the exploration does: a grid of candidate spots around the robot.
+	int n = 0;
+	volatile int sum = 0;
+	t = subsec_timestamp();
+	for(int rep=0; rep<KERNEL_REPS; rep++)
+	{
+		for(int dx=-4000; dx<=4000; dx+=200)
+		{
+			for(int dy=-4000; dy<=4000; dy+=200)
+			{
+				sum += unfamiliarity_score(w, x+dx, y+dy);
+				n++;
+			}
+		}
+	}
+	kt->unfamiliarity = (subsec_timestamp()-t)/n;
+}
+
+// After the route searches, which make the robot shapes: 36 directions, 1 to 4 m. The first round makes the c-space
+// of the headings, and is not timed.
+static void time_direct_routes(world_t* w, int32_t x, int32_t y, kernel_times_t* kt)
+{
+	routing_set_world(w);
+	kt->direct_routes = kt->direct_routes_clear = kt->direct_route_hits = 0;
+	double t = 0.0;
+	for(int rep=0; rep<=KERNEL_REPS; rep++)
+	{
+		if(rep == 1)
+			t = subsec_timestamp();
+		for(int a=0; a<360; a+=10)
+		{
+			for(int len=1000; len<=4000; len+=1000)
+			{
+				int clear = check_direct_route_non_turning_mm(x, y, x+len*cos(a*M_PI/180.0), y+len*sin(a*M_PI/180.0));
+				if(rep == 0)
+				{
+					kt->direct_routes++;
+					kt->direct_routes_clear += clear;
+				}
+			}
+		}
+	}
+	kt->direct_route = (subsec_timestamp()-t)/(KERNEL_REPS*kt->direct_routes);
+
+	for(int rep=0; rep<=KERNEL_REPS; rep++)
+	{
+		if(rep == 1)
+			t = subsec_timestamp();
+		for(int a=0; a<360; a+=10)
+		{
+			for(int len=1000; len<=4000; len+=1000)
+			{
+				int hits = check_direct_route_non_turning_hitcnt_mm(x, y, x+len*cos(a*M_PI/180.0), y+len*sin(a*M_PI/180.0));
+				if(rep == 0)
+					kt->direct_route_hits += hits;
+			}
+		}
+	}
+	kt->direct_route_hitcnt = (subsec_timestamp()-t)/(KERNEL_REPS*kt->direct_routes);
+}
+
+/*
+	Route search benchmark on the final map: routes from the last robot position to the spots the robot visited
+	during the session (so they are reachable), within the pages loaded around the last position. The same routes
+	are then searched on the cluster graph (hpa_min_dist 0), those that are long enough for it, and with each
+	full resolution search algorithm, comparing the lengths of the paths A* and jump point search find.
+
+	Then the incremental replanning: each route is searched with routing_incremental, an obstacle (ROUTE_BENCH_BLOB
+	units of wall) is put on it about a meter ahead of the robot, like a person stepping in front of it, and the same
+	route is searched again, which repairs the kept search. The map is put back as it was after each route.
+*/
+
+#define ROUTE_BENCH_POINTS 32
+#define ROUTE_BENCH_SPACING 2000 // mm between the spots
+
+// Passes over the routes
+#define ROUTE_BENCH_DIRECT       0 // as configured
+#define ROUTE_BENCH_HIERARCHICAL 1
+#define ROUTE_BENCH_THETA        2
+#define ROUTE_BENCH_ASTAR        3
+#define ROUTE_BENCH_JPS          4
+#define ROUTE_BENCH_PASSES       5
+
+#define ROUTE_BENCH_BLOB 2 // units, square
+#define ROUTE_BENCH_AHEAD 25 // units from the start
+
+typedef struct
+{
+	int tried;
+	int found;
+	double total_time;
+	double max_time;
+	int expansions;
+	double length; // of the routes found, in units
+} route_bench_res_t;
+
+typedef struct
+{
+	int n_points;
+	int32_t points[ROUTE_BENCH_POINTS][2];
+
+	route_bench_res_t res[ROUTE_BENCH_PASSES];
+	float astar_cost[ROUTE_BENCH_POINTS]; // path length A* found, -1 if none
+	int jps_same_cost; // routes jump point search found as short a path for as A*
+	int jps_compared;
+
+	route_bench_res_t fresh;  // incremental search, first time to the goal
+	route_bench_res_t repair; // again, with the obstacle on the route
+	int repaired; // of repair.found, those found with the kept search
+	int repair_same_cost; // repaired routes as short as A* finds with the obstacle
+	int repair_compared;
+} route_bench_t;
+
+static void route_bench_add_point(route_bench_t* rb, int32_t x, int32_t y)
+{
+	if(rb->n_points >= ROUTE_BENCH_POINTS)
+		return;
+	if(rb->n_points > 0)
+	{
+		int64_t dx = x - rb->points[rb->n_points-1][0];
+		int64_t dy = y - rb->points[rb->n_points-1][1];
+		if(dx*dx + dy*dy < (int64_t)ROUTE_BENCH_SPACING*ROUTE_BENCH_SPACING)
+			return;
+	}
+	rb->points[rb->n_points][0] = x;
+	rb->points[rb->n_points][1] = y;
+	rb->n_points++;
+}
+
+static double route_length(int32_t x, int32_t y, route_unit_t* route)
+{
+	route_xy_t prev;
+	unit_coords(x, y, &prev.x, &prev.y);
+	double len = 0.0;
+	route_unit_t* rt;
+	DL_FOREACH(route, rt)
+	{
+		len += sqrt((double)(rt->loc.x-prev.x)*(rt->loc.x-prev.x) + (double)(rt->loc.y-prev.y)*(rt->loc.y-prev.y));
+		prev = rt->loc;
+	}
+	return len;
+}
+
+static void time_route_searches(world_t* w, int32_t x, int32_t y, route_bench_t* rb)
+{
+	int px, py, ox, oy;
+	page_coords(x, y, &px, &py, &ox, &oy);
+	load_25pages(w, px, py);
+
+	int min_dist = hpa_min_dist;
+	int algo = routing_search_algo;
+	for(int pass=0; pass<ROUTE_BENCH_PASSES; pass++)
+	{
+		route_bench_res_t* res = &rb->res[pass];
+		hpa_min_dist = (pass == ROUTE_BENCH_HIERARCHICAL) ? 0 : min_dist;
+		if(pass == ROUTE_BENCH_THETA) routing_search_algo = SEARCH_THETA;
+		if(pass == ROUTE_BENCH_ASTAR) routing_search_algo = SEARCH_ASTAR;
+		if(pass == ROUTE_BENCH_JPS)   routing_search_algo = SEARCH_JPS;
+
+		for(int i=0; i<rb->n_points; i++)
+		{
+			int dpx, dpy;
+			page_coords(rb->points[i][0], rb->points[i][1], &dpx, &dpy, &ox, &oy);
+			if(abs(dpx-px) > 1 || abs(dpy-py) > 1) // so that the robot shape around the route stays within the loaded pages
+				continue;
+			int64_t dx = rb->points[i][0] - x, dy = rb->points[i][1] - y;
+			if(dx*dx + dy*dy < (int64_t)ROUTE_BENCH_SPACING*ROUTE_BENCH_SPACING/4) // search() can't make a route to where it is
+				continue;
+
+			route_unit_t* route = NULL;
+			int searches = hpa_stats.searches;
+			int expansions = search_stats.expansions;
+			double t = subsec_timestamp();
+			int ret = search_route(w, &route, 0.0, x, y, rb->points[i][0], rb->points[i][1], 0);
+			t = subsec_timestamp() - t;
+			double len = route_length(x, y, route);
+			clear_route(&route);
+
+			if(pass == ROUTE_BENCH_HIERARCHICAL && hpa_stats.searches == searches)
+				continue; // searched directly anyway
+
+			res->tried++;
+			if(ret == 0)
+			{
+				res->found++;
+				res->length += len;
+			}
+			res->total_time += t;
+			if(t > res->max_time)
+				res->max_time = t;
+			res->expansions += search_stats.expansions - expansions;
+
+			if(pass == ROUTE_BENCH_ASTAR)
+				rb->astar_cost[i] = (ret == 0) ? search_stats.cost : -1.0;
+			if(pass == ROUTE_BENCH_JPS && ret == 0 && rb->astar_cost[i] >= 0.0)
+			{
+				rb->jps_compared++;
+				if(fabs(search_stats.cost - rb->astar_cost[i]) < 0.01)
+					rb->jps_same_cost++;
+			}
+		}
+	}
+	hpa_min_dist = min_dist;
+	routing_search_algo = algo;
+}
+
+// Times one search_route() into res, returning its return value. The route is left in *route.
+static int time_route_search(world_t* w, route_unit_t** route, int32_t x, int32_t y, int32_t dest_x, int32_t dest_y, route_bench_res_t* res)
+{
+	int expansions = search_stats.expansions;
+	double t = subsec_timestamp();
+	int ret = search_route(w, route, 0.0, x, y, dest_x, dest_y, 0);
+	t = subsec_timestamp() - t;
+
+	res->tried++;
+	if(ret == 0)
+	{
+		res->found++;
+		res->length += route_length(x, y, *route);
+	}
+	res->total_time += t;
+	if(t > res->max_time)
+		res->max_time = t;
+	res->expansions += search_stats.expansions - expansions;
+	return ret;
+}
+
+static void time_route_repairs(world_t* w, int32_t x, int32_t y, route_bench_t* rb)
+{
+	int px, py, ox, oy;
+	page_coords(x, y, &px, &py, &ox, &oy);
+
+	int incremental = routing_incremental;
+	int algo = routing_search_algo;
+	for(int i=0; i<rb->n_points; i++)
+	{
+		int dpx, dpy;
+		page_coords(rb->points[i][0], rb->points[i][1], &dpx, &dpy, &ox, &oy);
+		if(abs(dpx-px) > 1 || abs(dpy-py) > 1)
+			continue;
+		int64_t dx = rb->points[i][0] - x, dy = rb->points[i][1] - y;
+		if(dx*dx + dy*dy < (int64_t)ROUTE_BENCH_SPACING*ROUTE_BENCH_SPACING/4)
+			continue;
+
+		routing_incremental = 1;
+		routing_search_algo = algo;
+		route_unit_t* route = NULL;
+		if(time_route_search(w, &route, x, y, rb->points[i][0], rb->points[i][1], &rb->fresh))
+		{
+			clear_route(&route);
+			continue;
+		}
+
+		// ROUTE_BENCH_AHEAD units along the first leg, or the middle of it if it's shorter
+		route_xy_t start, mid;
+		unit_coords(x, y, &start.x, &start.y);
+		float leg = sqrt((float)((route->loc.x-start.x)*(route->loc.x-start.x) + (route->loc.y-start.y)*(route->loc.y-start.y)));
+		float ahead = (leg > 2*ROUTE_BENCH_AHEAD) ? ROUTE_BENCH_AHEAD/leg : 0.5;
+		mid.x = start.x + ahead*(route->loc.x-start.x);
+		mid.y = start.y + ahead*(route->loc.y-start.y);
+		clear_route(&route);
+
+		int bpx = mid.x/MAP_PAGE_W, bpy = mid.y/MAP_PAGE_W;
+		int box = mid.x%MAP_PAGE_W, boy = mid.y%MAP_PAGE_W;
+		if(box > MAP_PAGE_W-ROUTE_BENCH_BLOB) box = MAP_PAGE_W-ROUTE_BENCH_BLOB;
+		if(boy > MAP_PAGE_W-ROUTE_BENCH_BLOB) boy = MAP_PAGE_W-ROUTE_BENCH_BLOB;
+		map_page_t* page = map_page(w, bpx, bpy);
+		if(!page)
+			continue;
+
+		uint8_t saved[ROUTE_BENCH_BLOB][ROUTE_BENCH_BLOB];
+		uint64_t tiles = 0;
+		for(int bx=0; bx<ROUTE_BENCH_BLOB; bx++)
+		{
+			for(int by=0; by<ROUTE_BENCH_BLOB; by++)
+			{
+				saved[bx][by] = PAGE_UNIT(page, box+bx, boy+by, result);
+				PAGE_UNIT(page, box+bx, boy+by, result) |= UNIT_WALL;
+				tiles |= 1ULL << map_tile_idx(box+bx, boy+by);
+			}
+		}
+		page_tiles_changed(w, bpx, bpy, tiles, 0);
+
+		// A* first, so that the repair doesn't pay for regenerating the c-space around the obstacle, which any search
+		// would. The kept search still has it to apply.
+		routing_incremental = 0;
+		routing_search_algo = SEARCH_ASTAR;
+		float astar_cost = -1.0;
+		if(search_route(w, &route, 0.0, x, y, rb->points[i][0], rb->points[i][1], 0) == 0)
+			astar_cost = search_stats.cost;
+		clear_route(&route);
+
+		routing_incremental = 1;
+		routing_search_algo = algo;
+		int repairs = dstar_stats.repairs;
+		if(time_route_search(w, &route, x, y, rb->points[i][0], rb->points[i][1], &rb->repair) == 0)
+		{
+			if(dstar_stats.repairs > repairs)
+				rb->repaired++;
+			if(astar_cost >= 0.0)
+			{
+				rb->repair_compared++;
+				if(fabs(search_stats.cost - astar_cost) < 0.01)
+					rb->repair_same_cost++;
+			}
+		}
+		clear_route(&route);
+
+		for(int bx=0; bx<ROUTE_BENCH_BLOB; bx++)
+		{
+			for(int by=0; by<ROUTE_BENCH_BLOB; by++)
+				PAGE_UNIT(page, box+bx, boy+by, result) = saved[bx][by];
+		}
+		page_tiles_changed(w, bpx, bpy, tiles, 0);
+	}
+	routing_incremental = incremental;
+	routing_search_algo = algo;
+}
+
+int replay_mapping_session(world_t* w, const char* fname)
+{
+	int ret = map_dir_has_pages();
+	if(ret)
+	{
+		if(ret > 0)
+			printf("ERROR: replay must start from an empty map: MAP_DIR (%s) already has .map, .jnl, .world or .mapar files.\n", MAP_DIR);
+		return 1;
+	}
+
+	FILE* f = fopen(fname, "rb");
+	if(!f)
+	{
+		printf("ERROR: opening %s failed, errno=%d\n", fname, errno);
+		return 1;
+	}
+
+	uint32_t file_hdr[2];
+	if(fread(file_hdr, sizeof(file_hdr), 1, f) != 1 || file_hdr[0] != REPLAY_MAGIC || file_hdr[1] != REPLAY_VERSION)
+	{
+		printf("ERROR: %s is not a mapping recording (or is of wrong version)\n", fname);
+		fclose(f);
+		return 1;
+	}
+
+	uart = -1; // Localization with big search area sends stop commands to the robot; make sure they go nowhere.
+
+	static uint8_t tof_buf[sizeof(tof3d_scan_t)];
+	tof3d_scan_t* tof = (tof3d_scan_t*)tof_buf;
+
+	uint32_t buf_size = 0;
+	uint8_t* buf = NULL;
+
+	int cnts[6] = {0};
+	double times[6] = {0.0};
+	double max_times[6] = {0.0};
+	int n_lidars_total = 0;
+	int32_t last_x = 0, last_y = 0;
+	route_bench_t rb;
+	memset(&rb, 0, sizeof(rb));
+
+	memset(&map_io_stats, 0, sizeof(map_io_stats));
+	memset(&map_prefetch_stats, 0, sizeof(map_prefetch_stats));
+	double start_time = subsec_timestamp();
+	init_map_persistence();
+	init_map_prefetch();
+
+	replay_rec_hdr_t hdr;
+	while(fread(&hdr, sizeof(hdr), 1, f) == 1)
+	{
+		if(hdr.len > buf_size)
+		{
+			buf_size = hdr.len;
+			buf = realloc(buf, buf_size);
+			if(!buf)
+			{
+				printf("ERROR: out of memory\n");
+				fclose(f);
+				return 1;
+			}
+		}
+
+		if(hdr.len && fread(buf, hdr.len, 1, f) != 1)
+		{
+			printf("WARN: recording ends in a truncated record, ignoring it.\n");
+			break;
+		}
+
+		double time = subsec_timestamp();
+		switch(hdr.type)
+		{
+			case REPLAY_LIDARS:
+			{
+				int32_t n;
+				memcpy(&n, &buf[sizeof(state_vect_t)], sizeof(n));
+				if(n < 0 || n > SIGNIFICANT_LIDAR_RING_BUF_LEN || hdr.len != sizeof(state_vect_t)+sizeof(n)+n*sizeof(lidar_scan_t))
+					goto CORRUPT;
+
+				// map_lidars() only accepts scans from the lidar ring buffers.
+				lidar_scan_t* list[SIGNIFICANT_LIDAR_RING_BUF_LEN];
+				for(int i=0; i<n; i++)
+				{
+					memcpy(&significant_lidars[i], &buf[sizeof(state_vect_t)+sizeof(n)+i*sizeof(lidar_scan_t)], sizeof(lidar_scan_t));
+					list[i] = &significant_lidars[i];
+				}
+				memcpy(&state_vect, buf, sizeof(state_vect_t));
+
+				int32_t da, dx, dy;
+				map_lidars(w, n, list, &da, &dx, &dy);
+				n_lidars_total += n;
+			}
+			break;
+
+			case REPLAY_TOF:
+			{
+				if(hdr.len != sizeof(pos_t)+sizeof(tof->objmap))
+					goto CORRUPT;
+
+				memcpy(&tof->robot_pos, buf, sizeof(pos_t));
+				memcpy(tof->objmap, &buf[sizeof(pos_t)], sizeof(tof->objmap));
+				int32_t mx, my;
+				fuse_3dtof(w, tof, &mx, &my);
+			}
+			break;
+
+			case REPLAY_TOF_RESET:
+			{
+				reset_3dtof_fusion();
+			}
+			break;
+
+			case REPLAY_ROBOT_POS:
+			{
+				if(hdr.len != sizeof(state_vect_t)+sizeof(pos_t))
+					goto CORRUPT;
+
+				pos_t pos;
+				memcpy(&state_vect, buf, sizeof(state_vect_t));
+				memcpy(&pos, &buf[sizeof(state_vect_t)], sizeof(pos_t));
+
+				int idx_x, idx_y, offs_x, offs_y;
+				page_coords(pos.x, pos.y, &idx_x, &idx_y, &offs_x, &offs_y);
+				load_25pages(w, idx_x, idx_y);
+				prefetch_ahead(w, pos.x, pos.y, pos.ang, 0, NULL);
+				if(state_vect.v.mapping_collisions)
+					clear_within_robot(w, pos);
+				last_x = pos.x; last_y = pos.y;
+				route_bench_add_point(&rb, pos.x, pos.y);
+			}
+			break;
+
+			case REPLAY_SYNC:
+			{
+				if(hdr.len != 2*sizeof(int32_t))
+					goto CORRUPT;
+
+				int32_t xy[2];
+				memcpy(xy, buf, sizeof(xy));
+
+				int idx_x, idx_y, offs_x, offs_y;
+				page_coords(xy[0], xy[1], &idx_x, &idx_y, &offs_x, &offs_y);
+				unload_map_pages(w, idx_x, idx_y);
+				save_map_pages(w);
+			}
+			break;
+
+			default:
+			printf("WARN: unknown record type %u, skipping\n", hdr.type);
+			continue;
+		}
+
+		time = subsec_timestamp() - time;
+		cnts[hdr.type]++;
+		times[hdr.type] += time;
+		if(time > max_times[hdr.type]) max_times[hdr.type] = time;
+		continue;
+
+		CORRUPT:
+		printf("ERROR: corrupted record (type %u, len %u), stopping replay.\n", hdr.type, hdr.len);
+		break;
+	}
+
+	fclose(f);
+	free(buf);
+
+	kernel_times_t kt;
+	time_map_kernels(w, last_x, last_y, &kt);
+	time_route_searches(w, last_x, last_y, &rb);
+	time_route_repairs(w, last_x, last_y, &rb);
+	time_direct_routes(w, last_x, last_y, &kt);
+
+	// Final sync, and drop everything from memory so that the checksum sees what's on disk.
+	double time = subsec_timestamp();
+	save_map_pages(w);
+	for(int x = 0; x < MAP_W; x++)
+	{
+		for(int y = 0; y < MAP_W; y++)
+		{
+			if(map_page(w, x, y))
+				unload_map_page(w, x, y);
+		}
+	}
+	stop_map_prefetch();
+	stop_map_persistence();
+	double final_sync_time = subsec_timestamp() - time;
+	double total_time = subsec_timestamp() - start_time;
+
+	map_io_stats_t io = map_io_stats;
+	int n_dir_blocks = w->n_blocks; // before the checksum goes through all pages
+
+	int n_pages;
+	memset(&map_io_stats, 0, sizeof(map_io_stats));
+	uint64_t checksum = map_pages_checksum(w, &n_pages);
+	map_io_stats_t readback = map_io_stats;
+
+	printf("\nReplay of %s finished in %.2f s (last robot pos %d,%d)\n", fname, total_time, last_x, last_y);
+#ifdef MAP_STORE_MMAP
+	printf("Page store: single-file memory-mapped world store\n\n");
+#elif defined(MAP_NO_JOURNAL)
+	printf("Page store: compressed file per page, whole pages written on sync\n\n");
+#else
+	printf("Page store: compressed file per page + journal of changed %dx%d tiles\n\n", MAP_TILE_W, MAP_TILE_W);
+#endif
+	printf("%-18s %8s %10s %10s %10s\n", "phase", "count", "total s", "avg ms", "max ms");
+	for(int i=1; i<6; i++)
+	{
+		printf("%-18s %8d %10.3f %10.3f %10.3f\n", phase_names[i], cnts[i], times[i],
+			cnts[i]?(1000.0*times[i]/cnts[i]):0.0, 1000.0*max_times[i]);
+	}
+	printf("%-18s %8d %10.3f\n\n", "final sync", 1, final_sync_time);
+
+	printf("Kernels: routing page generation %.3f ms/page (%s; scalar %.3f ms/page, %d pages differ), scoremap %.3f ms, unfamiliarity score %.2f us/call (%s page layout), %d page summary refreshes\n",
+		1000.0*kt.routing_page, routing_kernel_name, 1000.0*kt.routing_page_scalar, kt.routing_mismatches, 1000.0*kt.scoremap, 1e6*kt.unfamiliarity,
+#ifdef MAP_PAGE_PLANAR
+		"planar",
+#else
+		"map_unit_t array",
+#endif
+		io.summary_refreshes);
+	printf("Direct route checks: %.2f us/line (%d of %d clear), with hit counts %.2f us/line (%d hits in all)\n",
+		1e6*kt.direct_route, kt.direct_routes_clear, kt.direct_routes, 1e6*kt.direct_route_hitcnt, kt.direct_route_hits);
+	route_bench_res_t* rr = rb.res;
+	printf("Route search: %d of %d routes found, %.2f ms/route on average, %.2f ms at most\n",
+		rr[ROUTE_BENCH_DIRECT].found, rr[ROUTE_BENCH_DIRECT].tried,
+		rr[ROUTE_BENCH_DIRECT].tried?(1000.0*rr[ROUTE_BENCH_DIRECT].total_time/rr[ROUTE_BENCH_DIRECT].tried):0.0,
+		1000.0*rr[ROUTE_BENCH_DIRECT].max_time);
+	printf("Cluster graph: %d of %d routes found, %.2f ms/route on average, %.2f ms at most; %d clusters built, %d nodes expanded\n",
+		rr[ROUTE_BENCH_HIERARCHICAL].found, rr[ROUTE_BENCH_HIERARCHICAL].tried,
+		rr[ROUTE_BENCH_HIERARCHICAL].tried?(1000.0*rr[ROUTE_BENCH_HIERARCHICAL].total_time/rr[ROUTE_BENCH_HIERARCHICAL].tried):0.0,
+		1000.0*rr[ROUTE_BENCH_HIERARCHICAL].max_time, hpa_stats.clusters_built, hpa_stats.nodes_expanded);
+	for(int i=ROUTE_BENCH_THETA; i<=ROUTE_BENCH_JPS; i++)
+	{
+		printf("%-14s %d of %d routes found, %.2f ms/route on average, %.2f ms at most, %.0f nodes expanded/route, %.1f units long on average\n",
+			(i == ROUTE_BENCH_THETA) ? "Theta* search:" : (i == ROUTE_BENCH_ASTAR) ? "A* search:" : "JPS search:",
+			rr[i].found, rr[i].tried, rr[i].tried?(1000.0*rr[i].total_time/rr[i].tried):0.0, 1000.0*rr[i].max_time,
+			rr[i].tried?((double)rr[i].expansions/rr[i].tried):0.0, rr[i].found?(rr[i].length/rr[i].found):0.0);
+	}
+	printf("JPS paths as short as A*'s: %d of %d\n", rb.jps_same_cost, rb.jps_compared);
+	printf("Route repair: %d of %d routes found again after an obstacle on them (%d repaired), %.2f ms/route on average, "
+		"%.0f units expanded/route; the first search %.2f ms/route, %.0f units expanded/route; %d of %d as short as A*'s\n",
+		rb.repair.found, rb.repair.tried, rb.repaired, rb.repair.tried?(1000.0*rb.repair.total_time/rb.repair.tried):0.0,
+		rb.repair.tried?((double)rb.repair.expansions/rb.repair.tried):0.0,
+		rb.fresh.tried?(1000.0*rb.fresh.total_time/rb.fresh.tried):0.0, rb.fresh.tried?((double)rb.fresh.expansions/rb.fresh.tried):0.0,
+		rb.repair_same_cost, rb.repair_compared);
+	printf("C-space: %d collision checks, %d against the routing pages, %d tiles generated, %d planes (peak %d, %.1f MB), %d evicted\n",
+		cspace_stats.lookups, cspace_stats.fallbacks, cspace_stats.tiles_generated, cspace_stats.planes, cspace_stats.peak_planes,
+		(double)cspace_stats.peak_planes*(MAP_TILES_PER_PAGE*MAP_TILE_W*sizeof(uint32_t))/1e6, cspace_stats.evictions);
+	printf("Lidar scans: %d, %.1f scans/s in map_lidars\n", n_lidars_total, times[REPLAY_LIDARS]>0.0?(n_lidars_total/times[REPLAY_LIDARS]):0.0);
+	printf("3DTOF scans: %d, %.1f scans/s in fuse_3dtof\n", cnts[REPLAY_TOF], times[REPLAY_TOF]>0.0?(cnts[REPLAY_TOF]/times[REPLAY_TOF]):0.0);
+	printf("Disk: %d pages read (%.1f MB, %.3f s), %d pages written (%.1f MB, %.3f s, of which encoding %.3f s)\n",
+		io.pages_read, (double)io.bytes_read/1e6, io.read_time, io.pages_written, (double)io.bytes_written/1e6, io.write_time, io.encode_time);
+	printf("Write queue: %d snapshots queued, %d coalesced, %d read back from the queue, %.3f s main thread time (%d I/O threads)\n",
+		io.pages_queued, io.pages_coalesced, io.queue_hits, io.queue_wait_time, MAP_IO_THREADS);
+	printf("Syncs: %d syncs, %.1f kB written per sync; %d page syncs, %d as journal records (%d tiles, %.1f kB/record), %d full writes (%d journal compactions)\n",
+		cnts[REPLAY_SYNC]+1, (double)io.bytes_written/(cnts[REPLAY_SYNC]+1)/1e3, io.page_syncs, io.jnl_records, io.jnl_tiles,
+		io.jnl_records?((double)io.jnl_bytes/io.jnl_records/1e3):0.0, io.pages_written, io.jnl_compactions);
+	if(readback.pages_read)
+	{
+		printf("Final pages on disk: %d pages (%d from the world archive), %.1f kB/page on average (raw %.1f kB/page)\n",
+			readback.pages_read, readback.archive_reads, (double)readback.bytes_read/readback.pages_read/1e3, (double)sizeof(map_page_t)/1e3);
+		printf("Page load latency: %.3f ms/page, of which decoding %.3f ms/page (%d journal records applied, %d checksum errors)\n",
+			1000.0*readback.read_time/readback.pages_read, 1000.0*readback.decode_time/readback.pages_read, readback.jnl_replayed,
+			readback.crc_errors);
+	}
+	printf("Memory: %d pages allocated, %d freed (%.1f MB allocated in total)\n",
+		io.pages_allocated, io.pages_freed, (double)io.pages_allocated*sizeof(map_page_t)/1e6);
+	printf("Page index: %d pages asked for, %d already loaded (%.1f %%), peak %d resident, %d evicted (%d due to the %.1f MB budget)\n",
+		page_index_stats.requests, page_index_stats.hits, page_index_stats.requests?(100.0*page_index_stats.hits/page_index_stats.requests):0.0,
+		page_index_stats.peak_resident, page_index_stats.evictions, page_index_stats.budget_evictions, (double)MAP_RAM_BUDGET/1e6);
+	printf("Page directory: %d of %d blocks allocated, %.1f kB\n", n_dir_blocks, WORLD_BLOCKS*WORLD_BLOCKS,
+		(double)(n_dir_blocks*sizeof(world_block_t) + sizeof(world_t))/1e3);
+	pool_print_stats(&map_page_pool);
+	pool_print_stats(&routing_page_pool);
+	map_prefetch_stats_t pf = map_prefetch_stats;
+	printf("Prefetch: %d pages requested, %d read (%.1f MB, %.3f s), %d skipped, %d dropped, %d wasted; "
+		"loads: %d hits (%d late, %.3f s waited), %d misses (%.1f %% hit rate)\n",
+		pf.requests, pf.reads, (double)pf.bytes_read/1e6, pf.read_time, pf.skipped, pf.dropped, pf.wasted,
+		pf.hits, pf.late_hits, pf.wait_time, pf.misses, (pf.hits+pf.misses)?(100.0*pf.hits/(pf.hits+pf.misses)):0.0);
+	printf("\nChecksum of %d map pages: %016llx\n", n_pages, (unsigned long long)checksum);
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Recording of mapping inputs, and headless replay of recorded sessions
+	for regression checking and benchmarking the mapping code.
+
+*/
+
+#ifndef MAP_REPLAY_H
+#define MAP_REPLAY_H
+
+#include <stdint.h>
+#include "datatypes.h"
+#include "mapping.h"
+#include "pulutof.h"
+
+#define REPLAY_MAGIC   0x52314e52 // "RN1R"
+#define REPLAY_VERSION 1
+
+typedef enum
+{
+	REPLAY_LIDARS    = 1, // state_vect_t, int32_t n_lidars, n_lidars * lidar_scan_t
+	REPLAY_TOF       = 2, // pos_t, objmap
+	REPLAY_TOF_RESET = 3, // no payload
+	REPLAY_ROBOT_POS = 4, // state_vect_t, pos_t
+	REPLAY_SYNC      = 5  // int32_t x, int32_t y
+} replay_rec_type_t;
+
+typedef struct __attribute__((packed))
+{
+	uint32_t type;
+	uint32_t len;  // payload length in bytes, excluding this header
+} replay_rec_hdr_t;
+
+int  replay_start_recording(const char* fname);
+void replay_stop_recording();
+int  replay_is_recording();
+
+// Recording hooks: these do nothing unless recording is on.
+void replay_record_lidars(int n_lidars, lidar_scan_t** lidar_list);
+void replay_record_tof(tof3d_scan_t* tof);
+void replay_record_tof_reset();
+void replay_record_robot_pos(pos_t pos);
+void replay_record_sync(int32_t x, int32_t y);
+
+// Runs a recorded session through the mapping code into an empty MAP_DIR, prints timing, disk traffic and
+// a checksum of the resulting map pages. Returns 0 on success.
+int replay_mapping_session(world_t* w, const char* fname);
+
+#endif
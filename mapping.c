@@ -42,6 +42,7 @@
 #include "mapping.h"
 #include "hwdata.h"
 #include "routing.h"
+#include "map_replay.h"
 
 #include "tcp_comm.h"   // to send dbgpoint.
 #include "tcp_parser.h" // to send dbgpoint.
@@ -77,7 +78,23 @@ static const int search_order[25][2] = {
 	{-2,-2}};
 
 
-world_t world;
+world_t* cur_world;
+
+int select_world(uint32_t id, const char* name)
+{
+	world_t* w = get_world(id, name);
+	if(!w)
+		return 1;
+
+	if(cur_world && cur_world != w)
+	{
+		// The pages of the world we leave stay loaded (until evicted), but nothing changes them any more.
+		save_map_pages(cur_world);
+		printf("Info: switching from world %u (%s) to %u (%s)\n", cur_world->id, cur_world->name, w->id, w->name);
+	}
+	cur_world = w;
+	return 0;
+}
 
 void page_coords(int mm_x, int mm_y, int* pageidx_x, int* pageidx_y, int* pageoffs_x, int* pageoffs_y)
 {
@@ -273,9 +290,20 @@ x2 = x*cos(a) + y*sin(a)
 y2 = -1*x*sin(a) + y*cos(a)
 */
 
-#define TEMP_MAP_W (2*MAP_PAGE_W)
 #define TEMP_MAP_MIDDLE (TEMP_MAP_W/2)
 
+// True if the unit and its neighbors within radius have no obstacles, i.e., the score is 0: the neighborhood is
+// within one tile, and the tile summary says there are no obstacles in the whole tile.
+static inline int no_obstacles_near(world_t *w, int px, int py, int ox, int oy, int radius)
+{
+	int tx = ox%MAP_TILE_W, ty = oy%MAP_TILE_W;
+	if(tx < radius || tx >= MAP_TILE_W-radius || ty < radius || ty >= MAP_TILE_W-radius)
+		return 0;
+
+	page_summary_t* s = get_page_summary(w, px, py);
+	return s && s->max_num_obstacles[map_tile_idx(ox, oy)] == 0;
+}
+
 // Slower, allows stepping larger steps, pays the used extra time back when searching large areas:
 static int gen_scoremap_for_large_steps(world_t *w, int8_t *scoremap, int mid_x, int mid_y)
 {
@@ -291,7 +319,14 @@ static int gen_scoremap_for_large_steps(world_t *w, int8_t *scoremap, int mid_x,
 			page_coords(mid_x + (xx-TEMP_MAP_MIDDLE)*MAP_UNIT_W, mid_y + (yy-TEMP_MAP_MIDDLE)*MAP_UNIT_W, &px, &py, &ox, &oy);
 //			load_9pages(w, px, py);
 
-			int score = 3*w->pages[px][py]->units[ox][oy].num_obstacles;
+			if(no_obstacles_near(w, px, py, ox, oy, 5))
+			{
+				scoremap[yy*TEMP_MAP_W+xx] = 0;
+				continue;
+			}
+
+			map_page_t* page = map_page(w, px, py);
+			int score = 3*PAGE_UNIT(page, ox, oy, num_obstacles);
 
 			for(int ix=-5; ix<=5; ix++)
 			{
@@ -302,7 +337,8 @@ static int gen_scoremap_for_large_steps(world_t *w, int8_t *scoremap, int mid_x,
 					if(noy < 0) { noy += MAP_PAGE_W; npy--; } else if(noy >= MAP_PAGE_W) { noy -= MAP_PAGE_W; npy++;}
 
 					int neigh_score;
-					neigh_score = 2*w->pages[npx][npy]->units[nox][noy].num_obstacles;
+					map_page_t* npage = (npx == px && npy == py) ? page : map_page(w, npx, npy);
+					neigh_score = 2*PAGE_UNIT(npage, nox, noy, num_obstacles);
 					if(neigh_score > score) score = neigh_score;
 				}
 			}
@@ -343,7 +379,7 @@ static int gen_scoremap_for_large_steps(world_t *w, int8_t *scoremap, int mid_x,
 }
 
 
-static int gen_scoremap_for_small_steps(world_t *w, int8_t *scoremap, int mid_x, int mid_y)
+int gen_scoremap_for_small_steps(world_t *w, int8_t *scoremap, int mid_x, int mid_y)
 {
 	int px, py, ox, oy;
 
@@ -359,7 +395,14 @@ static int gen_scoremap_for_small_steps(world_t *w, int8_t *scoremap, int mid_x,
 			page_coords(mid_x + (xx-TEMP_MAP_MIDDLE)*MAP_UNIT_W, mid_y + (yy-TEMP_MAP_MIDDLE)*MAP_UNIT_W, &px, &py, &ox, &oy);
 //			load_9pages(w, px, py);
 
-			int score = 3*w->pages[px][py]->units[ox][oy].num_obstacles;
+			if(no_obstacles_near(w, px, py, ox, oy, 1))
+			{
+				scoremap[yy*TEMP_MAP_W+xx] = 0;
+				continue;
+			}
+
+			map_page_t* page = map_page(w, px, py);
+			int score = 3*PAGE_UNIT(page, ox, oy, num_obstacles);
 
 			for(int ix=-1; ix<=1; ix++)
 			{
@@ -369,7 +412,8 @@ static int gen_scoremap_for_small_steps(world_t *w, int8_t *scoremap, int mid_x,
 					if(nox < 0) { nox += MAP_PAGE_W; npx--; } else if(nox >= MAP_PAGE_W) { nox -= MAP_PAGE_W; npx++;}
 					if(noy < 0) { noy += MAP_PAGE_W; npy--; } else if(noy >= MAP_PAGE_W) { noy -= MAP_PAGE_W; npy++;}
 
-					int neigh_score = 2*w->pages[npx][npy]->units[nox][noy].num_obstacles;
+					map_page_t* npage = (npx == px && npy == py) ? page : map_page(w, npx, npy);
+					int neigh_score = 2*PAGE_UNIT(npage, nox, noy, num_obstacles);
 					if(neigh_score > score) score = neigh_score;
 				}
 			}
@@ -514,6 +558,85 @@ typedef struct  // Each bit represents each lidar scan (i.e., 32 lidar scans max
 	uint32_t wall;
 } temp_map_img_t;
 
+/*
+	Merge kernel for do_mapping().
+
+	The count used for each temp_map accumulator is its bit length (highest scan index that hit the unit, plus one),
+	which is what the original shift loops calculated. With count-leading-zeros, it's a single instruction on both
+	ARM and x86.
+
+	Counts are stored in byte planes, so that the neighbor wall counts, and the test whether the unit needs to be
+	merged at all, are done 16 units at a time with saturating vector adds (GCC vector extensions: NEON on the Raspi,
+	SSE2 on x86). Rows with nothing to merge don't touch the map pages at all.
+*/
+
+typedef uint8_t v16u8_t __attribute__ ((vector_size (16)));
+
+static inline int acc_bits(uint32_t acc)
+{
+	return acc ? (32 - __builtin_clz(acc)) : 0;
+}
+
+static inline v16u8_t v16u8_load(const uint8_t* p)
+{
+	v16u8_t v;
+	memcpy(&v, p, sizeof(v)); // unaligned load
+	return v;
+}
+
+static inline v16u8_t v16u8_adds(v16u8_t a, v16u8_t b)
+{
+	v16u8_t s = a + b;
+	return s | (v16u8_t)(s < a); // Lanes which wrapped around saturate to 255.
+}
+
+static void count_temp_map(const temp_map_img_t* temp_map, uint8_t* s_cnts, uint8_t* w_cnts)
+{
+	for(int i = 0; i < TEMP_MAP_W*TEMP_MAP_W; i++)
+	{
+		s_cnts[i] = acc_bits(temp_map[i].seen);
+		w_cnts[i] = acc_bits(temp_map[i].wall);
+	}
+}
+
+/*
+	Calculates the neighbor wall counts of row iy, and flags the units that will be merged to the map
+	(clear wall, or seen without a wall). Returns 0 if there is nothing to merge on the row.
+	Row iy must not be the first or the last one.
+*/
+static int merge_row_candidates(const uint8_t* s_cnts, const uint8_t* w_cnts, int iy, uint8_t* neigh_w_cnts, uint8_t* cands)
+{
+	int n_blocks = 0;
+	for(int ix = 0; ix < TEMP_MAP_W; ix += 16)
+	{
+		const uint8_t* up  = &w_cnts[(iy-1)*TEMP_MAP_W+ix];
+		const uint8_t* mid = &w_cnts[(iy  )*TEMP_MAP_W+ix];
+		const uint8_t* dn  = &w_cnts[(iy+1)*TEMP_MAP_W+ix];
+
+		// Off-the-row lanes at both ends read the adjacent rows; they are never used, since the merge doesn't loop near the edges.
+		v16u8_t neigh = v16u8_adds(v16u8_load(up-1), v16u8_load(up));
+		neigh = v16u8_adds(neigh, v16u8_load(up+1));
+		neigh = v16u8_adds(neigh, v16u8_load(mid-1));
+		neigh = v16u8_adds(neigh, v16u8_load(mid+1));
+		neigh = v16u8_adds(neigh, v16u8_load(dn-1));
+		neigh = v16u8_adds(neigh, v16u8_load(dn));
+		neigh = v16u8_adds(neigh, v16u8_load(dn+1));
+
+		v16u8_t w = v16u8_load(mid);
+		v16u8_t s = v16u8_load(&s_cnts[iy*TEMP_MAP_W+ix]);
+		v16u8_t cand = (v16u8_t)(w > 3) | ((v16u8_t)(w == 0) & (v16u8_t)(s > 3));
+
+		memcpy(&neigh_w_cnts[ix], &neigh, sizeof(neigh));
+		memcpy(&cands[ix], &cand, sizeof(cand));
+
+		uint64_t any[2];
+		memcpy(any, &cand, sizeof(any));
+		if(any[0] | any[1])
+			n_blocks++;
+	}
+	return n_blocks;
+}
+
 static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
                       int32_t da, int32_t dx, int32_t dy, int32_t rotate_mid_x, int32_t rotate_mid_y,
                       int32_t *after_dx, int32_t *after_dy)
@@ -693,7 +816,8 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 		if(pagex != prev_visit_px || pagey != prev_visit_py || offsx != prev_visit_ox || offsy != prev_visit_oy)
 		{
 			load_1page(w, pagex, pagey);
-			PLUS_SAT_255(w->pages[pagex][pagey]->units[offsx][offsy].num_visited);
+			PLUS_SAT_255(PAGE_UNIT(map_page(w, pagex, pagey), offsx, offsy, num_visited));
+			note_unit_changed(w, pagex, pagey, offsx, offsy);
 		}
 		prev_visit_px = pagex; prev_visit_py = pagey; prev_visit_ox = offsx; prev_visit_oy = offsy;
 
@@ -747,18 +871,13 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 
 			}
 
-			int w_cnt_at_next = 0;
-
 			if(next_x < 1 || next_x >= TEMP_MAP_W-1 || next_y < 1 || next_y >= TEMP_MAP_W-1)
 			{
 				continue;
 			}
-			uint32_t tmp = temp_map[next_y*TEMP_MAP_W+next_x].wall;
-			while(tmp) { w_cnt_at_next++; tmp>>=1;}
 
-			int w_cnt_at_cur = 0;
-			tmp = temp_map[y*TEMP_MAP_W+x].wall;
-			while(tmp) { w_cnt_at_cur++; tmp>>=1;}
+			int w_cnt_at_next = acc_bits(temp_map[next_y*TEMP_MAP_W+next_x].wall);
+			int w_cnt_at_cur = acc_bits(temp_map[y*TEMP_MAP_W+x].wall);
 
 			if(w_cnt_at_next > 0 && w_cnt_at_cur > 0 && w_cnt_at_next > w_cnt_at_cur) // next spot wins
 			{
@@ -808,7 +927,7 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 */
 	// Load relevant 9 pages in memory
 	page_coords(rotate_mid_x, rotate_mid_y, &pagex, &pagey, &offsx, &offsy);
-	load_9pages(&world, pagex, pagey);
+	load_9pages(cur_world, pagex, pagey);
 
 	// Add our temporary map to the actual map.
 	// Don't loop near to the edges, we are comparing neighbouring cells inside the loop.
@@ -829,20 +948,35 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 	{
 		for(int o=0; o<3; o++)
 		{
-			memcpy(&copies[i][o], w->pages[copy_pagex_start+i][copy_pagey_start+o], sizeof(map_page_t));
+			memcpy(&copies[i][o], map_page(w, copy_pagex_start+i, copy_pagey_start+o), sizeof(map_page_t));
 			memset(spot_used[i][o], 0, MAP_PAGE_W*MAP_PAGE_W);
 		}
 	}
 
 	int avg_drift_cnt = 0, avg_drift_x = 0, avg_drift_y = 0;
 
+	static uint8_t s_cnts[TEMP_MAP_W*TEMP_MAP_W] __attribute__((aligned(16)));
+	static uint8_t w_cnts[TEMP_MAP_W*TEMP_MAP_W] __attribute__((aligned(16)));
+
+	count_temp_map(temp_map, s_cnts, w_cnts);
+
 	for(int iy = 3; iy < TEMP_MAP_W-3; iy++)
 	{
+		uint8_t neigh_w_cnts[TEMP_MAP_W] __attribute__((aligned(16)));
+		uint8_t cands[TEMP_MAP_W] __attribute__((aligned(16)));
+
+		if(!merge_row_candidates(s_cnts, w_cnts, iy, neigh_w_cnts, cands))
+			continue; // Nothing to add to the map on this row.
+
 		for(int ix = 3; ix < TEMP_MAP_W-3; ix++)
 		{
+			if(!cands[ix])
+				continue;
+
 			int x_mm = (rotate_mid_x/MAP_UNIT_W - TEMP_MAP_MIDDLE + ix)*MAP_UNIT_W;
 			int y_mm = (rotate_mid_y/MAP_UNIT_W - TEMP_MAP_MIDDLE + iy)*MAP_UNIT_W;
 			page_coords(x_mm, y_mm, &pagex, &pagey, &offsx, &offsy);
+			map_page_t* page = map_page(w, pagex, pagey);
 //			if(ix == 2 && iy == 2)
 //				printf("temp map -> map: start: page (%d, %d) offs (%d, %d)\n", pagex, pagey, offsx, offsy);
 
@@ -850,18 +984,9 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 //			if(ang_from_middle < 0.0) ang_from_middle += 8.0;
 //			int ang_idx = ang_from_middle+0.5;
 
-			int s_cnt = 0, w_cnt = 0, neigh_w_cnt = 0;
-			uint32_t tmp = temp_map[iy*TEMP_MAP_W+ix].seen; while(tmp) { s_cnt++; tmp>>=1; }
-			tmp = temp_map[iy*TEMP_MAP_W+ix].wall; while(tmp) { w_cnt++; tmp>>=1; }
-
-			tmp = temp_map[(iy)*TEMP_MAP_W+(ix+1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy)*TEMP_MAP_W+(ix-1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy+1)*TEMP_MAP_W+(ix+1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy+1)*TEMP_MAP_W+(ix-1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy+1)*TEMP_MAP_W+(ix  )].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy-1)*TEMP_MAP_W+(ix+1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy-1)*TEMP_MAP_W+(ix-1)].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
-			tmp = temp_map[(iy-1)*TEMP_MAP_W+(ix  )].wall; while(tmp) { neigh_w_cnt++; tmp>>=1; }
+			int s_cnt = s_cnts[iy*TEMP_MAP_W+ix];
+			int w_cnt = w_cnts[iy*TEMP_MAP_W+ix];
+			int neigh_w_cnt = neigh_w_cnts[ix]; // Saturated at 255, only compared against small numbers.
 
 
 			if(w_cnt > 3) // A wall is very clearly here.
@@ -895,7 +1020,7 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 					copy_px = px - copy_pagex_start;
 					copy_py = py - copy_pagey_start;
 
-					if((copies[copy_px][copy_py].units[ox][oy].num_obstacles))
+					if((PAGE_UNIT(&copies[copy_px][copy_py], ox, oy, num_obstacles)))
 					{
 						if(!spot_used[copy_px][copy_py][ox][oy])
 						{
@@ -904,14 +1029,15 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 							avg_drift_y += search_order[i][1];
 
 							// Existing wall here, it suffices, increase the seen count.
-							PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_seen);
-							PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_obstacles);
+							PLUS_SAT_255(PAGE_UNIT(map_page(w, px, py), ox, oy, num_seen));
+							PLUS_SAT_255(PAGE_UNIT(map_page(w, px, py), ox, oy, num_obstacles));
 
-							//if(w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles > 2)
-								w->pages[pagex][pagey]->units[offsx][offsy].result |= UNIT_WALL;
+							//if(PAGE_UNIT(page, offsx, offsy, num_obstacles) > 2)
+								PAGE_UNIT(page, offsx, offsy, result) |= UNIT_WALL;
 
 							spot_used[copy_px][copy_py][ox][oy] = 1;
-							w->changed[px][py] = 1;
+							mark_unit_changed(w, px, py, ox, oy);
+							note_unit_changed(w, pagex, pagey, offsx, offsy);
 							found = 1;
 							break;
 						}
@@ -921,38 +1047,38 @@ static int do_mapping(world_t* w, int n_lidars, lidar_scan_t** lidar_list,
 				if(!found)
 				{
 					// We have a new wall.
-					w->pages[pagex][pagey]->units[offsx][offsy].result |= UNIT_MAPPED;
+					PAGE_UNIT(page, offsx, offsy, result) |= UNIT_MAPPED;
 
 					// If the area is basically unmapped, just decide that the new wall is actually a wall, right away.
 					// For mapped areas, UNIT_WALL is not set right away to avoid moving people etc. being count as walls.
-					if(w->pages[pagex][pagey]->units[offsx][offsy].num_seen < 2)
-						w->pages[pagex][pagey]->units[offsx][offsy].result |= UNIT_WALL;
+					if(PAGE_UNIT(page, offsx, offsy, num_seen) < 2)
+						PAGE_UNIT(page, offsx, offsy, result) |= UNIT_WALL;
 
-					PLUS_SAT_255(w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles);
-					PLUS_SAT_255(w->pages[pagex][pagey]->units[offsx][offsy].num_seen);
-					w->changed[pagex][pagey] = 1;
+					PLUS_SAT_255(PAGE_UNIT(page, offsx, offsy, num_obstacles));
+					PLUS_SAT_255(PAGE_UNIT(page, offsx, offsy, num_seen));
+					mark_unit_changed(w, pagex, pagey, offsx, offsy);
 				}
 			}
 
 			if(w_cnt == 0 && s_cnt > 3)
 			{
 				// We don't have a wall, but we mapped this unit nevertheless.
-				w->pages[pagex][pagey]->units[offsx][offsy].result |= UNIT_MAPPED;
-				PLUS_SAT_255(w->pages[pagex][pagey]->units[offsx][offsy].num_seen);
+				PAGE_UNIT(page, offsx, offsy, result) |= UNIT_MAPPED;
+				PLUS_SAT_255(PAGE_UNIT(page, offsx, offsy, num_seen));
 
-				MINUS_SAT_0(w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles);
+				MINUS_SAT_0(PAGE_UNIT(page, offsx, offsy, num_obstacles));
 
 				if(
 				   ( s_cnt > 5 && neigh_w_cnt == 0 && // we are quite sure:
-				   ((int)w->pages[pagex][pagey]->units[offsx][offsy].num_seen > (2*(int)w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles + 3)))
+				   ((int)PAGE_UNIT(page, offsx, offsy, num_seen) > (2*(int)PAGE_UNIT(page, offsx, offsy, num_obstacles) + 3)))
 				   || (neigh_w_cnt < 2 &&  // there is 1 wall neighbor, so we are not so sure, but do it eventually.
-				   ((int)w->pages[pagex][pagey]->units[offsx][offsy].num_seen > (5*(int)w->pages[pagex][pagey]->units[offsx][offsy].num_obstacles + 10))))
+				   ((int)PAGE_UNIT(page, offsx, offsy, num_seen) > (5*(int)PAGE_UNIT(page, offsx, offsy, num_obstacles) + 10))))
 				{
 					// Wall has vanished
-					w->pages[pagex][pagey]->units[offsx][offsy].result &= ~(UNIT_WALL);
+					PAGE_UNIT(page, offsx, offsy, result) &= ~(UNIT_WALL);
 				}
 
-				w->changed[pagex][pagey] = 1;
+				mark_unit_changed(w, pagex, pagey, offsx, offsy);
 			}
 		}
 	}
@@ -1060,6 +1186,7 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 		}
 	}
 
+	replay_record_lidars(n_lidars, lidar_list);
 
 	time = subsec_timestamp();
 	prefilter_lidar_list(n_lidars, lidar_list);
@@ -1222,7 +1349,8 @@ int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int
 				tcp_send_statevect();
 		}
 
-		tcp_send_localization_result(corr_da, corr_dx, corr_dy, success_code, best_score);
+		if(tcp_client_sock >= 0)
+			tcp_send_localization_result(corr_da, corr_dx, corr_dy, success_code, best_score);
 
 
 	}
@@ -1267,6 +1395,125 @@ void tofs_avg_midpoint(int n_tofs, tof3d_scan_t** tof_list, int32_t* mid_x, int3
 }
 
 
+#define TOF_TEMP_MIDDLE (MAP_PAGE_W/2)
+
+/*
+	Copies 3DTOF tempmaps (MAP_PAGE_W*MAP_PAGE_W, centered at mid_x, mid_y) to the actual map.
+
+	If observed is given, it holds the number of scans which actually saw each unit, and the limits are relative
+	to that count. Otherwise, the limits are relative to n_tofs.
+*/
+static int commit_3dtof_tempmaps(world_t* w, int32_t mid_x, int32_t mid_y, int n_tofs, const uint8_t* observed,
+	const uint8_t* drops, const uint8_t* items, const uint8_t* walls, const uint8_t* maybes, const uint8_t* seens)
+{
+	int mid_px, mid_py, mid_ox, mid_oy;
+	page_coords(mid_x, mid_y, &mid_px, &mid_py, &mid_ox, &mid_oy);
+	load_9pages(cur_world, mid_px, mid_py);
+
+	int start_px, start_py, start_ox, start_oy;
+	page_coords(mid_x-TOF_TEMP_MIDDLE*MAP_UNIT_W, mid_y-TOF_TEMP_MIDDLE*MAP_UNIT_W, &start_px, &start_py, &start_ox, &start_oy);
+
+	int cnt_drop = 0, cnt_item = 0, cnt_3dwall = 0, cnt_removal = 0, cnt_total_removal = 0;
+
+	int py = start_py; int oy = start_oy;
+	for(int iy=0; iy < MAP_PAGE_W; iy++)
+	{
+		int px = start_px; int ox = start_ox;
+		for(int ix=0; ix < MAP_PAGE_W; ix++)
+		{
+			if(ox < 0 || ox >= MAP_PAGE_W || oy < 0 || oy >= MAP_PAGE_W || px < 0 || px >= MAP_W || py < 0 || py >= MAP_W)
+			{
+				printf("ERROR: map_3dtof: invalid page coords (page (%d, %d), offs (%d, %d))\n", px, py, ox, oy);
+				continue;
+			}
+
+			map_page_t* page = map_page(w, px, py);
+			if(!page)
+			{
+				printf("ERROR: map_3dtof: page (%d, %d) unallocated!\n", px, py);
+				return -1;
+			}
+
+			int n = observed ? observed[iy*MAP_PAGE_W+ix] : n_tofs;
+
+			int wall_limit = n/2+1;
+			int item_limit = n/2+1;
+			int drop_limit = n/3+1;
+			int seen_total_removal_limit = (2*n)/3+1;
+			int seen_removal_limit = 1; //n/4+1;
+
+			if(n == 0)
+			{
+				// Not observed, nothing to do.
+			}
+			else if(walls[iy*MAP_PAGE_W+ix] >= wall_limit)
+			{
+				if(!(PAGE_UNIT(page, ox, oy, result) & UNIT_3D_WALL)) mark_unit_changed(w, px, py, ox, oy);
+				PAGE_UNIT(page, ox, oy, result) |= UNIT_3D_WALL;
+				PAGE_UNIT(page, ox, oy, latest) |= UNIT_3D_WALL;
+				PLUS_SAT_255(PAGE_UNIT(page, ox, oy, num_3d_obstacles));
+				note_unit_changed(w, px, py, ox, oy);
+				cnt_3dwall++;
+			}
+			else if(items[iy*MAP_PAGE_W+ix] >= item_limit)
+			{
+				if(!(PAGE_UNIT(page, ox, oy, result) & UNIT_ITEM)) mark_unit_changed(w, px, py, ox, oy);
+				PAGE_UNIT(page, ox, oy, result) |= UNIT_ITEM;
+				PAGE_UNIT(page, ox, oy, latest) |= UNIT_ITEM;
+				PLUS_SAT_255(PAGE_UNIT(page, ox, oy, num_3d_obstacles));
+				note_unit_changed(w, px, py, ox, oy);
+				cnt_item++;
+			}
+			else if(drops[iy*MAP_PAGE_W+ix] >= drop_limit)
+			{
+				if(!(PAGE_UNIT(page, ox, oy, result) & UNIT_DROP)) mark_unit_changed(w, px, py, ox, oy);
+				PAGE_UNIT(page, ox, oy, result) |= UNIT_DROP;
+				PAGE_UNIT(page, ox, oy, latest) |= UNIT_DROP;
+				PLUS_SAT_255(PAGE_UNIT(page, ox, oy, num_3d_obstacles));
+				note_unit_changed(w, px, py, ox, oy);
+				cnt_drop++;
+			}
+			else if(seens[iy*MAP_PAGE_W+ix] >= seen_total_removal_limit && maybes[iy*MAP_PAGE_W+ix] == 0 && drops[iy*MAP_PAGE_W+ix] == 0 && items[iy*MAP_PAGE_W+ix] == 0 && walls[iy*MAP_PAGE_W+ix] == 0)
+			{
+				if(PAGE_UNIT(page, ox, oy, result) & (UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL)) mark_unit_changed(w, px, py, ox, oy);
+				PAGE_UNIT(page, ox, oy, result) &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL);
+				PAGE_UNIT(page, ox, oy, latest) &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL);
+				PAGE_UNIT(page, ox, oy, num_3d_obstacles) = 0;
+				cnt_total_removal++;
+			}
+			else if(seens[iy*MAP_PAGE_W+ix] >= seen_removal_limit && drops[iy*MAP_PAGE_W+ix] == 0 && items[iy*MAP_PAGE_W+ix] == 0 && walls[iy*MAP_PAGE_W+ix] == 0)
+			{
+				// Clear neighbors as well. But to save time/complexity, don't go over page borders.
+				for(int nx=-1; nx<=1; nx++)
+				{
+					for(int ny=-1; ny<=1; ny++)
+					{
+						int oxn = ox+nx; if(oxn < 0 || oxn >= MAP_PAGE_W) continue;
+						int oyn = oy+ny; if(oyn < 0 || oyn >= MAP_PAGE_W) continue;
+						if(PAGE_UNIT(page, oxn, oyn, result) & (UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL)) mark_unit_changed(w, px, py, oxn, oyn);
+						PAGE_UNIT(page, oxn, oyn, result) &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL);
+						PAGE_UNIT(page, oxn, oyn, latest) &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL);
+						PAGE_UNIT(page, oxn, oyn, num_3d_obstacles) = 0;
+						cnt_removal++;
+
+					}
+				}
+			}
+
+			ox++;
+			if(ox >= MAP_PAGE_W) { ox=0; px++;}
+		}
+
+		oy++;
+		if(oy >= MAP_PAGE_W) { oy=0; py++;}
+	}
+
+//	printf("3D TOF objmap inserted: added %d drops, %d items and %d 3dwalls. Cleared %d units; of which %d confidently\n", 
+//		cnt_drop, cnt_item, cnt_3dwall, cnt_removal+cnt_total_removal, cnt_total_removal);
+
+	return 0;
+}
+
 int map_3dtof(world_t* w, int n_tofs, tof3d_scan_t** tof_list, int32_t *mx, int32_t *my)
 {
 //	printf("Mapping %d  3DTOF scans\n", n_tofs);
@@ -1278,11 +1525,11 @@ int map_3dtof(world_t* w, int n_tofs, tof3d_scan_t** tof_list, int32_t *mx, int3
 	// Rotate and move 3DTOF points to absolute world coordinates, insert them into temporary (composite) map.
 	// Filter moving / unsure objects by using value closest to 0 at each point.
 
-	int8_t *drops =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
-	int8_t *items =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
-	int8_t *walls =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
-	int8_t *maybes = calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
-	int8_t *seens =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(int8_t));
+	uint8_t *drops =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(uint8_t));
+	uint8_t *items =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(uint8_t));
+	uint8_t *walls =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(uint8_t));
+	uint8_t *maybes = calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(uint8_t));
+	uint8_t *seens =  calloc(MAP_PAGE_W*MAP_PAGE_W, sizeof(uint8_t));
 
 	if(!drops || !items || !walls || !maybes || !seens)
 	{
@@ -1295,8 +1542,6 @@ int map_3dtof(world_t* w, int n_tofs, tof3d_scan_t** tof_list, int32_t *mx, int3
 		return -1;
 	}
 
-	#define TOF_TEMP_MIDDLE (MAP_PAGE_W/2)
-
 	int out_of_area_ignores = 0;
 	for(int t=0; t < n_tofs; t++)
 	{
@@ -1343,115 +1588,181 @@ int map_3dtof(world_t* w, int n_tofs, tof3d_scan_t** tof_list, int32_t *mx, int3
 	if(out_of_area_ignores > 100)
 		printf("Ignored %d far-away points not fitting to tempmap.\n", out_of_area_ignores);
 
-	// Copy tempmaps to actual map
+	int ret = commit_3dtof_tempmaps(w, mid_x, mid_y, n_tofs, NULL, drops, items, walls, maybes, seens);
 
-	int mid_px, mid_py, mid_ox, mid_oy;
-	page_coords(mid_x, mid_y, &mid_px, &mid_py, &mid_ox, &mid_oy);
-	load_9pages(&world, mid_px, mid_py);
+	free(drops);
+	free(items);
+	free(walls);
+	free(maybes);
+	free(seens);
 
-	int start_px, start_py, start_ox, start_oy;
-	page_coords(mid_x-TOF_TEMP_MIDDLE*MAP_UNIT_W, mid_y-TOF_TEMP_MIDDLE*MAP_UNIT_W, &start_px, &start_py, &start_ox, &start_oy);
+	return ret;
+}
 
-	int cnt_drop = 0, cnt_item = 0, cnt_3dwall = 0, cnt_removal = 0, cnt_total_removal = 0;
+/*
+	3DTOF temporal fusion
 
-	int wall_limit = n_tofs/2+1;
-	int item_limit = n_tofs/2+1;
-	int drop_limit = n_tofs/3+1;
-	int seen_total_removal_limit = (2*n_tofs)/3+1;
-	int seen_removal_limit = 1; //n_tofs/4+1;
+	Instead of writing every small batch of objmaps to the world map, consecutive scans are accumulated in a
+	robot-centric fusion buffer. The buffer is world-aligned and anchored at the robot position of its first scan;
+	every scan is motion-compensated by its own robot pose (rotated by its heading, shifted by its position delta from
+	the anchor).
 
-	int py = start_py; int oy = start_oy;
-	for(int iy=0; iy < MAP_PAGE_W; iy++)
+	Each unit also counts how many scans actually observed it, and the commit limits are relative to that count
+	instead of the total number of scans, so that units near the edge of the view don't need to win over scans
+	which never saw them.
+
+	The buffer is committed to the world map when the robot has moved TOF_FUSION_COMMIT_DIST away from the anchor,
+	or TOF_FUSION_COMMIT_SCANS scans have been accumulated. A stationary robot thus writes the world once per
+	TOF_FUSION_COMMIT_SCANS scans, and a slowly moving one once per TOF_FUSION_COMMIT_DIST.
+*/
+
+#define TOF_FUSION_COMMIT_DIST  240 // mm from the anchor
+#define TOF_FUSION_COMMIT_SCANS 20
+#define TOF_FUSION_JUMP_DIST    500 // mm between two consecutive scans: coordinates have been changed, don't fuse over that.
+
+typedef struct
+{
+	int n_scans;
+	int32_t anchor_x, anchor_y;
+	int32_t prev_x, prev_y;
+
+	uint8_t observed[MAP_PAGE_W*MAP_PAGE_W];
+	uint8_t drops[MAP_PAGE_W*MAP_PAGE_W];
+	uint8_t items[MAP_PAGE_W*MAP_PAGE_W];
+	uint8_t walls[MAP_PAGE_W*MAP_PAGE_W];
+	uint8_t maybes[MAP_PAGE_W*MAP_PAGE_W];
+	uint8_t seens[MAP_PAGE_W*MAP_PAGE_W];
+} tof_fusion_t;
+
+static tof_fusion_t tof_fusion;
+
+// Statistics: number of scans fused, and number of world map writes.
+static int tof_fusion_scans_total, tof_fusion_commits_total;
+
+void reset_3dtof_fusion()
+{
+	tof_fusion.n_scans = 0;
+	memset(tof_fusion.observed, 0, sizeof(tof_fusion.observed));
+	memset(tof_fusion.drops,    0, sizeof(tof_fusion.drops));
+	memset(tof_fusion.items,    0, sizeof(tof_fusion.items));
+	memset(tof_fusion.walls,    0, sizeof(tof_fusion.walls));
+	memset(tof_fusion.maybes,   0, sizeof(tof_fusion.maybes));
+	memset(tof_fusion.seens,    0, sizeof(tof_fusion.seens));
+}
+
+static void fuse_3dtof_scan(tof3d_scan_t* tof)
+{
+	float ang = -1*ANG32TORAD(tof->robot_pos.ang);
+	float cos_a = cos(ang);
+	float sin_a = sin(ang);
+
+	// Robot position relative to the anchor
+	float robot_dx = tof->robot_pos.x - tof_fusion.anchor_x;
+	float robot_dy = tof->robot_pos.y - tof_fusion.anchor_y;
+
+	for(int iy=0; iy < TOF3D_HMAP_YSPOTS; iy++)
 	{
-		int px = start_px; int ox = start_ox;
-		for(int ix=0; ix < MAP_PAGE_W; ix++)
+		for(int ix=0; ix < TOF3D_HMAP_XSPOTS; ix++)
 		{
-			if(ox < 0 || ox >= MAP_PAGE_W || oy < 0 || oy >= MAP_PAGE_W || px < 0 || px >= MAP_W || py < 0 || py >= MAP_W)
-			{
-				printf("ERROR: map_3dtof: invalid page coords (page (%d, %d), offs (%d, %d))\n", px, py, ox, oy);
+			int8_t obj = tof->objmap[iy*TOF3D_HMAP_XSPOTS+ix];
+			if(obj == TOF3D_UNSEEN)
 				continue;
-			}
 
-			if(!w->pages[px][py])
-			{
-				printf("ERROR: map_3dtof: page (%d, %d) unallocated!\n", px, py);
-				free(drops);
-				free(items);
-				free(walls);
-				free(maybes);
-				free(seens);
+			float spot_x = (float)(ix-TOF3D_HMAP_XMIDDLE)*(float)TOF3D_HMAP_SPOT_SIZE;
+			float spot_y = (float)(iy-TOF3D_HMAP_YMIDDLE)*(float)TOF3D_HMAP_SPOT_SIZE;
+			int rotax = spot_x*cos_a + spot_y*sin_a + robot_dx;
+			int rotay = -1*spot_x*sin_a + spot_y*cos_a + robot_dy;
 
-				return -1;
-			}
+			int tm_x = rotax/MAP_UNIT_W + TOF_TEMP_MIDDLE;
+			int tm_y = rotay/MAP_UNIT_W + TOF_TEMP_MIDDLE;
 
-			if(walls[iy*MAP_PAGE_W+ix] >= wall_limit)
-			{
-				if(!(w->pages[px][py]->units[ox][oy].result & UNIT_3D_WALL)) w->changed[px][py] = 1;
-				w->pages[px][py]->units[ox][oy].result |= UNIT_3D_WALL;
-				w->pages[px][py]->units[ox][oy].latest |= UNIT_3D_WALL;
-				PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_3d_obstacles);
-				cnt_3dwall++;
-			}
-			else if(items[iy*MAP_PAGE_W+ix] >= item_limit)
-			{
-				if(!(w->pages[px][py]->units[ox][oy].result & UNIT_ITEM)) w->changed[px][py] = 1;
-				w->pages[px][py]->units[ox][oy].result |= UNIT_ITEM;
-				w->pages[px][py]->units[ox][oy].latest |= UNIT_ITEM;
-				PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_3d_obstacles);
-				cnt_item++;
-			}
-			else if(drops[iy*MAP_PAGE_W+ix] >= drop_limit)
-			{
-				if(!(w->pages[px][py]->units[ox][oy].result & UNIT_DROP)) w->changed[px][py] = 1;
-				w->pages[px][py]->units[ox][oy].result |= UNIT_DROP;
-				w->pages[px][py]->units[ox][oy].latest |= UNIT_DROP;
-				PLUS_SAT_255(w->pages[px][py]->units[ox][oy].num_3d_obstacles);
-				cnt_drop++;
-			}
-			else if(seens[iy*MAP_PAGE_W+ix] >= seen_total_removal_limit && maybes[iy*MAP_PAGE_W+ix] == 0 && drops[iy*MAP_PAGE_W+ix] == 0 && items[iy*MAP_PAGE_W+ix] == 0 && walls[iy*MAP_PAGE_W+ix] == 0)
-			{
-				if(w->pages[px][py]->units[ox][oy].result & (UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL)) w->changed[px][py] = 1;
-				w->pages[px][py]->units[ox][oy].result &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL);
-				w->pages[px][py]->units[ox][oy].latest &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL | UNIT_INVISIBLE_WALL);
-				w->pages[px][py]->units[ox][oy].num_3d_obstacles = 0;
-				cnt_total_removal++;
-			}
-			else if(seens[iy*MAP_PAGE_W+ix] >= seen_removal_limit && drops[iy*MAP_PAGE_W+ix] == 0 && items[iy*MAP_PAGE_W+ix] == 0 && walls[iy*MAP_PAGE_W+ix] == 0)
+			if(tm_x < 0 || tm_x >= MAP_PAGE_W || tm_y < 0 || tm_y >= MAP_PAGE_W)
+				continue;
+
+			int i = tm_y*MAP_PAGE_W+tm_x;
+			PLUS_SAT_255(tof_fusion.observed[i]);
+
+			switch(obj)
 			{
-				// Clear neighbors as well. But to save time/complexity, don't go over page borders.
-				for(int nx=-1; nx<=1; nx++)
-				{
-					for(int ny=-1; ny<=1; ny++)
-					{
-						int oxn = ox+nx; if(oxn < 0 || oxn >= MAP_PAGE_W) continue;
-						int oyn = oy+ny; if(oyn < 0 || oyn >= MAP_PAGE_W) continue;
-						if(w->pages[px][py]->units[oxn][oyn].result & (UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL)) w->changed[px][py] = 1;
-						w->pages[px][py]->units[oxn][oyn].result &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL);
-						w->pages[px][py]->units[oxn][oyn].latest &= ~(UNIT_DROP | UNIT_ITEM | UNIT_3D_WALL);
-						w->pages[px][py]->units[oxn][oyn].num_3d_obstacles = 0;
-						cnt_removal++;
+				case TOF3D_BIG_DROP     : PLUS_SAT_255(tof_fusion.drops[i]); break;
 
-					}
-				}
-			}
+				case TOF3D_SMALL_DROP   :
+				case TOF3D_THRESHOLD    : PLUS_SAT_255(tof_fusion.maybes[i]); break;
 
-			ox++;
-			if(ox >= MAP_PAGE_W) { ox=0; px++;}
+				case TOF3D_SMALL_ITEM   :
+				case TOF3D_BIG_ITEM     :
+				case TOF3D_LOW_CEILING  : PLUS_SAT_255(tof_fusion.items[i]); break;
+
+				case TOF3D_WALL         : PLUS_SAT_255(tof_fusion.walls[i]); break;
+
+				case TOF3D_FLOOR        : PLUS_SAT_255(tof_fusion.seens[i]); break;
+				default: break;
+			}
 		}
+	}
 
-		oy++;
-		if(oy >= MAP_PAGE_W) { oy=0; py++;}
+	tof_fusion.n_scans++;
+	tof_fusion_scans_total++;
+}
+
+/*
+	Commits the fusion buffer to the world map, if there is anything to commit.
+	Returns 1 if the world map was written, with the anchor point in mx, my.
+*/
+int flush_3dtof_fusion(world_t* w, int32_t *mx, int32_t *my)
+{
+	if(tof_fusion.n_scans == 0)
+		return 0;
+
+	*mx = tof_fusion.anchor_x;
+	*my = tof_fusion.anchor_y;
+
+	commit_3dtof_tempmaps(w, tof_fusion.anchor_x, tof_fusion.anchor_y, tof_fusion.n_scans, tof_fusion.observed,
+		tof_fusion.drops, tof_fusion.items, tof_fusion.walls, tof_fusion.maybes, tof_fusion.seens);
+	tof_fusion_commits_total++;
+
+//	printf("3DTOF fusion: committed %d scans; total %d scans in %d world map writes\n", tof_fusion.n_scans, tof_fusion_scans_total, tof_fusion_commits_total);
+
+	reset_3dtof_fusion();
+	return 1;
+}
+
+/*
+	Adds a 3DTOF scan to the fusion buffer, committing the buffer first or after, if needed.
+	Returns 1 if the world map was written (the area around mx, my has changed), 0 if the scan was only buffered.
+*/
+int fuse_3dtof(world_t* w, tof3d_scan_t* tof, int32_t *mx, int32_t *my)
+{
+	int committed = 0;
+
+	replay_record_tof(tof);
+
+	int64_t jump_x = tof->robot_pos.x - tof_fusion.prev_x;
+	int64_t jump_y = tof->robot_pos.y - tof_fusion.prev_y;
+	if(tof_fusion.n_scans > 0 && sq(jump_x) + sq(jump_y) > sq(TOF_FUSION_JUMP_DIST))
+	{
+		// Robot coordinates jumped: commit what we have in the old coordinates, start over.
+		committed = flush_3dtof_fusion(w, mx, my);
 	}
 
-	free(drops);
-	free(items);
-	free(walls);
-	free(maybes);
-	free(seens);
-//	printf("3D TOF objmap inserted: added %d drops, %d items and %d 3dwalls. Cleared %d units; of which %d confidently\n", 
-//		cnt_drop, cnt_item, cnt_3dwall, cnt_removal+cnt_total_removal, cnt_total_removal);
+	if(tof_fusion.n_scans == 0)
+	{
+		tof_fusion.anchor_x = tof->robot_pos.x;
+		tof_fusion.anchor_y = tof->robot_pos.y;
+	}
 
-	return 0;
+	fuse_3dtof_scan(tof);
+	tof_fusion.prev_x = tof->robot_pos.x;
+	tof_fusion.prev_y = tof->robot_pos.y;
+
+	int64_t moved_x = tof->robot_pos.x - tof_fusion.anchor_x;
+	int64_t moved_y = tof->robot_pos.y - tof_fusion.anchor_y;
+	if(tof_fusion.n_scans >= TOF_FUSION_COMMIT_SCANS || sq(moved_x) + sq(moved_y) >= sq(TOF_FUSION_COMMIT_DIST))
+	{
+		committed = flush_3dtof_fusion(w, mx, my);
+	}
+
+	return committed;
 }
 
 
@@ -1578,10 +1889,10 @@ void map_collision_obstacle(world_t* w, int32_t now_ang, int now_x, int now_y, i
 				y += sin(ANG32TORAD(angle))*(float)ASSUMED_ITEM_STEP_SIZE;
 
 				page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
-				load_9pages(&world, idx_x, idx_y);
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_INVISIBLE_WALL;
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].latest |= UNIT_INVISIBLE_WALL;
-				w->changed[idx_x][idx_y] = 1;
+				load_9pages(cur_world, idx_x, idx_y);
+				PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) |= UNIT_INVISIBLE_WALL;
+				PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, latest) |= UNIT_INVISIBLE_WALL;
+				mark_unit_changed(w, idx_x, idx_y, offs_x, offs_y);
 			}
 		}
 	}
@@ -1604,10 +1915,10 @@ void map_collision_obstacle(world_t* w, int32_t now_ang, int now_x, int now_y, i
 			y += sin(ANG32TORAD(angle))*(float)ASSUMED_ITEM_STEP_SIZE;
 
 			page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
-			load_9pages(&world, idx_x, idx_y);
-			world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_INVISIBLE_WALL;
-			world.pages[idx_x][idx_y]->units[offs_x][offs_y].latest |= UNIT_INVISIBLE_WALL;
-			w->changed[idx_x][idx_y] = 1;
+			load_9pages(cur_world, idx_x, idx_y);
+			PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) |= UNIT_INVISIBLE_WALL;
+			PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, latest) |= UNIT_INVISIBLE_WALL;
+			mark_unit_changed(w, idx_x, idx_y, offs_x, offs_y);
 		}
 	}
 
@@ -1627,12 +1938,12 @@ void map_collision_obstacle(world_t* w, int32_t now_ang, int now_x, int now_y, i
 				float y = (float)now_y + sin( ANG32TORAD(now_ang) + vect_ang_rad+((float)i*2.0*M_PI/32.0) )*(float)dist_to_outline;
 
 				page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
-				load_9pages(&world, idx_x, idx_y);
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_ITEM | UNIT_WALL | UNIT_DO_NOT_REMOVE_BY_LIDAR;
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].latest |= UNIT_ITEM | UNIT_WALL | UNIT_DO_NOT_REMOVE_BY_LIDAR;
-				PLUS_SAT_255(world.pages[idx_x][idx_y]->units[offs_x][offs_y].num_obstacles);
-				PLUS_SAT_255(world.pages[idx_x][idx_y]->units[offs_x][offs_y].num_obstacles);
-				w->changed[idx_x][idx_y] = 1;
+				load_9pages(cur_world, idx_x, idx_y);
+				PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) |= UNIT_ITEM | UNIT_WALL | UNIT_DO_NOT_REMOVE_BY_LIDAR;
+				PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, latest) |= UNIT_ITEM | UNIT_WALL | UNIT_DO_NOT_REMOVE_BY_LIDAR;
+				PLUS_SAT_255(PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, num_obstacles));
+				PLUS_SAT_255(PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, num_obstacles));
+				mark_unit_changed(w, idx_x, idx_y, offs_x, offs_y);
 			}
 		} */
 	}
@@ -1666,19 +1977,19 @@ void clear_within_robot(world_t* w, pos_t pos)
 			y += sin(ANG32TORAD(angle))*(float)20.0;
 
 			page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
-			load_1page(&world, idx_x, idx_y);
-			if((world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_WALL) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_ITEM) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_INVISIBLE_WALL) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_3D_WALL) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_DROP) ||
-			   (world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_ITEM) )
+			load_1page(cur_world, idx_x, idx_y);
+			if((PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) & UNIT_WALL) ||
+			   (PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) & UNIT_ITEM) ||
+			   (PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) & UNIT_INVISIBLE_WALL) ||
+			   (PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) & UNIT_3D_WALL) ||
+			   (PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) & UNIT_DROP) ||
+			   (PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) & UNIT_ITEM) )
 			{
-				MINUS_SAT_0(world.pages[idx_x][idx_y]->units[offs_x][offs_y].num_obstacles);
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].num_3d_obstacles = 0;
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].result = UNIT_MAPPED;
-				world.pages[idx_x][idx_y]->units[offs_x][offs_y].latest = UNIT_MAPPED;
-				w->changed[idx_x][idx_y] = 1;
+				MINUS_SAT_0(PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, num_obstacles));
+				PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, num_3d_obstacles) = 0;
+				PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) = UNIT_MAPPED;
+				PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, latest) = UNIT_MAPPED;
+				mark_unit_changed(w, idx_x, idx_y, offs_x, offs_y);
 			}
 		}
 	}
@@ -1695,7 +2006,8 @@ void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars)
 		{
 			//printf("Mapping a sonar item at (%d, %d) z=%d c=%d\n", p_sonars[i].x, p_sonars[i].y, p_sonars[i].z, p_sonars[i].c);
 			page_coords(p_sonars[i].x,p_sonars[i].y, &idx_x, &idx_y, &offs_x, &offs_y);
-			world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_ITEM;
+			PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) |= UNIT_ITEM;
+			note_unit_changed(cur_world, idx_x, idx_y, offs_x, offs_y);
 		}
 	}
 
@@ -1743,8 +2055,9 @@ void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars)
 					for(int iy=-5*MAP_UNIT_W; iy<=5*MAP_UNIT_W; iy+=MAP_UNIT_W)
 					{	
 						page_coords(x+ix,y+iy, &idx_x, &idx_y, &offs_x, &offs_y);
-						load_9pages(&world, idx_x, idx_y);
-						world.pages[idx_x][idx_y]->units[offs_x][offs_y].result &= ~(UNIT_ITEM);
+						load_9pages(cur_world, idx_x, idx_y);
+						PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) &= ~(UNIT_ITEM);
+						note_unit_changed(cur_world, idx_x, idx_y, offs_x, offs_y);
 					}
 				}
 
@@ -1768,9 +2081,9 @@ void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars)
 			int x = p_son->scan[i].x+search_order[s][0]*MAP_UNIT_W;
 			int y = p_son->scan[i].y+search_order[s][1]*MAP_UNIT_W;
 			page_coords(x,y, &idx_x, &idx_y, &offs_x, &offs_y);
-			load_9pages(&world, idx_x, idx_y);
+			load_9pages(cur_world, idx_x, idx_y);
 
-			if(world.pages[idx_x][idx_y]->units[offs_x][offs_y].result & UNIT_ITEM)
+			if(PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) & UNIT_ITEM)
 			{
 //				printf("Item already mapped\n");
 				goto ALREADY_MAPPED_ITEM;
@@ -1785,7 +2098,8 @@ void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars)
 		if(sqdist < sq(1500))
 		{
 			page_coords(p_son->scan[i].x,p_son->scan[i].y, &idx_x, &idx_y, &offs_x, &offs_y);
-			world.pages[idx_x][idx_y]->units[offs_x][offs_y].result |= UNIT_ITEM;
+			PAGE_UNIT(map_page(cur_world, idx_x, idx_y), offs_x, offs_y, result) |= UNIT_ITEM;
+			note_unit_changed(cur_world, idx_x, idx_y, offs_x, offs_y);
 //			printf("Mapping an item\n");
 			//world.changed[idx_x][idx_y] = 1;
 		}
@@ -1814,13 +2128,14 @@ int unfamiliarity_score(world_t* w, int x, int y)
 			int px, py, ox, oy;
 			page_coords(xx,yy, &px, &py, &ox, &oy);
 
-			if(w->pages[px][py])
+			map_page_t* page = map_page(w, px, py);
+			if(page)
 			{
-				if(w->pages[px][py]->units[ox][oy].result & UNIT_WALL) n_walls++;
+				if(PAGE_UNIT(page, ox, oy, result) & UNIT_WALL) n_walls++;
 				if(n_walls > 1)
 					return 0;
-				n_seen += w->pages[px][py]->units[ox][oy].num_seen;
-				n_visited += w->pages[px][py]->units[ox][oy].num_visited;
+				n_seen += PAGE_UNIT(page, ox, oy, num_seen);
+				n_visited += PAGE_UNIT(page, ox, oy, num_visited);
 			}
 
 		}
@@ -2110,7 +2425,7 @@ void autofsm()
 
 			daiju_mode(0);
 
-			int unfam_score = find_unfamiliar_direction_randomly(&world, &desired_x, &desired_y);
+			int unfam_score = find_unfamiliar_direction_randomly(cur_world, &desired_x, &desired_y);
 
 			if(unfam_score)
 			{
@@ -2166,7 +2481,7 @@ void autofsm()
 			else
 			{
 				int ret;
-				if( (ret = minimap_find_mapping_dir(&world, ANG32TORAD(cur_ang), &dx, &dy, desired_x-cur_x, desired_y-cur_y, &need_to_back)) )
+				if( (ret = minimap_find_mapping_dir(cur_world, ANG32TORAD(cur_ang), &dx, &dy, desired_x-cur_x, desired_y-cur_y, &need_to_back)) )
 				{
 					printf("Found direction\n");
 					if(movement_id == cur_xymove.id)
@@ -2307,7 +2622,7 @@ void dbg_test()
 	int need_to_back = 0;
 	extern int32_t cur_ang;
 	extern int32_t cur_x, cur_y;
-	if(minimap_find_mapping_dir(&world, ANG32TORAD(cur_ang), &dx, &dy, 0, 0, &need_to_back))
+	if(minimap_find_mapping_dir(cur_world, ANG32TORAD(cur_ang), &dx, &dy, 0, 0, &need_to_back))
 	{
 		printf("DBG_TEST: Found direction dx=%d  dy=%d  need_to_back=%d\n", dx, dy, need_to_back);
 		if(tcp_client_sock >= 0) tcp_send_dbgpoint(cur_x+dx, cur_x+dy, need_to_back?210:0, need_to_back?0:210, 0, 0);
@@ -2323,8 +2638,8 @@ void add_map_constraint(world_t* w, int32_t x, int32_t y)
 	int px, py, ox, oy;
 	page_coords(x, y, &px, &py, &ox, &oy);
 	load_1page(w, px, py);
-	w->pages[px][py]->units[ox][oy].constraints |= CONSTRAINT_FORBIDDEN;
-	w->changed[px][py] = 1;
+	PAGE_UNIT(map_page(w, px, py), ox, oy, constraints) |= CONSTRAINT_FORBIDDEN;
+	mark_unit_changed(w, px, py, ox, oy);
 }
 
 void remove_map_constraint(world_t* w, int32_t x, int32_t y)
@@ -2332,6 +2647,6 @@ void remove_map_constraint(world_t* w, int32_t x, int32_t y)
 	int px, py, ox, oy;
 	page_coords(x, y, &px, &py, &ox, &oy);
 	load_1page(w, px, py);
-	w->pages[px][py]->units[ox][oy].constraints &= ~(CONSTRAINT_FORBIDDEN);
-	w->changed[px][py] = 1;
+	PAGE_UNIT(map_page(w, px, py), ox, oy, constraints) &= ~(CONSTRAINT_FORBIDDEN);
+	mark_unit_changed(w, px, py, ox, oy);
 }
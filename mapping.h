@@ -89,11 +89,46 @@ Quick map only holds the mapping result byte, and with half*half resolution; 1 m
 #define QMAP_PAGE_W_MM (QMAP_UNIT_W * QMAP_PAGE_W)
 
 
+/*
+Page layout: by default, a map page is an array of map_unit_t. With -DMAP_PAGE_PLANAR, every field of map_unit_t is
+stored as its own 256*256 byte plane instead. Most of the hot loops only read one or two fields (routing page
+generation: result and constraints, scoremap: num_obstacles, unfamiliarity: num_seen and num_visited), and with
+the planes they stream through 64 KB per field instead of dragging the whole 512 KB page through the cache.
+
+Access units with PAGE_UNIT(page, x, y, field), which works with both layouts and is an lvalue. Code handling
+whole units (disk I/O, checksums) uses PAGE_UNIT_BYTE(page, x, y, b): byte b of the unit, in map_unit_t order.
+The planes must be in the same order as the fields of map_unit_t.
+*/
+
+#ifdef MAP_PAGE_PLANAR
+
+typedef struct
+{
+	uint8_t result[MAP_PAGE_W][MAP_PAGE_W];
+	uint8_t latest[MAP_PAGE_W][MAP_PAGE_W];
+	uint8_t timestamp[MAP_PAGE_W][MAP_PAGE_W];
+	uint8_t num_visited[MAP_PAGE_W][MAP_PAGE_W];
+	uint8_t num_seen[MAP_PAGE_W][MAP_PAGE_W];
+	uint8_t num_obstacles[MAP_PAGE_W][MAP_PAGE_W];
+	uint8_t constraints[MAP_PAGE_W][MAP_PAGE_W];
+	uint8_t num_3d_obstacles[MAP_PAGE_W][MAP_PAGE_W];
+} map_page_t;
+
+#define PAGE_UNIT(page, x, y, field) ((page)->field[(x)][(y)])
+#define PAGE_UNIT_BYTE(page, x, y, b) (((uint8_t*)(page))[(b)*MAP_PAGE_W*MAP_PAGE_W + (x)*MAP_PAGE_W + (y)])
+
+#else
+
 typedef struct
 {
 	map_unit_t units[MAP_PAGE_W][MAP_PAGE_W];
 } map_page_t;
 
+#define PAGE_UNIT(page, x, y, field) ((page)->units[(x)][(y)].field)
+#define PAGE_UNIT_BYTE(page, x, y, b) (((uint8_t*)&(page)->units[(x)][(y)])[(b)])
+
+#endif
+
 
 typedef struct
 {
@@ -117,12 +152,13 @@ world_t is one continuously mappable entity. There can be several worlds, but th
 in case they would, they should be combined.
 
 When the software cannot decide which world it's in, we create a new, empty world. If we figure out it matches
-an earlier world, we will combine them.
-
-To make things simple, we statically allocate for the map page pointers. Map pages themselves are dynamically allocated.
+an earlier world, we will combine them. Several worlds (e.g., the floors of a building) can be in memory at the
+same time, see get_world() in map_memdisk.h; switching between them doesn't reload anything.
 
-256*256 map pages will limit the maximum world size to 2.62 km * 2.62 km. On a 64-bit system, storing pointers to map pages
-and qmap pages, 1Mbyte is required for the pointers. NULL pointer means the data is not loaded in memory.
+256*256 map pages will limit the maximum world size to 2.62 km * 2.62 km. The page directory is sparse: a two-level
+radix, where the WORLD_BLOCK_W*WORLD_BLOCK_W page blocks are allocated when a page in the block is first loaded
+(get_world_page()). A block is about 16 KB, so the directory of a world scales with the mapped area, not with the
+maximum world size. NULL page pointer (or no block) means the data is not loaded in memory.
 
 */
 
@@ -131,16 +167,85 @@ and qmap pages, 1Mbyte is required for the pointers. NULL pointer means the data
 
 #define MAP_MIDDLE_UNIT (MAP_PAGE_W * MAP_MIDDLE_PAGE)
 
+#define WORLD_BLOCK_W 16
+#define WORLD_BLOCKS (MAP_W/WORLD_BLOCK_W)
+
+#define WORLD_NAME_LEN 32
+
+typedef struct page_index_t page_index_t;
+typedef struct page_summary_t page_summary_t;
+typedef struct cspace_page_t cspace_page_t;
+typedef struct hpa_page_t hpa_page_t;
+
+typedef struct
+{
+	map_page_t* page;
+	routing_page_t* rpage;
+	cspace_page_t* cspace; // configuration space planes of the page, maintained by routing.c
+	hpa_page_t* hpa; // cluster graph of the page for hierarchical routing, maintained by routing.c; kept when unloaded
+	page_summary_t* summary; // per-tile summary of the loaded page, see map_memdisk.h
+	uint64_t changed_tiles; // changed MAP_TILE_W*MAP_TILE_W tiles within the page, see map_memdisk.h
+	uint8_t changed; // set with mark_page_changed() or mark_unit_changed()
+	uint8_t mmapped; // MAP_STORE_MMAP: the page is a mapping of the world store file
+
+	// Routing page freshness, see gen_routing_page()
+	uint64_t routing_stale; // tiles changed since the routing page was generated
+	uint32_t map_gen; // bumped on every change to the page, and when it's loaded, reread or unloaded
+	uint32_t rpage_next_gen; // map_gen of page (x,y+1) when the last column of the routing page was generated
+
+	// Resident page index, maintained by map_memdisk.c
+	int32_t lru_prev, lru_next;
+	int32_t dirty_prev, dirty_next;
+	uint32_t stamp;
+	uint32_t accesses; // Number of times asked for by load_*page*()
+} world_page_t;
+
+typedef struct
+{
+	world_page_t p[WORLD_BLOCK_W][WORLD_BLOCK_W];
+} world_block_t;
+
 typedef struct
 {
 	uint32_t id;
+	char name[WORLD_NAME_LEN];
 
-	map_page_t*  pages[MAP_W][MAP_W];
-	uint8_t changed[MAP_W][MAP_W];
-	qmap_page_t* qpages[MAP_W][MAP_W];
-	routing_page_t* rpages[MAP_W][MAP_W];
+	world_block_t* blocks[WORLD_BLOCKS][WORLD_BLOCKS];
+	int n_blocks;
+
+	page_index_t* index; // Loaded and changed pages, maintained by map_memdisk.c
 } world_t;
 
+// Directory entry of the page, or NULL if no page in its block was ever loaded. Doesn't allocate anything.
+static inline world_page_t* find_world_page(world_t* w, int pagex, int pagey)
+{
+	if((unsigned)pagex >= MAP_W || (unsigned)pagey >= MAP_W)
+		return NULL;
+
+	world_block_t* b = w->blocks[pagex/WORLD_BLOCK_W][pagey/WORLD_BLOCK_W];
+	return b ? &b->p[pagex%WORLD_BLOCK_W][pagey%WORLD_BLOCK_W] : NULL;
+}
+
+// The loaded map page, or NULL
+static inline map_page_t* map_page(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	return wp ? wp->page : NULL;
+}
+
+// The routing page, or NULL if not generated
+static inline routing_page_t* routing_page(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	return wp ? wp->rpage : NULL;
+}
+
+// The world the robot is in; see select_world().
+extern world_t* cur_world;
+
+// Makes the world current, creating it if it's not in memory yet. Returns 0 on success.
+int select_world(uint32_t id, const char* name);
+
 void page_coords(int mm_x, int mm_y, int* pageidx_x, int* pageidx_y, int* pageoffs_x, int* pageoffs_y);
 void unit_coords(int mm_x, int mm_y, int* unit_x, int* unit_y);
 void mm_from_unit_coords(int unit_x, int unit_y, int* mm_x, int* mm_y);
@@ -150,11 +255,23 @@ void page_coords_from_unit_coords(int unit_x, int unit_y, int* pageidx_x, int* p
 int map_lidars(world_t* w, int n_lidars, lidar_scan_t** lidar_list, int* da, int* dx, int* dy);
 void map_next_with_larger_search_area();
 
+// Localization scoremap of TEMP_MAP_W*TEMP_MAP_W units around (mid_x, mid_y), as used by map_lidars().
+#define TEMP_MAP_W (2*MAP_PAGE_W)
+int gen_scoremap_for_small_steps(world_t *w, int8_t *scoremap, int mid_x, int mid_y);
+
+// Exploration: the higher, the less visited the area around (x,y) is. 0 if near walls or not seen enough.
+int unfamiliarity_score(world_t* w, int x, int y);
+
 void map_sonars(world_t* w, int n_sonars, sonar_point_t* p_sonars);
 void map_collision_obstacle(world_t* w, int32_t cur_ang, int cur_x, int cur_y, int stop_reason, int vect_valid, float vect_ang_rad);
 
 int map_3dtof(world_t* w, int n_tofs, tof3d_scan_t** tof_list, int32_t *mx, int32_t *my);
 
+// 3DTOF temporal fusion: scans are buffered and written to the world map only when needed. Return 1 when the world map was written.
+int fuse_3dtof(world_t* w, tof3d_scan_t* tof, int32_t *mx, int32_t *my);
+int flush_3dtof_fusion(world_t* w, int32_t *mx, int32_t *my);
+void reset_3dtof_fusion();
+
 
 void start_automapping_from_compass();
 void start_automapping_skip_compass();
@@ -0,0 +1,144 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Fixed-size slab pools
+
+	As the robot drives, map pages (512 KB) and routing pages are loaded and unloaded
+	all the time. Doing that with malloc/free fragments the heap on the small board.
+	The pools get memory from the system in slabs of several objects, carve the slabs
+	into objects, and keep freed objects on a free list for reuse. Slabs are never given
+	back, so the memory use is the peak, and it is limited by max_objs.
+
+	With -DPAGE_POOL_HUGEPAGES, slabs are first tried from huge pages (MAP_HUGETLB),
+	which needs huge pages to be reserved in /proc/sys/vm/nr_hugepages. A map page slab
+	of 4 pages is exactly one 2 MB huge page.
+
+	Pools are only used from the main thread - no locking.
+
+*/
+
+#define _GNU_SOURCE // MAP_ANONYMOUS, MAP_HUGETLB
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "page_pool.h"
+
+static int add_slab(page_pool_t* p)
+{
+	if(p->n_slabs >= POOL_MAX_SLABS)
+		return 1;
+
+	size_t size = (size_t)p->obj_size * p->objs_per_slab;
+	void* slab = MAP_FAILED;
+	int huge = 0;
+
+#if defined(PAGE_POOL_HUGEPAGES) && defined(MAP_HUGETLB)
+	slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(slab != MAP_FAILED)
+		huge = 1;
+#endif
+
+	if(slab == MAP_FAILED)
+		slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if(slab == MAP_FAILED)
+	{
+		printf("ERROR: %s pool: out of memory for a new slab\n", p->name);
+		return 1;
+	}
+
+	p->slabs[p->n_slabs] = slab;
+	p->slab_is_huge[p->n_slabs] = huge;
+	p->n_slabs++;
+	return 0;
+}
+
+void* pool_alloc(page_pool_t* p, int zero)
+{
+	if(p->in_use >= p->max_objs)
+	{
+		p->failures++;
+		return NULL;
+	}
+
+	void* obj;
+	if(p->free_list)
+	{
+		obj = p->free_list;
+		p->free_list = *(void**)obj;
+		if(zero)
+			memset(obj, 0, p->obj_size);
+	}
+	else
+	{
+		if(p->n_carved >= p->n_slabs*p->objs_per_slab && add_slab(p))
+		{
+			p->failures++;
+			return NULL;
+		}
+
+		int slab = p->n_carved / p->objs_per_slab;
+		int idx  = p->n_carved % p->objs_per_slab;
+		obj = p->slabs[slab] + (size_t)idx*p->obj_size;
+		p->n_carved++;
+		// Fresh anonymous memory is already zero.
+	}
+
+	p->in_use++;
+	if(p->in_use > p->peak)
+		p->peak = p->in_use;
+
+	return obj;
+}
+
+void pool_free(page_pool_t* p, void* obj)
+{
+	if(!obj)
+		return;
+
+	size_t slab_size = (size_t)p->obj_size * p->objs_per_slab;
+	for(int i=0; i<p->n_slabs; i++)
+	{
+		if((uint8_t*)obj >= p->slabs[i] && (uint8_t*)obj < p->slabs[i]+slab_size)
+		{
+			*(void**)obj = p->free_list;
+			p->free_list = obj;
+			p->in_use--;
+			return;
+		}
+	}
+
+	free(obj);
+	p->outside--;
+}
+
+void pool_print_stats(page_pool_t* p)
+{
+	int n_huge = 0;
+	for(int i=0; i<p->n_slabs; i++)
+		n_huge += p->slab_is_huge[i];
+
+	printf("%s pool: %d in use, peak %d, max %d, %d failures, %d outside the pool; %d slabs (%d huge), %.1f MB reserved\n",
+		p->name, p->in_use, p->peak, p->max_objs, p->failures, p->outside, p->n_slabs, n_huge,
+		(double)p->n_slabs*p->objs_per_slab*p->obj_size/1e6);
+}
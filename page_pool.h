@@ -0,0 +1,61 @@
+/*
+	PULUROBOT RN1-HOST Computer-on-RobotBoard main software
+
+	(c) 2017-2018 Pulu Robotics and other contributors
+	Maintainer: Antti Alhonen <antti.alhonen@iki.fi>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License version 2, as
+	published by the Free Software Foundation.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	GNU General Public License version 2 is supplied in file LICENSING.
+
+
+
+	Fixed-size slab pools for the big, constantly allocated and freed objects (map pages, routing pages)
+
+*/
+
+#ifndef PAGE_POOL_H
+#define PAGE_POOL_H
+
+#include <stdint.h>
+
+#define POOL_MAX_SLABS 64
+
+typedef struct
+{
+	const char* name;
+	int obj_size;
+	int objs_per_slab;
+	int max_objs;      // Hard limit for the pool; pool_alloc() returns NULL when reached.
+
+	void* free_list;   // Freed objects, linked through their first bytes.
+	uint8_t* slabs[POOL_MAX_SLABS];
+	int slab_is_huge[POOL_MAX_SLABS];
+	int n_slabs;
+	int n_carved;      // Objects taken from the slabs so far
+
+	// Statistics
+	int in_use;
+	int peak;
+	int failures;      // pool_alloc() returned NULL
+	int outside;       // objects the caller allocated outside the pool after a failure
+} page_pool_t;
+
+#define PAGE_POOL_INIT(name_, type_, objs_per_slab_, max_objs_) {.name = (name_), .obj_size = sizeof(type_), .objs_per_slab = (objs_per_slab_), .max_objs = (max_objs_)}
+
+// Returns NULL if the pool is at max_objs or out of memory. If zero is set, the object is zeroed.
+void* pool_alloc(page_pool_t* p, int zero);
+
+// Frees an object from the pool. Objects not from the pool (fallback allocations) are given to free().
+void pool_free(page_pool_t* p, void* obj);
+
+void pool_print_stats(page_pool_t* p);
+
+#endif
@@ -87,6 +87,8 @@
 #include "tcp_comm.h"
 #include "tcp_parser.h"
 #include "routing.h"
+#include "map_replay.h"
+#include "map_archive.h"
 #include "utlist.h"
 
 #include "pulutof.h"
@@ -139,7 +141,6 @@ uint32_t robot_id = 0xacdcabba; // Hopefully unique identifier for the robot.
 
 int cmd_state;
 
-extern world_t world;
 #define BUFLEN 2048
 
 int32_t cur_ang, cur_x, cur_y;
@@ -189,14 +190,14 @@ int run_search(int32_t dest_x, int32_t dest_y, int dont_map_lidars, int no_tight
 	if(!dont_map_lidars)
 	{
 		int32_t da, dx, dy;
-		map_lidars(&world, NUM_LATEST_LIDARS_FOR_ROUTING_START, lidars_to_map_at_routing_start, &da, &dx, &dy);
+		map_lidars(cur_world, NUM_LATEST_LIDARS_FOR_ROUTING_START, lidars_to_map_at_routing_start, &da, &dx, &dy);
 		INCR_POS_CORR_ID();
 		correct_robot_pos(da/2, dx/2, dy/2, pos_corr_id);
 	}
 
 	route_unit_t *some_route = NULL;
 
-	int ret = search_route(&world, &some_route, ANG32TORAD(cur_ang), cur_x, cur_y, dest_x, dest_y, no_tight);
+	int ret = search_route(cur_world, &some_route, ANG32TORAD(cur_ang), cur_x, cur_y, dest_x, dest_y, no_tight);
 
 	route_unit_t *rt;
 	int len = 0;
@@ -827,7 +828,7 @@ void retrieve_robot_pos()
 void conf_charger_pos()  // call when the robot is *in* the charger.
 {
 	int32_t da, dx, dy;
-	map_lidars(&world, NUM_LATEST_LIDARS_FOR_ROUTING_START, lidars_to_map_at_routing_start, &da, &dx, &dy);
+	map_lidars(cur_world, NUM_LATEST_LIDARS_FOR_ROUTING_START, lidars_to_map_at_routing_start, &da, &dx, &dy);
 	INCR_POS_CORR_ID();
 
 	int32_t cha_ang = cur_ang-da; int cha_x = cur_x+dx; int cha_y = cur_y+dy;
@@ -916,6 +917,10 @@ void* main_thread()
 		return NULL;
 	}
 
+	recover_map_dir();
+	init_map_persistence();
+	init_map_prefetch();
+
 	srand(time(NULL));
 
 	send_keepalive();
@@ -968,7 +973,7 @@ void* main_thread()
 		if(select(fds_size, &fds, NULL, NULL, &select_time) < 0)
 		{
 			fprintf(stderr, "select() error %d", errno);
-			return NULL;
+			break;
 		}
 
 #ifdef MOTCON_PID_EXPERIMENT
@@ -1005,13 +1010,13 @@ void* main_thread()
 /*			if(cmd == 'c')
 			{
 				printf("Starting automapping from compass round.\n");
-				routing_set_world(&world);
+				routing_set_world(cur_world);
 				start_automapping_from_compass();
 			}
 			if(cmd == 'a')
 			{
 				printf("Starting automapping, skipping compass round.\n");
-				routing_set_world(&world);
+				routing_set_world(cur_world);
 				start_automapping_skip_compass();
 			}
 			if(cmd == 'w')
@@ -1023,6 +1028,18 @@ void* main_thread()
 			{
 				set_robot_pos(0,0,0);
 			}
+			if(cmd == 'R')
+			{
+				// Toggle recording of the mapping inputs, for replaying with rn1host --replay <file>
+				if(replay_is_recording())
+					replay_stop_recording();
+				else
+				{
+					char fname[1024];
+					snprintf(fname, 1024, MAP_DIR"/mapping_%08x_%u.rec", robot_id, (unsigned)time(NULL));
+					replay_start_recording(fname);
+				}
+			}
 			if(cmd == 'M')
 			{
 				printf("Requesting massive search.\n");
@@ -1201,7 +1218,7 @@ void* main_thread()
 			else if(ret == TCP_CR_ADDCONSTRAINT_MID)
 			{
 				printf("  ---> ADD CONSTRAINT params: X=%d Y=%d\n", msg_cr_addconstraint.x, msg_cr_addconstraint.y);
-				add_map_constraint(&world, msg_cr_addconstraint.x, msg_cr_addconstraint.y);
+				add_map_constraint(cur_world, msg_cr_addconstraint.x, msg_cr_addconstraint.y);
 			}
 			else if(ret == TCP_CR_REMCONSTRAINT_MID)
 			{
@@ -1210,7 +1227,7 @@ void* main_thread()
 				{
 					for(int yy = -2; yy<=2; yy++)
 					{
-						remove_map_constraint(&world, msg_cr_remconstraint.x + xx*40, msg_cr_remconstraint.y + yy*40);
+						remove_map_constraint(cur_world, msg_cr_remconstraint.x + xx*40, msg_cr_remconstraint.y + yy*40);
 					}
 				}
 			}
@@ -1244,7 +1261,7 @@ void* main_thread()
 					{
 						state_vect.v.keep_position = 1;
 						daiju_mode(0);
-						routing_set_world(&world);
+						routing_set_world(cur_world);
 						start_automapping_skip_compass();
 						state_vect.v.mapping_collisions = state_vect.v.mapping_3d = state_vect.v.mapping_2d = state_vect.v.loca_3d = state_vect.v.loca_2d = 1;
 					} break;
@@ -1253,7 +1270,7 @@ void* main_thread()
 					{
 						state_vect.v.keep_position = 1;
 						daiju_mode(0);
-						routing_set_world(&world);
+						routing_set_world(cur_world);
 						start_automapping_from_compass();
 						state_vect.v.mapping_collisions = state_vect.v.mapping_3d = state_vect.v.mapping_2d = state_vect.v.loca_3d = state_vect.v.loca_2d = 1;
 					} break;
@@ -1386,6 +1403,8 @@ void* main_thread()
 
 #ifdef PULUTOF1
 				while(get_tof3d()); // flush 3DTOF queue
+				reset_3dtof_fusion(); // scans in the fusion buffer are in the old coordinates
+				replay_record_tof_reset();
 #endif
 				flush_3dtof = 2; // Flush two extra scans
 			}
@@ -1481,7 +1500,7 @@ void* main_thread()
 				printf("Feedback module reported: %s\n", MCU_FEEDBACK_COLLISION_NAMES[stop_reason]);
 				if(state_vect.v.mapping_collisions)
 				{
-					map_collision_obstacle(&world, cur_ang, cur_x, cur_y, stop_reason, cur_xymove.stop_xcel_vector_valid,
+					map_collision_obstacle(cur_world, cur_ang, cur_x, cur_y, stop_reason, cur_xymove.stop_xcel_vector_valid,
 						cur_xymove.stop_xcel_vector_ang_rad);
 					if(do_follow_route) // regenerate routing pages because the map is changed now.
 					{
@@ -1492,7 +1511,7 @@ void* main_thread()
 						{
 							for(int iy=-1; iy<=1; iy++)
 							{
-								gen_routing_page(&world, px+ix, py+iy, 0);
+								gen_routing_page(cur_world, px+ix, py+iy, 0);
 							}
 						}
 					}
@@ -1566,7 +1585,7 @@ void* main_thread()
 				printf("Turned at first charger point, mapping lidars for exact pos.\n");
 
 				int32_t da, dx, dy;
-				map_lidars(&world, NUM_LATEST_LIDARS_FOR_ROUTING_START, lidars_to_map_at_routing_start, &da, &dx, &dy);
+				map_lidars(cur_world, NUM_LATEST_LIDARS_FOR_ROUTING_START, lidars_to_map_at_routing_start, &da, &dx, &dy);
 				INCR_POS_CORR_ID();
 				correct_robot_pos(da, dx, dy, pos_corr_id);
 				lidar_ignore_over = 0;
@@ -1782,30 +1801,13 @@ void* main_thread()
 				}
 			}
 
-			static int32_t prev_x, prev_y, prev_ang;
-
 			if(!flush_3dtof && state_vect.v.mapping_3d && !pwr_status.charging && !pwr_status.charged)
 			{
 				if(p_tof->robot_pos.x != 0 || p_tof->robot_pos.y != 0 || p_tof->robot_pos.ang != 0)
 				{
-					int robot_moving = 0;
-					if((prev_x != p_tof->robot_pos.x || prev_y != p_tof->robot_pos.y || prev_ang != p_tof->robot_pos.ang))
-					{
-						prev_x = p_tof->robot_pos.x; prev_y = p_tof->robot_pos.y; prev_ang = p_tof->robot_pos.ang;
-						robot_moving = 1;
-					}
-
-					static int n_tofs_to_map = 0;
-					static tof3d_scan_t* tofs_to_map[25];
-
-					tofs_to_map[n_tofs_to_map] = p_tof;
-					n_tofs_to_map++;
-
-					if(n_tofs_to_map >= (robot_moving?3:20))
+					int32_t mid_x, mid_y;
+					if(fuse_3dtof(cur_world, p_tof, &mid_x, &mid_y))
 					{
-						int32_t mid_x, mid_y;
-						map_3dtof(&world, n_tofs_to_map, tofs_to_map, &mid_x, &mid_y);
-
 						if(do_follow_route)
 						{
 							int px, py, ox, oy;
@@ -1815,12 +1817,10 @@ void* main_thread()
 							{
 								for(int iy=-1; iy<=1; iy++)
 								{
-									gen_routing_page(&world, px+ix, py+iy, 0);
+									gen_routing_page(cur_world, px+ix, py+iy, 0);
 								}
 							}
 						}
-
-						n_tofs_to_map = 0;
 					}
 				}
 			}
@@ -1918,13 +1918,30 @@ void* main_thread()
 					curpos_send_cnt = 0;
 				}
 
+				replay_record_robot_pos(p_lid->robot_pos);
 				page_coords(p_lid->robot_pos.x, p_lid->robot_pos.y, &idx_x, &idx_y, &offs_x, &offs_y);
-				load_25pages(&world, idx_x, idx_y);
+				load_25pages(cur_world, idx_x, idx_y);
+
+				{
+					// Read the pages needed next in the background, so that crossing into a new area doesn't block on the disk.
+					int32_t route_ahead[8][2];
+					int n_route_ahead = 0;
+					if(do_follow_route)
+					{
+						for(int i=route_pos; i<the_route_len && n_route_ahead < 8; i++)
+						{
+							route_ahead[n_route_ahead][0] = the_route[i].x;
+							route_ahead[n_route_ahead][1] = the_route[i].y;
+							n_route_ahead++;
+						}
+					}
+					prefetch_ahead(cur_world, p_lid->robot_pos.x, p_lid->robot_pos.y, p_lid->robot_pos.ang, n_route_ahead, route_ahead);
+				}
 
 				if(state_vect.v.mapping_collisions)
 				{
 					// Clear any walls and items within the robot:
-					clear_within_robot(&world, p_lid->robot_pos);
+					clear_within_robot(cur_world, p_lid->robot_pos);
 				}
 
 
@@ -1956,7 +1973,7 @@ void* main_thread()
 							printf("Got DISTORTED significant lidar scan, running mapping early on previous images\n");
 							int32_t da, dx, dy;
 
-							map_lidars(&world, n_lidars_to_map, lidars_to_map, &da, &dx, &dy);
+							map_lidars(cur_world, n_lidars_to_map, lidars_to_map, &da, &dx, &dy);
 							INCR_POS_CORR_ID();
 							correct_robot_pos(da/3, dx/3, dy/3, pos_corr_id);
 
@@ -1978,7 +1995,7 @@ void* main_thread()
 							if(good_time_for_lidar_mapping) good_time_for_lidar_mapping = 0;
 							int32_t da, dx, dy;
 
-							map_lidars(&world, n_lidars_to_map, lidars_to_map, &da, &dx, &dy);
+							map_lidars(cur_world, n_lidars_to_map, lidars_to_map, &da, &dx, &dy);
 							INCR_POS_CORR_ID();
 
 							if(state_vect.v.localize_with_big_search_area)
@@ -2004,7 +2021,7 @@ void* main_thread()
 		if(state_vect.v.command_source && !prev_autonomous)
 		{
 			daiju_mode(0);
-			routing_set_world(&world);
+			routing_set_world(cur_world);
 			start_automapping_skip_compass();
 			state_vect.v.mapping_collisions = state_vect.v.mapping_3d = state_vect.v.mapping_2d = state_vect.v.loca_3d = state_vect.v.loca_2d = 1;
 		}
@@ -2030,7 +2047,7 @@ void* main_thread()
 		{
 			if(tcp_client_sock >= 0) tcp_send_sonar(p_son);
 			if(state_vect.v.mapping_2d)
-				map_sonars(&world, 1, p_son);
+				map_sonars(cur_world, 1, p_son);
 		}
 
 		static double prev_sync = 0;
@@ -2047,11 +2064,13 @@ void* main_thread()
 			int idx_x, idx_y, offs_x, offs_y;
 			page_coords(cur_x, cur_y, &idx_x, &idx_y, &offs_x, &offs_y);
 
+			replay_record_sync(cur_x, cur_y);
+
 			// Do some "garbage collection" by disk-syncing and deallocating far-away map pages.
-			unload_map_pages(&world, idx_x, idx_y);
+			unload_map_pages(cur_world, idx_x, idx_y);
 
 			// Sync all changed map pages to disk
-			if(save_map_pages(&world))
+			if(save_map_pages(cur_world))
 			{
 				if(tcp_client_sock >= 0) tcp_send_sync_request();
 			}
@@ -2067,6 +2086,12 @@ void* main_thread()
 
 	}
 
+	// Everything must be on the disk before run_rn1host.sh acts on the exit code (reboot, shutdown, update...)
+	printf("Info: syncing map pages before exit\n");
+	stop_map_prefetch();
+	save_map_pages(cur_world);
+	stop_map_persistence();
+
 #ifdef PULUTOF1
 	request_tof_quit();
 #endif
@@ -2085,6 +2110,28 @@ int main(int argc, char** argv)
 
 	int ret;
 
+	// Before anything is printed: the archive may go to stdout.
+	if((argc == 4 || argc == 5) && strcmp(argv[1], "--export-map") == 0)
+	{
+		// rn1host --export-map <world id> <file, or - for stdout> [name]
+		return export_map_archive_file(strtoul(argv[2], NULL, 0), (argc==5)?argv[4]:NULL, argv[3]) ? -1 : 0;
+	}
+
+	if(argc == 3 && strcmp(argv[1], "--import-map") == 0)
+	{
+		// rn1host --import-map <file, or - for stdin>
+		return import_map_archive_file(argv[2]) ? -1 : 0;
+	}
+
+	if(select_world(0, "default"))
+		return -1;
+
+	if(argc == 3 && strcmp(argv[1], "--replay") == 0)
+	{
+		// Headless mapping regression / benchmark run; no hardware needed.
+		return replay_mapping_session(cur_world, argv[2]);
+	}
+
 	if( (ret = pthread_create(&thread_main, NULL, main_thread, NULL)) )
 	{
 		printf("ERROR: main thread creation, ret = %d\n", ret);
@@ -46,10 +46,11 @@
 #include <stdio.h>
 #include <math.h>
 #include <inttypes.h>
+#include <stddef.h>
 
 #include "mapping.h"
+#include "map_memdisk.h"
 #include "routing.h"
-#include "uthash.h"
 #include "utlist.h"
 
 #ifndef M_PI
@@ -75,6 +76,10 @@ float main_robot_middle_to_lidar = -183.0;
 static void wide_search_mode();
 static void normal_search_mode();
 static void tight_search_mode();
+static void cspace_shapes_generated();
+static int check_hit(int x, int y, int direction);
+static const uint32_t* cspace_tile_bits(int x, int y, int direction);
+static void dstar_routing_changed(world_t* w, int pagex, int pagey, uint64_t tiles);
 
 world_t* routing_world;
 
@@ -88,7 +93,8 @@ struct search_unit_t
 
 	search_unit_t* parent;
 
-	UT_hash_handle hh;
+	int heap_idx;  // position in open_heap, -1 when closed
+	uint32_t seq;  // index in the node pool = order of adding to the open set, for breaking ties in f
 };
 
 #define sq(x) ((x)*(x))
@@ -99,18 +105,29 @@ float robot_shape_x_len;
 uint32_t robot_shapes[32][ROBOT_SHAPE_WINDOW];
 
 
-static int check_hit(int x, int y, int direction)
+// The robot shape tested against the routing pages; check_hit() gets the same from the configuration space.
+// The window is walked column by column; the routing page is looked up again only where the window crosses to the next
+// page.
+static int check_hit_window(int x, int y, int direction)
 {
 //	printf("check_hit(%d, %d, %d)\n", x, y, direction);
-	for(int chk_x=0; chk_x<ROBOT_SHAPE_WINDOW; chk_x++)
-	{
-		int pageidx_x, pageidx_y, pageoffs_x, pageoffs_y;
-		page_coords_from_unit_coords(x-ROBOT_SHAPE_WINDOW/2+chk_x, y-ROBOT_SHAPE_WINDOW/2, &pageidx_x, &pageidx_y, &pageoffs_x, &pageoffs_y);
+	int pageidx_x, pageidx_y, pageoffs_x, pageoffs_y;
+	page_coords_from_unit_coords(x-ROBOT_SHAPE_WINDOW/2, y-ROBOT_SHAPE_WINDOW/2, &pageidx_x, &pageidx_y, &pageoffs_x, &pageoffs_y);
+
+	int yoffs = pageoffs_y/32;
+	int yoffs_remain = pageoffs_y - yoffs*32;
 
-		int yoffs = pageoffs_y/32;
-		int yoffs_remain = pageoffs_y - yoffs*32;
+	routing_page_t* rpage = routing_page(routing_world, pageidx_x, pageidx_y);
+	for(int chk_x=0; chk_x<ROBOT_SHAPE_WINDOW; chk_x++, pageoffs_x++)
+	{
+		if(pageoffs_x >= MAP_PAGE_W)
+		{
+			pageidx_x++;
+			pageoffs_x = 0;
+			rpage = routing_page(routing_world, pageidx_x, pageidx_y);
+		}
 
-		if(!routing_world->rpages[pageidx_x][pageidx_y]) // out of bounds (not allocated) - give up instantly
+		if(!rpage) // out of bounds (not allocated) - give up instantly
 		{
 			printf("rpages[%d][%d] not allocated\n", pageidx_x, pageidx_y);
 			printf("x = %d  y = %d  direction = %d\n", x, y, direction);
@@ -123,8 +140,8 @@ static int check_hit(int x, int y, int direction)
 
 		uint64_t shape = (uint64_t)robot_shapes[direction][chk_x] << (32-yoffs_remain);
 
-		if((((uint64_t)routing_world->rpages[pageidx_x][pageidx_y]->obst_u32[pageoffs_x][yoffs]<<32) |
-		   (uint64_t)routing_world->rpages[pageidx_x][pageidx_y]->obst_u32[pageoffs_x][yoffs+1])
+		if((((uint64_t)rpage->obst_u32[pageoffs_x][yoffs]<<32) |
+		   (uint64_t)rpage->obst_u32[pageoffs_x][yoffs+1])
 		      & shape)
 		{
 			return 1;
@@ -134,21 +151,30 @@ static int check_hit(int x, int y, int direction)
 	return 0;
 }
 
+// Columns of the robot shape hitting something, walked like check_hit_window() does
 static int check_hit_hitcnt(int x, int y, int direction)
 {
 //	printf("check_hit(%d, %d, %d)\n", x, y, direction);
 
 	int hit_cnt = 0;
 
-	for(int chk_x=0; chk_x<ROBOT_SHAPE_WINDOW; chk_x++)
-	{
-		int pageidx_x, pageidx_y, pageoffs_x, pageoffs_y;
-		page_coords_from_unit_coords(x-ROBOT_SHAPE_WINDOW/2+chk_x, y-ROBOT_SHAPE_WINDOW/2, &pageidx_x, &pageidx_y, &pageoffs_x, &pageoffs_y);
+	int pageidx_x, pageidx_y, pageoffs_x, pageoffs_y;
+	page_coords_from_unit_coords(x-ROBOT_SHAPE_WINDOW/2, y-ROBOT_SHAPE_WINDOW/2, &pageidx_x, &pageidx_y, &pageoffs_x, &pageoffs_y);
+
+	int yoffs = pageoffs_y/32;
+	int yoffs_remain = pageoffs_y - yoffs*32;
 
-		int yoffs = pageoffs_y/32;
-		int yoffs_remain = pageoffs_y - yoffs*32;
+	routing_page_t* rpage = routing_page(routing_world, pageidx_x, pageidx_y);
+	for(int chk_x=0; chk_x<ROBOT_SHAPE_WINDOW; chk_x++, pageoffs_x++)
+	{
+		if(pageoffs_x >= MAP_PAGE_W)
+		{
+			pageidx_x++;
+			pageoffs_x = 0;
+			rpage = routing_page(routing_world, pageidx_x, pageidx_y);
+		}
 
-		if(!routing_world->rpages[pageidx_x][pageidx_y]) // out of bounds (not allocated) - give up instantly
+		if(!rpage) // out of bounds (not allocated) - give up instantly
 		{
 			printf("rpages[%d][%d] not allocated\n", pageidx_x, pageidx_y);
 			printf("x = %d  y = %d  direction = %d\n", x, y, direction);
@@ -161,8 +187,8 @@ static int check_hit_hitcnt(int x, int y, int direction)
 
 		uint64_t shape = (uint64_t)robot_shapes[direction][chk_x] << (32-yoffs_remain);
 
-		if((((uint64_t)routing_world->rpages[pageidx_x][pageidx_y]->obst_u32[pageoffs_x][yoffs]<<32) |
-		   (uint64_t)routing_world->rpages[pageidx_x][pageidx_y]->obst_u32[pageoffs_x][yoffs+1])
+		if((((uint64_t)rpage->obst_u32[pageoffs_x][yoffs]<<32) |
+		   (uint64_t)rpage->obst_u32[pageoffs_x][yoffs+1])
 		      & shape)
 		{
 			hit_cnt++;
@@ -264,94 +290,124 @@ static int test_robot_turn_hitcnt(int x, int y, float start, float end)
 	return hitcnt;
 }
 
-static int line_of_sight(route_xy_t p1, route_xy_t p2)
-{
-	int dx = p2.x - p1.x;
-	int dy = p2.y - p1.y;
+/*
+	Line of sight
 
-	float step = ((robot_shape_x_len-10.0)/MAP_UNIT_W);
+	The robot, in the heading of the line, is checked at points a bit less than its length apart along the line,
+	from half of that on, and at the end. The points are walked with an integer DDA: the position is a 16.16 fixed
+	point fraction of the line, so that there is one division per line instead of a sin and a cos per point.
 
-	float len = sqrt(sq(dx) + sq(dy));
+	The points are within a robot length of each other, mostly in the same c-space tile: los_cursor_t keeps the tile
+	it looked up last, and the page, the plane and the tile are only looked up again when the walk crosses into the
+	next one. The pointer is only kept during one walk, as making the c-space of another page can evict planes.
+*/
 
-	int terminate = 0;
+typedef struct
+{
+	int direction;
+	int tx, ty;           // the tile, in MAP_TILE_W units
+	const uint32_t* bits; // its column words, NULL if there is no c-space for it
+} los_cursor_t;
 
-	float pos = step/2.0;
-	if(pos > len) {pos = len; terminate = 1;}
+typedef struct
+{
+	int x0, y0, dx, dy;
+	int32_t t, dt; // position and step, fractions of the line (1<<16 = all of it)
+	int last;
+} los_walk_t;
 
+static int los_direction(int dx, int dy)
+{
 	float ang = atan2(dy, dx);
 	if(ang < 0.0) ang += 2.0*M_PI;
 	int dir = (ang/(2.0*M_PI) * 32.0)+0.5;
 	if(dir < 0) dir = 0; else if(dir > 31) dir = 31;
+	return dir;
+}
 
-//	printf("ang = %.4f  dir = %d \n", ang, dir);
-
-	while(1)
-	{
-		int x = (cos(ang)*pos + (float)p1.x)+0.5;
-		int y = (sin(ang)*pos + (float)p1.y)+0.5;
-
-//		printf("check_hit(%d, %d, %d) = ", x, y, dir);
+static void los_start(los_walk_t* lw, route_xy_t p1, route_xy_t p2)
+{
+	lw->x0 = p1.x;
+	lw->y0 = p1.y;
+	lw->dx = p2.x - p1.x;
+	lw->dy = p2.y - p1.y;
 
-		if(check_hit(x, y, dir))
-		{
-//			printf("1 !\n");
-			return 0;
-		}
-//		printf("0\n");
+	float step = ((robot_shape_x_len-10.0)/MAP_UNIT_W);
+	if(step < 1.0) step = 1.0;
+	float len = sqrt(sq(lw->dx) + sq(lw->dy));
 
-		if(terminate) break;
-		pos += step;
-		if(pos > len)
-		{
-			pos = len;
-			terminate = 1;
-		}
+	if(step/2.0 >= len)
+	{
+		lw->t = 1<<16;
+		lw->dt = 1<<16;
+	}
+	else
+	{
+		lw->t = (step/2.0)/len*65536.0;
+		lw->dt = step/len*65536.0;
+		if(lw->dt < 1) lw->dt = 1;
 	}
+	lw->last = 0;
+}
 
+// The next point to check. Returns 0 after the end of the line.
+static int los_next(los_walk_t* lw, int* x, int* y)
+{
+	if(lw->last)
+		return 0;
+	if(lw->t >= 1<<16)
+	{
+		lw->t = 1<<16;
+		lw->last = 1;
+	}
+	*x = lw->x0 + (((int64_t)lw->dx*lw->t + (1<<15)) >> 16);
+	*y = lw->y0 + (((int64_t)lw->dy*lw->t + (1<<15)) >> 16);
+	lw->t += lw->dt;
 	return 1;
 }
 
-static int line_of_sight_hitcnt(route_xy_t p1, route_xy_t p2)
+static int los_hit(los_cursor_t* c, int x, int y)
 {
-	int dx = p2.x - p1.x;
-	int dy = p2.y - p1.y;
+	int tx = x/MAP_TILE_W, ty = y/MAP_TILE_W;
+	if(tx != c->tx || ty != c->ty)
+	{
+		c->tx = tx;
+		c->ty = ty;
+		c->bits = cspace_tile_bits(x, y, c->direction);
+	}
+	if(!c->bits)
+		return check_hit(x, y, c->direction);
 
-	float step = ((robot_shape_x_len-10.0)/MAP_UNIT_W);
+	cspace_stats.lookups++;
+	return (c->bits[x%MAP_TILE_W] >> (31 - y%MAP_TILE_W)) & 1;
+}
 
-	float len = sqrt(sq(dx) + sq(dy));
+static int line_of_sight(route_xy_t p1, route_xy_t p2)
+{
+	los_walk_t lw;
+	los_start(&lw, p1, p2);
+	los_cursor_t c = {los_direction(p2.x-p1.x, p2.y-p1.y), INT32_MIN, INT32_MIN, NULL};
 
-	int terminate = 0;
+	int x, y;
+	while(los_next(&lw, &x, &y))
+	{
+		if(los_hit(&c, x, y))
+			return 0;
+	}
 
-	float pos = step/2.0;
-	if(pos > len) {pos = len; terminate = 1;}
+	return 1;
+}
 
-	float ang = atan2(dy, dx);
-	if(ang < 0.0) ang += 2.0*M_PI;
-	int dir = (ang/(2.0*M_PI) * 32.0)+0.5;
-	if(dir < 0) dir = 0; else if(dir > 31) dir = 31;
+static int line_of_sight_hitcnt(route_xy_t p1, route_xy_t p2)
+{
+	los_walk_t lw;
+	los_start(&lw, p1, p2);
+	int dir = los_direction(p2.x-p1.x, p2.y-p1.y);
 
 	int hit_cnt = 0;
-
-//	printf("ang = %.4f  dir = %d \n", ang, dir);
-
-	while(1)
-	{
-		int x = (cos(ang)*pos + (float)p1.x)+0.5;
-		int y = (sin(ang)*pos + (float)p1.y)+0.5;
-
-//		printf("check_hit(%d, %d, %d) = ", x, y, dir);
-
+	int x, y;
+	while(los_next(&lw, &x, &y))
 		hit_cnt += check_hit_hitcnt(x, y, dir);
-//		printf("0\n");
-
-		if(terminate) break;
-		pos += step;
-		if(pos > len)
-		{
-			pos = len;
-			terminate = 1;
-		}
-	}
 
 	return hit_cnt;
 }
@@ -915,6 +971,8 @@ static void gen_robot_shapes()
 */
 	}
 
+	cspace_shapes_generated();
+
 }
 
 static void wide_search_mode()
@@ -942,169 +1000,721 @@ static void extra_tight_search_mode()
 	gen_robot_shapes();	
 }
 
-void clear_route(route_unit_t **route)
+/*
+	Configuration space
+
+	check_hit() used to test the robot shape of the heading against the routing pages, 32 columns of 64 bits, at
+	every call; the search and the line-of-sight tests ask for the same spots over and over. Instead, the routing
+	pages are dilated with the robot shapes into c-space planes: one bit per routing unit, set if the robot in that
+	heading and search mode would hit something there, so that a collision check is a single bit lookup.
+
+	A plane covers one page for one (mode, heading) pair. Its 32*32 unit tiles are computed on first use, column by
+	column: the routing units from y-16 to y+47 as one 64-bit window, ORed over the shifts of each run of set bits in
+	the shape column. The result is exactly check_hit_window(), including its quirk of reporting a hit whenever the
+	first row of the window reaches a page without a routing page.
+
+	A tile depends on the routing tiles around it, possibly on neighbor pages. gen_routing_page() tells which routing
+	tiles it recomputed (cspace_routing_changed()), and unload_map_page() which pages lost their routing page
+	(cspace_page_unloaded()); the affected c-space tiles are marked invalid in all planes, and recomputed when used
+	again. The planes live while they fit in CSPACE_BUDGET_MB; beyond that, the least recently used ones are freed.
+*/
+
+#define CSPACE_MODES 4 // tight_shapes -1 .. 2
+
+#ifndef CSPACE_BUDGET_MB
+#define CSPACE_BUDGET_MB 32
+#endif
+#if CSPACE_BUDGET_MB < 1
+#error CSPACE_BUDGET_MB must be at least 1
+#endif
+
+#define CSPACE_TILES_TY0 0x0101010101010101ULL // tiles in the first row of the page (y offset < MAP_TILE_W)
+
+typedef struct
 {
-	route_unit_t *elt, *tmp;
-	DL_FOREACH_SAFE(*route,elt,tmp)
+	uint64_t valid;    // tiles computed
+	uint32_t stamp;    // cspace_clock when last used
+	int32_t slot;      // in cspace_slots
+	uint32_t bits[MAP_TILES_PER_PAGE][MAP_TILE_W]; // per tile, a word per unit column, first unit in the MSb like routing pages
+} cspace_plane_t;
+
+struct cspace_page_t
+{
+	cspace_plane_t* planes[CSPACE_MODES][32];
+	int n_planes;
+};
+
+typedef struct
+{
+	cspace_plane_t* plane;
+	world_page_t* wp;
+	uint8_t mode;
+	uint8_t dir;
+} cspace_slot_t;
+
+#define CSPACE_MAX_PLANES ((int)(((int64_t)CSPACE_BUDGET_MB<<20)/sizeof(cspace_plane_t)))
+
+static cspace_slot_t* cspace_slots;
+static uint32_t cspace_clock;
+static uint32_t cspace_shapes[CSPACE_MODES][32][ROBOT_SHAPE_WINDOW]; // the shapes the planes were made with
+static uint32_t cspace_shapes_gen[CSPACE_MODES]; // bumped when the shapes of the mode change
+
+cspace_stats_t cspace_stats;
+
+static void free_cspace_plane(int slot)
+{
+	cspace_slot_t* s = &cspace_slots[slot];
+	cspace_page_t* cp = s->wp->cspace;
+	cp->planes[s->mode][s->dir] = NULL;
+	if(--cp->n_planes == 0)
 	{
-		DL_DELETE(*route,elt);
-		free(elt);
+		free(cp);
+		s->wp->cspace = NULL;
+	}
+	free(s->plane);
+
+	// Keep the slots packed
+	cspace_stats.planes--;
+	if(slot != cspace_stats.planes)
+	{
+		*s = cspace_slots[cspace_stats.planes];
+		s->plane->slot = slot;
 	}
-	*route = NULL;
 }
 
-static int search(route_unit_t **route, float start_ang, int start_x_mm, int start_y_mm, int end_x_mm, int end_y_mm)
+static void evict_cspace_plane()
 {
-	search_unit_t* closed_set = NULL;
-	search_unit_t* open_set = NULL;
+	int oldest = 0;
+	for(int i = 1; i < cspace_stats.planes; i++)
+	{
+		if((int32_t)(cspace_slots[i].plane->stamp - cspace_slots[oldest].plane->stamp) < 0)
+			oldest = i;
+	}
+	free_cspace_plane(oldest);
+	cspace_stats.evictions++;
+}
 
-	clear_route(route);
+// The plane of the page for the current search mode and the heading, allocated if needed. NULL if out of memory.
+static cspace_plane_t* cspace_plane(world_page_t* wp, int dir)
+{
+	int mode = tight_shapes+1;
+	if(wp->cspace && wp->cspace->planes[mode][dir])
+	{
+		cspace_plane_t* pl = wp->cspace->planes[mode][dir];
+		pl->stamp = cspace_clock;
+		return pl;
+	}
 
-	int s_x, s_y, e_x, e_y;
-	unit_coords(start_x_mm, start_y_mm, &s_x, &s_y);
-	unit_coords(end_x_mm, end_y_mm, &e_x, &e_y);
+	if(!cspace_slots && !(cspace_slots = malloc(CSPACE_MAX_PLANES*sizeof(cspace_slot_t))))
+		return NULL;
 
-	while(start_ang >= 2.0*M_PI) start_ang -= 2.0*M_PI;
-	while(start_ang < 0.0) start_ang += 2.0*M_PI;
-	int start_dir = (start_ang/(2.0*M_PI) * 32.0)+0.5;
+	if(!wp->cspace && !(wp->cspace = calloc(1, sizeof(cspace_page_t))))
+		return NULL;
 
-//	printf("Start %d,%d,  end %d,%d  start_ang=%f  start_dir=%d\n", s_x, s_y, e_x, e_y, start_ang, start_dir);
+	if(cspace_stats.planes >= CSPACE_MAX_PLANES)
+		evict_cspace_plane();
 
+	cspace_plane_t* pl = malloc(sizeof(cspace_plane_t));
+	if(!pl)
+	{
+		if(wp->cspace->n_planes == 0)
+		{
+			free(wp->cspace);
+			wp->cspace = NULL;
+		}
+		return NULL;
+	}
+	pl->valid = 0;
+	pl->stamp = cspace_clock;
+	pl->slot = cspace_stats.planes++;
+	cspace_slots[pl->slot] = (cspace_slot_t){pl, wp, mode, dir};
+	wp->cspace->planes[mode][dir] = pl;
+	wp->cspace->n_planes++;
+	if(cspace_stats.planes > cspace_stats.peak_planes)
+		cspace_stats.peak_planes = cspace_stats.planes;
+	return pl;
+}
 
-	search_unit_t* p_start = (search_unit_t*) malloc(sizeof(search_unit_t));
-	memset(p_start, 0, sizeof(search_unit_t));
+// Routing word wy (in absolute units/32) of the unit column x, as check_hit_window() would see it. 0xffffffff if
+// there's no routing page.
+static uint32_t cspace_routing_word(int x, int wy)
+{
+	int px = x / MAP_PAGE_W, py = wy / (MAP_PAGE_W/32);
+	int ox = x % MAP_PAGE_W, oy = wy % (MAP_PAGE_W/32);
+	routing_page_t* rp = routing_page(routing_world, px, py);
+	if(rp)
+		return rp->obst_u32[ox][oy];
 
-	p_start->loc.x = s_x;
-	p_start->loc.y = s_y;
-	p_start->direction = start_dir;
-	p_start->parent = NULL;
-	// g = 0
-	p_start->f = sqrt((float)(sq(e_x-s_x) + sq(e_y-s_y)));
+	// The extra column of the page below is what a window starting there uses
+	if(oy == 0 && (rp = routing_page(routing_world, px, py-1)))
+		return rp->obst_u32[ox][MAP_PAGE_W/32];
 
-	HASH_ADD(hh, open_set, loc,sizeof(route_xy_t), p_start);
+	return 0xffffffff;
+}
 
-	int cnt = 0;
+static void gen_cspace_tile(cspace_plane_t* pl, int px, int py, int tile, int dir)
+{
+	int x0 = px*MAP_PAGE_W + (tile/MAP_TILES_PER_ROW)*MAP_TILE_W;
+	int y0 = py*MAP_PAGE_W + (tile%MAP_TILES_PER_ROW)*MAP_TILE_W;
 
-	while(HASH_CNT(hh, open_set) > 0)
+	if(x0 < MAP_TILE_W || y0 < MAP_TILE_W || x0 + 2*MAP_TILE_W > MAP_W*MAP_PAGE_W || y0 + 2*MAP_TILE_W > MAP_W*MAP_PAGE_W)
 	{
-		cnt++;
+		// World border, where check_hit_window() would go out of the map
+		memset(pl->bits[tile], 0xff, sizeof(pl->bits[tile]));
+		pl->valid |= 1ULL << tile;
+		return;
+	}
 
-		if(cnt > 50000)
-		{
-			printf("Giving up at cnt = %d\n", cnt);
-			return 3;
-		}
+	// Routing units y0-16 .. y0+47 of the columns x0-16 .. x0+47, the first unit in the MSb
+	uint64_t win[MAP_TILE_W+ROBOT_SHAPE_WINDOW];
+	for(int i = 0; i < MAP_TILE_W+ROBOT_SHAPE_WINDOW; i++)
+	{
+		int x = x0 - ROBOT_SHAPE_WINDOW/2 + i;
+		win[i] = ((uint64_t)cspace_routing_word(x, y0/32-1) << 48) |
+		         ((uint64_t)cspace_routing_word(x, y0/32) << 16) |
+		         (cspace_routing_word(x, y0/32+1) >> 16);
+	}
 
-		// Find the lowest f score from open_set.
-		search_unit_t* p_cur = NULL;
-		float lowest_f = 2.0*MAX_F;
-		for(search_unit_t* p_iter = open_set; p_iter != NULL; p_iter=p_iter->hh.next)
+	// check_hit_window() gives up on a window starting on a page without a routing page. On the first tile row,
+	// the windows of the first 16 rows start on the page below.
+	int lo_py = (y0 - ROBOT_SHAPE_WINDOW/2) / MAP_PAGE_W;
+	uint32_t lo_rows = (lo_py == py) ? 0xffffffff : 0xffff0000;
+
+	for(int xx = 0; xx < MAP_TILE_W; xx++)
+	{
+		uint64_t acc = 0;
+		for(int chk = 0; chk < ROBOT_SHAPE_WINDOW; chk++)
 		{
-			if(p_iter->f < lowest_f)
+			uint32_t s = robot_shapes[dir][chk];
+			uint64_t w = win[xx+chk];
+			while(s)
 			{
-				lowest_f = p_iter->f;
-				p_cur = p_iter;
+				// Run of set bits: shape units a .. a+len-1 of the column, OR the window shifted by each
+				int a = __builtin_clz(s);
+				uint32_t rest = ~(s << a);
+				int len = rest ? __builtin_clz(rest) : 32;
+				if(a+len < 32)
+					s &= (1U << (32-a-len)) - 1;
+				else
+					s = 0;
+
+				uint64_t run = w << a;
+				int l = 1;
+				for(; l*2 <= len; l *= 2)
+					run |= run << l;
+				if(l < len)
+					run |= run << (len-l);
+				acc |= run;
 			}
 		}
 
-		if(p_cur == NULL)
+		uint32_t no_page = 0;
+		int left_px = (x0 + xx - ROBOT_SHAPE_WINDOW/2) / MAP_PAGE_W;
+		int right_px = (x0 + xx + ROBOT_SHAPE_WINDOW/2 - 1) / MAP_PAGE_W;
+		for(int qx = left_px; qx <= right_px; qx++)
 		{
-			printf("search() error: open set empty while finding lowest f score.\n");
-			return 55;
+			if(!routing_page(routing_world, qx, lo_py))
+				no_page |= lo_rows;
+			if(lo_py != py && !routing_page(routing_world, qx, py))
+				no_page |= ~lo_rows;
 		}
 
-		if(p_cur->loc.x == e_x && p_cur->loc.y == e_y)
-		{
-
-			//printf("Solution found, cnt = %d\n", cnt);
-
-			// solution found.
+		pl->bits[tile][xx] = (uint32_t)(acc >> 32) | no_page;
+	}
+	pl->valid |= 1ULL << tile;
+	cspace_stats.tiles_generated++;
+}
 
-			// Reconstruct the path
+// The tiles within r (at most MAP_TILES_PER_ROW) tiles of the given ones: around[1][1] on the page, around[0][1] on
+// the page to the left, and so on.
+static void tiles_around(uint64_t tiles, int r, uint64_t around[3][3])
+{
+	memset(around, 0, 9*sizeof(uint64_t));
+	while(tiles)
+	{
+		int tile = __builtin_ctzll(tiles);
+		tiles &= tiles-1;
 
-			search_unit_t* p_recon = p_cur;
-			while( (p_recon = p_recon->parent) )
+		int tx = tile/MAP_TILES_PER_ROW, ty = tile%MAP_TILES_PER_ROW;
+		for(int dx = -r; dx <= r; dx++)
+		{
+			for(int dy = -r; dy <= r; dy++)
 			{
-				route_unit_t* point = malloc(sizeof(route_unit_t));
-				point->loc.x = p_recon->loc.x; point->loc.y = p_recon->loc.y;
-				point->backmode = 0;
-				DL_PREPEND(*route, point);
+				int nx = tx+dx, ny = ty+dy;
+				int pdx = (nx < 0) ? -1 : (nx >= MAP_TILES_PER_ROW) ? 1 : 0;
+				int pdy = (ny < 0) ? -1 : (ny >= MAP_TILES_PER_ROW) ? 1 : 0;
+				nx -= pdx*MAP_TILES_PER_ROW;
+				ny -= pdy*MAP_TILES_PER_ROW;
+				around[pdx+1][pdy+1] |= 1ULL << (nx*MAP_TILES_PER_ROW + ny);
 			}
+		}
+	}
+}
+
+// Marks the c-space tiles depending on the routing tiles invalid, on the page and its neighbors.
+void cspace_routing_changed(world_t* w, int pagex, int pagey, uint64_t tiles)
+{
+	uint64_t inval[3][3];
+	tiles_around(tiles, 1, inval);
+
+	for(int dx = -1; dx <= 1; dx++)
+	{
+		for(int dy = -1; dy <= 1; dy++)
+		{
+			world_page_t* wp = find_world_page(w, pagex+dx, pagey+dy);
+			if(!wp || !wp->cspace || !inval[dx+1][dy+1])
+				continue;
 
-			route_unit_t *rt = *route;
-			while(rt->next && rt->next->next)
+			for(int m = 0; m < CSPACE_MODES; m++)
 			{
-				if(line_of_sight(rt->loc, rt->next->next->loc))
+				for(int d = 0; d < 32; d++)
 				{
-//					printf("Deleting.\n");
-					route_unit_t *tmp = rt->next;
-					DL_DELETE(*route, tmp);
-					free(tmp);
+					if(wp->cspace->planes[m][d])
+						wp->cspace->planes[m][d]->valid &= ~inval[dx+1][dy+1];
 				}
-				else
-					rt = rt->next;
 			}
+		}
+	}
+}
 
-			// Remove the first, because it's the starting point.
-			route_unit_t *tm = *route;
-			DL_DELETE(*route, tm);
-			free(tm);
-
-			// Free all memory.
-			search_unit_t *p_del, *p_tmp;
-			HASH_ITER(hh, closed_set, p_del, p_tmp)
-			{
-				HASH_DEL(closed_set, p_del);
-				free(p_del);
-			}
-			HASH_ITER(hh, open_set, p_del, p_tmp)
+void cspace_page_unloaded(world_t* w, int pagex, int pagey)
+{
+	world_page_t* wp = find_world_page(w, pagex, pagey);
+	if(wp)
+	{
+		for(int m = 0; m < CSPACE_MODES && wp->cspace; m++)
+		{
+			for(int d = 0; d < 32 && wp->cspace; d++)
 			{
-				HASH_DEL(open_set, p_del);
-				free(p_del);
+				if(wp->cspace->planes[m][d])
+					free_cspace_plane(wp->cspace->planes[m][d]->slot);
 			}
-
-			return 0;
 		}
+	}
+	cspace_routing_changed(w, pagex, pagey, ~0ULL);
+	dstar_routing_changed(w, pagex, pagey, ~0ULL);
+}
 
-		// move from open to closed:
-		HASH_DELETE(hh, open_set, p_cur);
-		HASH_ADD(hh, closed_set, loc,sizeof(route_xy_t), p_cur);
+// Called when the robot shapes are generated: the planes of the mode are dropped if the shapes changed.
+static void cspace_shapes_generated()
+{
+	int mode = tight_shapes+1;
+	if(!memcmp(cspace_shapes[mode], robot_shapes, sizeof(robot_shapes)))
+		return;
 
-		// For each neighbor
-		for(int xx=-1; xx<=1; xx++)
-		{
-			for(int yy=-1; yy<=1; yy++)
-			{
-				search_unit_t* found;
-				float new_g;
-				float new_g_from_parent;
-				if(xx == 0 && yy == 0) continue;
+	for(int i = cspace_stats.planes-1; i >= 0; i--)
+	{
+		if(cspace_slots[i].mode == mode)
+			free_cspace_plane(i);
+	}
+	memcpy(cspace_shapes[mode], robot_shapes, sizeof(robot_shapes));
+	cspace_shapes_gen[mode]++;
+}
 
-				search_unit_t* p_neigh;
-				route_xy_t neigh_loc = {p_cur->loc.x + xx, p_cur->loc.y + yy};
+// The column words of the c-space tile of the unit, made if they are invalid. NULL if there is no c-space for it (no
+// routing page, or out of memory).
+static const uint32_t* cspace_tile_bits(int x, int y, int direction)
+{
+	int px, py, ox, oy;
+	page_coords_from_unit_coords(x, y, &px, &py, &ox, &oy);
+	world_page_t* wp = find_world_page(routing_world, px, py);
+	cspace_plane_t* pl;
+	if(!wp || !wp->rpage || !(pl = cspace_plane(wp, direction)))
+		return NULL;
+
+	int tile = map_tile_idx(ox, oy);
+	if(!(pl->valid & (1ULL << tile)))
+		gen_cspace_tile(pl, px, py, tile, direction);
+	return pl->bits[tile];
+}
 
-				// Check if it's out-of-allowed area here:
+static int check_hit(int x, int y, int direction)
+{
+	const uint32_t* bits;
+	if((unsigned)direction < 32 && (bits = cspace_tile_bits(x, y, direction)))
+	{
+		cspace_stats.lookups++;
+		return (bits[x%MAP_TILE_W] >> (31 - y%MAP_TILE_W)) & 1;
+	}
 
+	cspace_stats.fallbacks++;
+	return check_hit_window(x, y, direction);
+}
 
-				HASH_FIND(hh, closed_set, &neigh_loc,sizeof(route_xy_t), found);
-				if(found)
-					continue; // ignore neighbor that's in closed_set.
+// The collision bits of the units y0 .. y0+31 (y0 a multiple of MAP_TILE_W) in the column x, first unit in the MSb.
+static uint32_t cspace_word(int x, int y0, int direction)
+{
+	if(x < 0 || y0 < 0 || x >= MAP_W*MAP_PAGE_W || y0 >= MAP_W*MAP_PAGE_W)
+		return 0xffffffff;
 
+	const uint32_t* bits = cspace_tile_bits(x, y0, direction);
+	if(bits)
+	{
+		cspace_stats.lookups++;
+		return bits[x%MAP_TILE_W];
+	}
 
-				// gscore for the neigbor: distance from the start to neighbor
-				// is current unit's g score plus distance to the neighbor.
-				new_g = p_cur->g + sqrt((float)(sq(p_cur->loc.x-neigh_loc.x) + sq(p_cur->loc.y-neigh_loc.y)));
+	uint32_t word = 0;
+	for(int i = 0; i < MAP_TILE_W; i++)
+		word = (word<<1) | (check_hit(x, y0+i, direction) ? 1 : 0);
+	return word;
+}
 
-				// for theta*:
-				if(p_cur->parent)
-					new_g_from_parent = p_cur->parent->g + sqrt((float)(sq(p_cur->parent->loc.x-neigh_loc.x) + sq(p_cur->parent->loc.y-neigh_loc.y)));
+void clear_route(route_unit_t **route)
+{
+	route_unit_t *elt, *tmp;
+	DL_FOREACH_SAFE(*route,elt,tmp)
+	{
+		DL_DELETE(*route,elt);
+		free(elt);
+	}
+	*route = NULL;
+}
 
+/*
+	Search state
+
+	Nodes come from a pool which is kept from search to search: chunks of SEARCH_NODE_CHUNK nodes, allocated the
+	first time a search gets that far, so the nodes never move. A node is found by location through a flat array
+	over the search area (search_cells), holding the pool index of the node of each routing unit. The array is never
+	cleared: an entry is only valid if it points to a node of the current search (index < n_search_nodes) which is at
+	that location - the pool fill level works as the generation counter. So a search, and every back-off attempt of
+	search2(), only resets a counter, and does no allocation once the pool and the array are big enough.
+
+	The search area is the bounding box of the routing pages within SEARCH_AREA_PAGES/2 pages of the start; the
+	robot can't go outside the routing pages anyway (check_hit() treats them as obstacles).
+
+	The open set is a binary min-heap by f score, for finding the next node to expand; each node knows its place in
+	the heap (heap_idx), so that a better path to a node already in the open set can move it up (decrease-key); the
+	closed nodes have heap_idx -1. Ties in f are broken by the order the nodes were added, which is the order a linear
+	scan through the open set used to find them - routes are the same as with the scan, which was quadratic in the
+	open set size.
+*/
 
-				HASH_FIND(hh, open_set, &neigh_loc,sizeof(route_xy_t), p_neigh);
+// Nodes expanded before giving up. Most of the time of an iteration is now in the collision checks of the neighbors.
+#ifndef SEARCH_MAX_ITERATIONS
+#define SEARCH_MAX_ITERATIONS 50000
+#endif
 
+#define SEARCH_AREA_PAGES 7
+#define SEARCH_NODE_CHUNK 16384
+#define SEARCH_MAX_NODES (8*SEARCH_MAX_ITERATIONS+1) // each iteration adds 8 neighbors at most
+#define SEARCH_NODE_CHUNKS ((SEARCH_MAX_NODES+SEARCH_NODE_CHUNK-1)/SEARCH_NODE_CHUNK)
 
-				int direction_from_cur_parent = -1;
-				int direction_from_neigh_parent = -1;
+static search_unit_t* search_node_chunks[SEARCH_NODE_CHUNKS];
+static uint32_t n_search_nodes;
+
+static uint32_t* search_cells;
+static int search_cells_alloc;
+static int area_x0, area_y0, area_w, area_h; // in routing units
+
+static search_unit_t** open_heap;
+static int open_heap_len, open_heap_alloc;
+
+search_stats_t search_stats;
+
+static inline search_unit_t* search_node(uint32_t idx)
+{
+	return &search_node_chunks[idx/SEARCH_NODE_CHUNK][idx%SEARCH_NODE_CHUNK];
+}
+
+static int setup_search_area(int s_x, int s_y)
+{
+	int s_px, s_py, ox, oy;
+	page_coords_from_unit_coords(s_x, s_y, &s_px, &s_py, &ox, &oy);
+
+	int min_px = s_px, max_px = s_px, min_py = s_py, max_py = s_py;
+	for(int px = s_px-SEARCH_AREA_PAGES/2; px <= s_px+SEARCH_AREA_PAGES/2; px++)
+	{
+		for(int py = s_py-SEARCH_AREA_PAGES/2; py <= s_py+SEARCH_AREA_PAGES/2; py++)
+		{
+			if(!routing_page(routing_world, px, py))
+				continue;
+			if(px < min_px) min_px = px;
+			if(px > max_px) max_px = px;
+			if(py < min_py) min_py = py;
+			if(py > max_py) max_py = py;
+		}
+	}
+
+	area_x0 = min_px*MAP_PAGE_W;
+	area_y0 = min_py*MAP_PAGE_W;
+	area_w = (max_px-min_px+1)*MAP_PAGE_W;
+	area_h = (max_py-min_py+1)*MAP_PAGE_W;
+
+	if(area_w*area_h > search_cells_alloc)
+	{
+		// Grows to the full SEARCH_AREA_PAGES area at most. The contents don't need initializing, but keep valgrind happy.
+		free(search_cells);
+		search_cells_alloc = area_w*area_h;
+		search_cells = calloc(search_cells_alloc, sizeof(uint32_t));
+		if(!search_cells)
+		{
+			printf("ERROR: out of memory for the routing search area\n");
+			search_cells_alloc = 0;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Entry of the unit in search_cells, NULL if outside the search area.
+static inline uint32_t* search_cell(int x, int y)
+{
+	x -= area_x0;
+	y -= area_y0;
+	if((unsigned)x >= (unsigned)area_w || (unsigned)y >= (unsigned)area_h)
+		return NULL;
+	return &search_cells[x*area_h + y];
+}
+
+// Node of the current search at the unit, NULL if none.
+static inline search_unit_t* find_search_node(uint32_t* cell, int x, int y)
+{
+	if(*cell >= n_search_nodes)
+		return NULL;
+	search_unit_t* p = search_node(*cell);
+	return (p->loc.x == x && p->loc.y == y) ? p : NULL;
+}
+
+// Returns NULL when the pool is at SEARCH_MAX_NODES or out of memory.
+static search_unit_t* new_search_node(uint32_t* cell, int x, int y)
+{
+	uint32_t idx = n_search_nodes;
+	if(idx >= SEARCH_MAX_NODES)
+		return NULL;
+
+	search_unit_t** chunk = &search_node_chunks[idx/SEARCH_NODE_CHUNK];
+	if(!*chunk && !(*chunk = malloc(SEARCH_NODE_CHUNK*sizeof(search_unit_t))))
+	{
+		printf("ERROR: out of memory for the routing search\n");
+		return NULL;
+	}
+
+	n_search_nodes++;
+	search_unit_t* p = search_node(idx);
+	memset(p, 0, sizeof(search_unit_t));
+	p->loc.x = x;
+	p->loc.y = y;
+	p->seq = idx;
+	*cell = idx;
+	return p;
+}
+
+static inline int heap_less(search_unit_t* a, search_unit_t* b)
+{
+	return a->f < b->f || (a->f == b->f && a->seq < b->seq);
+}
+
+static inline void heap_set(int idx, search_unit_t* p)
+{
+	open_heap[idx] = p;
+	p->heap_idx = idx;
+}
+
+static void heap_up(int idx)
+{
+	search_unit_t* p = open_heap[idx];
+	while(idx > 0)
+	{
+		int parent = (idx-1)/2;
+		if(!heap_less(p, open_heap[parent]))
+			break;
+		heap_set(idx, open_heap[parent]);
+		idx = parent;
+	}
+	heap_set(idx, p);
+}
+
+static void heap_down(int idx)
+{
+	search_unit_t* p = open_heap[idx];
+	while(1)
+	{
+		int child = 2*idx+1;
+		if(child >= open_heap_len)
+			break;
+		if(child+1 < open_heap_len && heap_less(open_heap[child+1], open_heap[child]))
+			child++;
+		if(!heap_less(open_heap[child], p))
+			break;
+		heap_set(idx, open_heap[child]);
+		idx = child;
+	}
+	heap_set(idx, p);
+}
+
+static void heap_push(search_unit_t* p)
+{
+	if(open_heap_len >= open_heap_alloc)
+	{
+		int new_alloc = open_heap_alloc?(2*open_heap_alloc):4096;
+		search_unit_t** new_heap = realloc(open_heap, new_alloc*sizeof(search_unit_t*));
+		if(!new_heap)
+		{
+			printf("ERROR: out of memory for the routing search\n");
+			exit(1);
+		}
+		open_heap = new_heap;
+		open_heap_alloc = new_alloc;
+	}
+	heap_set(open_heap_len, p);
+	open_heap_len++;
+	heap_up(open_heap_len-1);
+}
+
+static search_unit_t* heap_pop()
+{
+	if(open_heap_len == 0)
+		return NULL;
+
+	search_unit_t* top = open_heap[0];
+	top->heap_idx = -1;
+	open_heap_len--;
+	if(open_heap_len > 0)
+	{
+		heap_set(0, open_heap[open_heap_len]);
+		heap_down(0);
+	}
+	return top;
+}
+
+// Drops the points the robot can skip, going straight from the previous one to the next.
+static void smooth_route(route_unit_t **route)
+{
+	route_unit_t *rt = *route;
+	while(rt->next && rt->next->next)
+	{
+		if(line_of_sight(rt->loc, rt->next->next->loc))
+		{
+//			printf("Deleting.\n");
+			route_unit_t *tmp = rt->next;
+			DL_DELETE(*route, tmp);
+			free(tmp);
+		}
+		else
+			rt = rt->next;
+	}
+}
+
+static int search(route_unit_t **route, float start_ang, int start_x_mm, int start_y_mm, int end_x_mm, int end_y_mm)
+{
+	clear_route(route);
+
+	int s_x, s_y, e_x, e_y;
+	unit_coords(start_x_mm, start_y_mm, &s_x, &s_y);
+	unit_coords(end_x_mm, end_y_mm, &e_x, &e_y);
+
+	while(start_ang >= 2.0*M_PI) start_ang -= 2.0*M_PI;
+	while(start_ang < 0.0) start_ang += 2.0*M_PI;
+	int start_dir = (start_ang/(2.0*M_PI) * 32.0)+0.5;
+
+//	printf("Start %d,%d,  end %d,%d  start_ang=%f  start_dir=%d\n", s_x, s_y, e_x, e_y, start_ang, start_dir);
+
+
+	if(setup_search_area(s_x, s_y))
+		return 1;
+
+	n_search_nodes = 0;
+	open_heap_len = 0;
+	search_stats.searches++;
+
+	search_unit_t* p_start = new_search_node(search_cell(s_x, s_y), s_x, s_y);
+	if(!p_start)
+		return 1;
+
+	p_start->direction = start_dir;
+	p_start->parent = NULL;
+	// g = 0
+	p_start->f = sqrt((float)(sq(e_x-s_x) + sq(e_y-s_y)));
+
+	heap_push(p_start);
+
+	int cnt = 0;
+
+	while(open_heap_len > 0)
+	{
+		cnt++;
+		search_stats.expansions++;
+
+		if(cnt > SEARCH_MAX_ITERATIONS)
+		{
+			printf("Giving up at cnt = %d\n", cnt);
+			return 3;
+		}
+
+		// Lowest f score from open_set.
+		search_unit_t* p_cur = heap_pop();
+
+		if(p_cur == NULL)
+		{
+			printf("search() error: open set empty while finding lowest f score.\n");
+			return 55;
+		}
+
+		if(p_cur->loc.x == e_x && p_cur->loc.y == e_y)
+		{
+
+			//printf("Solution found, cnt = %d\n", cnt);
+			search_stats.cost = p_cur->g;
+
+			// solution found.
+
+			// Reconstruct the path
+
+			search_unit_t* p_recon = p_cur;
+			while( (p_recon = p_recon->parent) )
+			{
+				route_unit_t* point = malloc(sizeof(route_unit_t));
+				point->loc.x = p_recon->loc.x; point->loc.y = p_recon->loc.y;
+				point->backmode = 0;
+				DL_PREPEND(*route, point);
+			}
+
+			smooth_route(route);
+
+			// Remove the first, because it's the starting point.
+			route_unit_t *tm = *route;
+			DL_DELETE(*route, tm);
+			free(tm);
+
+			return 0;
+		}
+
+		// heap_pop() moved it from open to closed.
+
+		// For each neighbor
+		for(int xx=-1; xx<=1; xx++)
+		{
+			for(int yy=-1; yy<=1; yy++)
+			{
+				float new_g;
+				float new_g_from_parent;
+				if(xx == 0 && yy == 0) continue;
+
+				route_xy_t neigh_loc = {p_cur->loc.x + xx, p_cur->loc.y + yy};
+
+				// Check if it's out-of-allowed area here:
+				uint32_t* neigh_cell = search_cell(neigh_loc.x, neigh_loc.y);
+				if(!neigh_cell)
+					continue;
+
+				search_unit_t* p_neigh = find_search_node(neigh_cell, neigh_loc.x, neigh_loc.y);
+				if(p_neigh && p_neigh->heap_idx < 0)
+					continue; // ignore neighbor that's in closed_set.
+
+
+				// gscore for the neigbor: distance from the start to neighbor
+				// is current unit's g score plus distance to the neighbor.
+				new_g = p_cur->g + sqrt((float)(sq(p_cur->loc.x-neigh_loc.x) + sq(p_cur->loc.y-neigh_loc.y)));
+
+				// for theta*:
+				if(p_cur->parent)
+					new_g_from_parent = p_cur->parent->g + sqrt((float)(sq(p_cur->parent->loc.x-neigh_loc.x) + sq(p_cur->parent->loc.y-neigh_loc.y)));
+
+
+				int direction_from_cur_parent = -1;
+				int direction_from_neigh_parent = -1;
 
 				if(p_cur->parent)  // Use this if possible
 				{
@@ -1175,15 +1785,15 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 
 				if(!p_neigh)
 				{
-					p_neigh = (search_unit_t*) malloc(sizeof(search_unit_t));
-					memset(p_neigh, 0, sizeof(search_unit_t));
-					p_neigh->loc.x = neigh_loc.x; p_neigh->loc.y = neigh_loc.y;
-					HASH_ADD(hh, open_set, loc,sizeof(route_xy_t), p_neigh);
+					p_neigh = new_search_node(neigh_cell, neigh_loc.x, neigh_loc.y);
+					if(!p_neigh)
+						continue;
 
 					p_neigh->direction = direction;
 					p_neigh->parent = p_cur;
 					p_neigh->g = new_g;
 					p_neigh->f = new_g + sqrt((float)(sq(e_x-neigh_loc.x) + sq(e_y-neigh_loc.y)));
+					heap_push(p_neigh);
 
 				}
 				else
@@ -1196,6 +1806,7 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 							p_neigh->parent = p_cur->parent;
 							p_neigh->g = new_g_from_parent;
 							p_neigh->f = new_g_from_parent + sqrt((float)(sq(e_x-neigh_loc.x) + sq(e_y-neigh_loc.y)));
+							heap_up(p_neigh->heap_idx);
 						}
 					}
 					else if(new_g < p_neigh->g)  // A* style path shorter than before.
@@ -1204,6 +1815,7 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 						p_neigh->parent = p_cur;
 						p_neigh->g = new_g;
 						p_neigh->f = new_g + sqrt((float)(sq(e_x-neigh_loc.x) + sq(e_y-neigh_loc.y)));
+						heap_up(p_neigh->heap_idx);
 					}
 				}
 			}
@@ -1212,18 +1824,6 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 		}		
 	}
 
-	search_unit_t *p_del, *p_tmp;
-	HASH_ITER(hh, closed_set, p_del, p_tmp)
-	{
-		HASH_DELETE(hh, closed_set, p_del);
-		free(p_del);
-	}
-	HASH_ITER(hh, open_set, p_del, p_tmp)
-	{
-		HASH_DELETE(hh, open_set, p_del);
-		free(p_del);
-	}
-	
 	//printf("Solution not found, cnt = %d\n", cnt);
 
 	if(cnt < 200)
@@ -1237,85 +1837,408 @@ static int search(route_unit_t **route, float start_ang, int start_x_mm, int sta
 }
 
 /*
+	search_grid(): A* over the units, 8-connected like the cluster graph of the hierarchical routing. A step in the
+	direction k (0 is +x, 1 is +x+y, 2 is +y, and so on) is allowed if the robot in the heading k*4 doesn't hit
+	anything at the unit it steps to. Unlike in search()'s Theta*, the heading doesn't depend on where the path comes
+	from, which lets the search skip the units no shortest path needs to turn at: jump point search (JPS).
+
+	The pruning rules of JPS are about obstacle cells; here they are about the steps themselves. Going from p to x,
+	the neighbor n of x is left out if the robot can go from p to n in one or two allowed steps around x, not via x,
+	at most as far as via x (strictly less far if p -> x is diagonal, so that ties leave one of the paths). Whether a
+	step is allowed only depends on the step, so the path from n on is as allowed after the detour as before: the
+	routes found are as short as with plain A*. From each unit expanded, the search jumps in the remaining
+	directions until it runs into something, reaches the goal, or comes to a unit with neighbors that aren't left out
+	(a diagonal jump also stops where one of its straight side jumps would).
+
+	The path is smoothed like search()'s. Unlike search(), the goal itself is the last point of the route: the point
+	before it can be a long jump away.
+*/
 
-search2():
-
-Return values:
-
-0 success
-1 fails near the beginning
-2 backing off helped search to succeed in the beginning, but it still fails later
-3 search succeeds in the beginning, but fails later
-
-Searches for the route; if it fails almost right away, different back-offs are tried.
-Note that now "backoffs" also include trying to go forward first, as this could provide better
-results than the search algorithm can provide, in some rare cases.
+static const int step_dx[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+static const int step_dy[8] = {0, 1, 1, 1, 0, -1, -1, -1};
 
-*/
+#ifndef ROUTING_SEARCH_ALGO
+#define ROUTING_SEARCH_ALGO SEARCH_THETA
+#endif
 
+int routing_search_algo = ROUTING_SEARCH_ALGO;
 
-int search2(route_unit_t **route, float start_ang, int start_x_mm, int start_y_mm, int end_x_mm, int end_y_mm)
+static inline float step_len(int dx, int dy)
 {
+	return (dx && dy) ? 1.41421356 : 1.0;
+}
 
-#define SRCH_NUM_A 23
-	static const int a_s[SRCH_NUM_A] =   // back-off angles in degs
-	{	0,	-4,	4,	-8,	8,	-12,	12,	-18,	18,	-24,	24,	-36,	36,	-48,	48,	-60,	60,	-72,	72, 	-84,	84,	-96,	96	};
-
+// Direction of the step (dx, dy), -1 .. 1 each
+static inline int step_dir(int dx, int dy)
+{
+	static const int dirs[3][3] = {{5, 4, 3}, {6, -1, 2}, {7, 0, 1}};
+	return dirs[dx+1][dy+1];
+}
 
-#define SRCH_NUM_BACK 18
-	static const int b_s[SRCH_NUM_BACK] = // back-offs in mm - positive backoffs are actually forward :-).
-	{	80,	120,	160,	240,	280,	320,	400,	480,	-320,	-400,	-280,	-240,	-200,	-480,	-160,	-120,	-80,	-560	};
+// The robot can step to the unit in the direction k, within the search area.
+static inline int step_allowed(int x, int y, int k)
+{
+	return search_cell(x, y) && !check_hit(x, y, k*4);
+}
 
+/*
+	The ways around x, for leaving a step out: from p (the unit before x, in the direction d) to n (the unit after x,
+	in the direction k), in one or two steps within the 3x3 units around x, not through x, and at most as long (less
+	if d is diagonal) as through x. Only depends on d and k, so made once.
+*/
 
-	// If going forward doesn't work out from the beginning, try backing off slightly.
+#define JPS_MAX_DETOURS 4
 
-	int ret = search(route, start_ang, start_x_mm, start_y_mm, end_x_mm, end_y_mm);
+typedef struct
+{
+	int8_t n_steps;
+	int8_t x[2], y[2]; // units stepped to, relative to x
+	int8_t k[2];       // directions of the steps
+} jps_detour_t;
 
-	if(ret == 0)
-		return 0;
+static jps_detour_t jps_detours[8][8][JPS_MAX_DETOURS];
+static int8_t jps_n_detours[8][8]; // -1 for stepping back to p
+static int jps_detours_made;
 
-	if(ret == 1)
+static void jps_add_detour(int d, int k, int n_steps, int x0, int y0, int k0, int x1, int y1, int k1)
+{
+	int i = jps_n_detours[d][k]++;
+	if(i >= JPS_MAX_DETOURS)
 	{
-		//printf("Search fails in the start - trying to back off.\n");
+		printf("ERROR: jps_add_detour: too many detours\n");
+		exit(1);
+	}
+	jps_detours[d][k][i] = (jps_detour_t){n_steps, {x0, x1}, {y0, y1}, {k0, k1}};
+}
 
-		for(int a_idx = 0; a_idx < SRCH_NUM_A; a_idx++)
+static void make_jps_detours()
+{
+	for(int d = 0; d < 8; d++)
+	{
+		for(int k = 0; k < 8; k++)
 		{
-			for(int back_idx = 0; back_idx < SRCH_NUM_BACK; back_idx++)
+			// p and n relative to x
+			int p_x = -step_dx[d], p_y = -step_dy[d];
+			int n_x = step_dx[k], n_y = step_dy[k];
+			jps_n_detours[d][k] = 0;
+			if(n_x == p_x && n_y == p_y)
 			{
-				float new_ang = start_ang + (2.0*M_PI*(float)a_s[a_idx]/360.0);
-				while(new_ang >= 2.0*M_PI) new_ang -= 2.0*M_PI;
-				while(new_ang < 0.0) new_ang += 2.0*M_PI;
-				int new_x = start_x_mm + cos(new_ang)*b_s[back_idx];
-				int new_y = start_y_mm + sin(new_ang)*b_s[back_idx];
-
-				int dir = (new_ang/(2.0*M_PI) * 32.0)+0.5;
-				if(dir < 0) dir = 0; else if(dir > 31) dir = 31;
+				jps_n_detours[d][k] = -1;
+				continue;
+			}
 
-				int new_x_units, new_y_units;
-				unit_coords(new_x, new_y, &new_x_units, &new_y_units);
+			float via = step_len(step_dx[d], step_dy[d]) + step_len(n_x, n_y);
+			float limit = (d&1) ? (via - 0.001) : (via + 0.001);
 
-		//		printf("Back off ang=%.2f deg, mm = %d  -> new start = (%d, %d) --> ", TODEG(new_ang), b_s[back_idx], new_x_units, new_y_units);
+			// Straight from p first, the cheapest to check
+			if(abs(n_x-p_x) <= 1 && abs(n_y-p_y) <= 1 && step_len(n_x-p_x, n_y-p_y) < limit)
+				jps_add_detour(d, k, 1, n_x, n_y, step_dir(n_x-p_x, n_y-p_y), 0, 0, 0);
 
-				if(check_hit(new_x_units, new_y_units, dir))
+			// Through another neighbor m of x
+			for(int m_x = -1; m_x <= 1; m_x++)
+			{
+				for(int m_y = -1; m_y <= 1; m_y++)
 				{
-		//			printf("backing off hits the wall.\n");
+					if((m_x == 0 && m_y == 0) || (m_x == p_x && m_y == p_y) || (m_x == n_x && m_y == n_y))
+						continue;
+					if(abs(m_x-p_x) > 1 || abs(m_y-p_y) > 1 || abs(n_x-m_x) > 1 || abs(n_y-m_y) > 1)
+						continue;
+					if(step_len(m_x-p_x, m_y-p_y) + step_len(n_x-m_x, n_y-m_y) < limit)
+						jps_add_detour(d, k, 2, m_x, m_y, step_dir(m_x-p_x, m_y-p_y), n_x, n_y, step_dir(n_x-m_x, n_y-m_y));
 				}
-				else
-				{
-					int ret = search(route, new_ang, new_x, new_y, end_x_mm, end_y_mm);
-					if(ret == 0)
-					{
-						//printf("Search succeeded (back off ang=%.1fdeg, mm = %d), stopping back-off search.\n", TODEG(new_ang), b_s[back_idx]);
+			}
+		}
+	}
+	jps_detours_made = 1;
+}
 
-						route_unit_t* point = malloc(sizeof(route_unit_t));
-						point->loc.x = new_x_units; point->loc.y = new_y_units;
-						point->backmode = (b_s[back_idx]<0)?1:0;
-						DL_PREPEND(*route, point);
+// True if the step from (x,y) in the direction k can be left out, having come to (x,y) in the direction d.
+static int jps_pruned(int x, int y, int d, int k)
+{
+	if(jps_n_detours[d][k] < 0)
+		return 1;
 
-						return 0;
-					}
-					else if(ret > 1)
-					{
+	for(int i = 0; i < jps_n_detours[d][k]; i++)
+	{
+		jps_detour_t* t = &jps_detours[d][k][i];
+		if(step_allowed(x+t->x[0], y+t->y[0], t->k[0]) && (t->n_steps == 1 || step_allowed(x+t->x[1], y+t->y[1], t->k[1])))
+			return 1;
+	}
+	return 0;
+}
+
+// The directions a path coming in the direction d goes on to without obstacles
+static inline int jps_natural(int d, int k)
+{
+	return k == d || ((d&1) && (k == ((d+7)&7) || k == ((d+1)&7)));
+}
+
+// True if the unit, come to in the direction d, has neighbors to expand other than the natural ones.
+static int jps_forced(int x, int y, int d)
+{
+	for(int k = 0; k < 8; k++)
+	{
+		if(jps_natural(d, k) || k == ((d+4)&7))
+			continue;
+		// Left out is the rule on open floor, and usually cheaper to tell
+		if(!jps_pruned(x, y, d, k) && step_allowed(x+step_dx[k], y+step_dy[k], k))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Unknown floor is free to route through, so a jump that is let go runs on to the edge of the search area, over most
+	of it on open ground: it would take more collision checks than plain A* does. Jumps are stopped after
+	JPS_MAX_JUMP units instead; the unit stopped at is a jump point like the others, so the routes stay as short.
+*/
+#ifndef JPS_MAX_JUMP
+#define JPS_MAX_JUMP 8
+#endif
+
+// Jumps from (x,y) in the direction d. Returns 1 with the jump point in jp, 0 if the jump runs into something.
+// Counts the units jumped over in *scanned.
+static int jps_jump(int x, int y, int d, int e_x, int e_y, route_xy_t* jp, int* scanned)
+{
+	for(int i = 1; ; i++)
+	{
+		x += step_dx[d];
+		y += step_dy[d];
+		if(!step_allowed(x, y, d))
+			return 0;
+		(*scanned)++;
+
+		if((x == e_x && y == e_y) || i >= JPS_MAX_JUMP || jps_forced(x, y, d))
+			break;
+		if((d&1) && (jps_jump(x, y, (d+7)&7, e_x, e_y, jp, scanned) || jps_jump(x, y, (d+1)&7, e_x, e_y, jp, scanned)))
+			break;
+	}
+	jp->x = x;
+	jp->y = y;
+	return 1;
+}
+
+// Octile distance, the length of the shortest 8-connected path without obstacles
+static inline float octile(int dx, int dy)
+{
+	dx = abs(dx);
+	dy = abs(dy);
+	return (dx > dy) ? (dx + 0.41421356*dy) : (dy + 0.41421356*dx);
+}
+
+static int search_grid(route_unit_t **route, float start_ang, int start_x_mm, int start_y_mm, int end_x_mm, int end_y_mm, int jump_points)
+{
+	clear_route(route);
+
+	int s_x, s_y, e_x, e_y;
+	unit_coords(start_x_mm, start_y_mm, &s_x, &s_y);
+	unit_coords(end_x_mm, end_y_mm, &e_x, &e_y);
+
+	while(start_ang >= 2.0*M_PI) start_ang -= 2.0*M_PI;
+	while(start_ang < 0.0) start_ang += 2.0*M_PI;
+
+	if(setup_search_area(s_x, s_y))
+		return 1;
+
+	if(!jps_detours_made)
+		make_jps_detours();
+
+	n_search_nodes = 0;
+	open_heap_len = 0;
+	search_stats.searches++;
+
+	search_unit_t* p_start = new_search_node(search_cell(s_x, s_y), s_x, s_y);
+	if(!p_start)
+		return 1;
+
+	p_start->direction = -1;
+	p_start->f = octile(e_x-s_x, e_y-s_y);
+	heap_push(p_start);
+
+	int cnt = 0;
+	int scanned = 0; // units expanded or jumped over, for telling if it failed near the start
+
+	while(open_heap_len > 0)
+	{
+		cnt++;
+		search_stats.expansions++;
+
+		if(cnt > SEARCH_MAX_ITERATIONS)
+		{
+			printf("Giving up at cnt = %d\n", cnt);
+			return 3;
+		}
+
+		search_unit_t* p_cur = heap_pop();
+		scanned++;
+
+		if(p_cur->loc.x == e_x && p_cur->loc.y == e_y)
+		{
+			search_stats.cost = p_cur->g;
+
+			for(search_unit_t* p_recon = p_cur; p_recon; p_recon = p_recon->parent)
+			{
+				route_unit_t* point = malloc(sizeof(route_unit_t));
+				point->loc.x = p_recon->loc.x; point->loc.y = p_recon->loc.y;
+				point->backmode = 0;
+				DL_PREPEND(*route, point);
+			}
+
+			smooth_route(route);
+
+			// Remove the first, because it's the starting point.
+			route_unit_t *tm = *route;
+			DL_DELETE(*route, tm);
+			free(tm);
+
+			return 0;
+		}
+
+		int d = p_cur->direction;
+		for(int k = 0; k < 8; k++)
+		{
+			// The robot must be able to turn to the first step.
+			if(cnt == 1 && !test_robot_turn(s_x, s_y, start_ang, ((float)(k*4)/32.0)*2.0*M_PI))
+				continue;
+
+			route_xy_t loc;
+			if(jump_points)
+			{
+				if(d >= 0 && !jps_natural(d, k) && (k == ((d+4)&7) || jps_pruned(p_cur->loc.x, p_cur->loc.y, d, k)))
+					continue;
+				if(!jps_jump(p_cur->loc.x, p_cur->loc.y, k, e_x, e_y, &loc, &scanned))
+					continue;
+			}
+			else
+			{
+				loc.x = p_cur->loc.x + step_dx[k];
+				loc.y = p_cur->loc.y + step_dy[k];
+				if(!step_allowed(loc.x, loc.y, k))
+					continue;
+			}
+
+			uint32_t* cell = search_cell(loc.x, loc.y);
+			search_unit_t* p_neigh = find_search_node(cell, loc.x, loc.y);
+			if(p_neigh && p_neigh->heap_idx < 0)
+				continue; // closed
+
+			float new_g = p_cur->g + sqrt((float)(sq(loc.x-p_cur->loc.x) + sq(loc.y-p_cur->loc.y)));
+			if(!p_neigh)
+			{
+				p_neigh = new_search_node(cell, loc.x, loc.y);
+				if(!p_neigh)
+					continue;
+				p_neigh->g = new_g;
+				p_neigh->f = new_g + octile(e_x-loc.x, e_y-loc.y);
+				p_neigh->direction = k;
+				p_neigh->parent = p_cur;
+				heap_push(p_neigh);
+			}
+			else if(new_g < p_neigh->g)
+			{
+				p_neigh->g = new_g;
+				p_neigh->f = new_g + octile(e_x-loc.x, e_y-loc.y);
+				p_neigh->direction = k;
+				p_neigh->parent = p_cur;
+				heap_up(p_neigh->heap_idx);
+			}
+		}
+	}
+
+	if(scanned < 200)
+		return 1;
+
+	return 2;
+}
+
+// The full resolution search of search2(), by routing_search_algo
+static int search_algo(route_unit_t **route, float start_ang, int start_x_mm, int start_y_mm, int end_x_mm, int end_y_mm)
+{
+	if(routing_search_algo == SEARCH_THETA)
+		return search(route, start_ang, start_x_mm, start_y_mm, end_x_mm, end_y_mm);
+	return search_grid(route, start_ang, start_x_mm, start_y_mm, end_x_mm, end_y_mm, routing_search_algo == SEARCH_JPS);
+}
+
+/*
+
+search2():
+
+Return values:
+
+0 success
+1 fails near the beginning
+2 backing off helped search to succeed in the beginning, but it still fails later
+3 search succeeds in the beginning, but fails later
+
+Searches for the route; if it fails almost right away, different back-offs are tried.
+Note that now "backoffs" also include trying to go forward first, as this could provide better
+results than the search algorithm can provide, in some rare cases.
+
+*/
+
+
+int search2(route_unit_t **route, float start_ang, int start_x_mm, int start_y_mm, int end_x_mm, int end_y_mm)
+{
+
+#define SRCH_NUM_A 23
+	static const int a_s[SRCH_NUM_A] =   // back-off angles in degs
+	{	0,	-4,	4,	-8,	8,	-12,	12,	-18,	18,	-24,	24,	-36,	36,	-48,	48,	-60,	60,	-72,	72, 	-84,	84,	-96,	96	};
+
+
+#define SRCH_NUM_BACK 18
+	static const int b_s[SRCH_NUM_BACK] = // back-offs in mm - positive backoffs are actually forward :-).
+	{	80,	120,	160,	240,	280,	320,	400,	480,	-320,	-400,	-280,	-240,	-200,	-480,	-160,	-120,	-80,	-560	};
+
+
+	// If going forward doesn't work out from the beginning, try backing off slightly.
+
+	int ret = search_algo(route, start_ang, start_x_mm, start_y_mm, end_x_mm, end_y_mm);
+
+	if(ret == 0)
+		return 0;
+
+	if(ret == 1)
+	{
+		//printf("Search fails in the start - trying to back off.\n");
+
+		for(int a_idx = 0; a_idx < SRCH_NUM_A; a_idx++)
+		{
+			for(int back_idx = 0; back_idx < SRCH_NUM_BACK; back_idx++)
+			{
+				float new_ang = start_ang + (2.0*M_PI*(float)a_s[a_idx]/360.0);
+				while(new_ang >= 2.0*M_PI) new_ang -= 2.0*M_PI;
+				while(new_ang < 0.0) new_ang += 2.0*M_PI;
+				int new_x = start_x_mm + cos(new_ang)*b_s[back_idx];
+				int new_y = start_y_mm + sin(new_ang)*b_s[back_idx];
+
+				int dir = (new_ang/(2.0*M_PI) * 32.0)+0.5;
+				if(dir < 0) dir = 0; else if(dir > 31) dir = 31;
+
+				int new_x_units, new_y_units;
+				unit_coords(new_x, new_y, &new_x_units, &new_y_units);
+
+		//		printf("Back off ang=%.2f deg, mm = %d  -> new start = (%d, %d) --> ", TODEG(new_ang), b_s[back_idx], new_x_units, new_y_units);
+
+				if(check_hit(new_x_units, new_y_units, dir))
+				{
+		//			printf("backing off hits the wall.\n");
+				}
+				else
+				{
+					int ret = search_algo(route, new_ang, new_x, new_y, end_x_mm, end_y_mm);
+					if(ret == 0)
+					{
+						//printf("Search succeeded (back off ang=%.1fdeg, mm = %d), stopping back-off search.\n", TODEG(new_ang), b_s[back_idx]);
+
+						route_unit_t* point = malloc(sizeof(route_unit_t));
+						point->loc.x = new_x_units; point->loc.y = new_y_units;
+						point->backmode = (b_s[back_idx]<0)?1:0;
+						DL_PREPEND(*route, point);
+
+						return 0;
+					}
+					else if(ret > 1)
+					{
 						//printf("Search failed later than in the beginning, stopping back-off search.\n");
 						return 2;
 					}
@@ -1323,120 +2246,1709 @@ int search2(route_unit_t **route, float start_ang, int start_x_mm, int start_y_m
 
 			}
 		}
-		return 1;
+		return 1;
+	}
+
+	return 3;
+
+}
+
+
+/*
+	Incremental replanning
+
+	When something blocks the route, the robot backs off, looks around and searches again to the same goal, often
+	several times in a row; each search started from scratch, although only a little of the map had changed. With
+	routing_incremental set, search_route() keeps the search of the active route and repairs it instead (D* Lite,
+	Koenig & Likhachev, in its optimized form).
+
+	The search runs backwards, from the goal to the robot, over the 8-connected units like search_grid(): a step in the
+	direction k is allowed if the robot in the heading k*4 doesn't hit anything at the unit it steps to, and the first
+	step must be one the robot can turn to from its heading. g of a unit is its distance to the goal, rhs the one step
+	lookahead from its neighbors; the units where the two differ are in the queue, by key (min(g,rhs) + the octile
+	distance to the robot + km, min(g,rhs)). The robot moving only adds to km, so the queue never needs reordering.
+
+	gen_routing_page() tells which routing tiles it changed (dstar_routing_changed(), like for the c-space, and
+	cspace_page_unloaded() for a page that is gone); the c-space tiles depending on them are marked dirty. The next
+	search recomputes rhs of the units in and next to the dirty tiles, and expands only the units whose distance to the
+	goal changed. A new goal, a new world, robot shapes changed for the search mode, or a start outside the area kept,
+	makes a fresh search, in the usual wide, normal, tight order; the state is kept for the mode the route was found in.
+
+	The state covers the units within DSTAR_MARGIN of the bounding box of the start and the goal of the fresh search.
+	Nodes come from a pool of chunks found through a flat array over the area, like search()'s, but kept from search
+	to search. The route is the path down the g values, smoothed like search()'s, the goal being the last point.
+*/
+
+#ifndef ROUTING_INCREMENTAL
+#define ROUTING_INCREMENTAL 0
+#endif
+
+#define DSTAR_MARGIN MAP_PAGE_W // units around the start and the goal
+#define DSTAR_INF MAX_F
+
+int routing_incremental = ROUTING_INCREMENTAL;
+dstar_stats_t dstar_stats;
+
+typedef struct
+{
+	route_xy_t loc;
+	float g;
+	float rhs;
+	float k1, k2;  // key in the queue
+	int heap_idx;  // position in dstar_heap, -1 when not in the queue
+} dstar_node_t;
+
+static dstar_node_t* dstar_node_chunks[SEARCH_NODE_CHUNKS];
+static uint32_t n_dstar_nodes;
+static int dstar_full; // ran out of nodes
+
+static uint32_t* dstar_cells;
+static int dstar_cells_alloc;
+static uint8_t* dstar_dirty; // per tile of the area: the c-space changed since the last search
+static int dstar_dirty_alloc;
+static int dstar_any_dirty;
+
+static dstar_node_t** dstar_heap;
+static int dstar_heap_len, dstar_heap_alloc;
+
+static int dstar_valid;
+static world_t* dstar_world;
+static int dstar_mode; // tight_shapes
+static uint32_t dstar_shapes_gen;
+static int dstar_x0, dstar_y0, dstar_w, dstar_h; // in units, tile aligned
+static route_xy_t dstar_goal;
+static route_xy_t dstar_start;
+static route_xy_t dstar_last; // start when km was last updated
+static float dstar_km;
+static int dstar_start_steps; // bit k set if the robot can turn to the direction k at the start
+
+static inline dstar_node_t* dstar_node(uint32_t idx)
+{
+	return &dstar_node_chunks[idx/SEARCH_NODE_CHUNK][idx%SEARCH_NODE_CHUNK];
+}
+
+// Entry of the unit in dstar_cells, NULL if outside the area.
+static inline uint32_t* dstar_cell(int x, int y)
+{
+	x -= dstar_x0;
+	y -= dstar_y0;
+	if((unsigned)x >= (unsigned)dstar_w || (unsigned)y >= (unsigned)dstar_h)
+		return NULL;
+	return &dstar_cells[x*dstar_h + y];
+}
+
+// Node of the unit, NULL if none.
+static inline dstar_node_t* dstar_find(int x, int y)
+{
+	uint32_t* cell = dstar_cell(x, y);
+	if(!cell || *cell >= n_dstar_nodes)
+		return NULL;
+	dstar_node_t* n = dstar_node(*cell);
+	return (n->loc.x == x && n->loc.y == y) ? n : NULL;
+}
+
+// Node of the unit, made with g and rhs infinite if there is none. NULL outside the area, or when out of nodes.
+static dstar_node_t* dstar_get(int x, int y)
+{
+	uint32_t* cell = dstar_cell(x, y);
+	if(!cell)
+		return NULL;
+	if(*cell < n_dstar_nodes)
+	{
+		dstar_node_t* n = dstar_node(*cell);
+		if(n->loc.x == x && n->loc.y == y)
+			return n;
+	}
+
+	uint32_t idx = n_dstar_nodes;
+	dstar_node_t** chunk = &dstar_node_chunks[idx/SEARCH_NODE_CHUNK];
+	if(idx >= SEARCH_MAX_NODES || (!*chunk && !(*chunk = malloc(SEARCH_NODE_CHUNK*sizeof(dstar_node_t)))))
+	{
+		if(idx < SEARCH_MAX_NODES)
+			printf("ERROR: out of memory for the incremental routing search\n");
+		dstar_full = 1;
+		return NULL;
+	}
+
+	n_dstar_nodes++;
+	dstar_node_t* n = dstar_node(idx);
+	n->loc.x = x;
+	n->loc.y = y;
+	n->g = n->rhs = DSTAR_INF;
+	n->heap_idx = -1;
+	*cell = idx;
+	return n;
+}
+
+static inline int dstar_key_less(float a1, float a2, float b1, float b2)
+{
+	return a1 < b1 || (a1 == b1 && a2 < b2);
+}
+
+static inline void dstar_key(dstar_node_t* n, float* k1, float* k2)
+{
+	float m = (n->g < n->rhs) ? n->g : n->rhs;
+	*k1 = m + octile(n->loc.x-dstar_start.x, n->loc.y-dstar_start.y) + dstar_km;
+	*k2 = m;
+}
+
+static inline int dstar_heap_less(dstar_node_t* a, dstar_node_t* b)
+{
+	return dstar_key_less(a->k1, a->k2, b->k1, b->k2);
+}
+
+static inline void dstar_heap_set(int idx, dstar_node_t* n)
+{
+	dstar_heap[idx] = n;
+	n->heap_idx = idx;
+}
+
+static void dstar_heap_up(int idx)
+{
+	dstar_node_t* n = dstar_heap[idx];
+	while(idx > 0)
+	{
+		int parent = (idx-1)/2;
+		if(!dstar_heap_less(n, dstar_heap[parent]))
+			break;
+		dstar_heap_set(idx, dstar_heap[parent]);
+		idx = parent;
+	}
+	dstar_heap_set(idx, n);
+}
+
+static void dstar_heap_down(int idx)
+{
+	dstar_node_t* n = dstar_heap[idx];
+	while(1)
+	{
+		int child = 2*idx+1;
+		if(child >= dstar_heap_len)
+			break;
+		if(child+1 < dstar_heap_len && dstar_heap_less(dstar_heap[child+1], dstar_heap[child]))
+			child++;
+		if(!dstar_heap_less(dstar_heap[child], n))
+			break;
+		dstar_heap_set(idx, dstar_heap[child]);
+		idx = child;
+	}
+	dstar_heap_set(idx, n);
+}
+
+static void dstar_heap_push(dstar_node_t* n)
+{
+	if(dstar_heap_len >= dstar_heap_alloc)
+	{
+		int new_alloc = dstar_heap_alloc?(2*dstar_heap_alloc):4096;
+		dstar_node_t** new_heap = realloc(dstar_heap, new_alloc*sizeof(dstar_node_t*));
+		if(!new_heap)
+		{
+			printf("ERROR: out of memory for the incremental routing search\n");
+			exit(1);
+		}
+		dstar_heap = new_heap;
+		dstar_heap_alloc = new_alloc;
+	}
+	dstar_heap_set(dstar_heap_len, n);
+	dstar_heap_len++;
+	dstar_heap_up(dstar_heap_len-1);
+}
+
+static void dstar_heap_remove(dstar_node_t* n)
+{
+	int idx = n->heap_idx;
+	n->heap_idx = -1;
+	dstar_heap_len--;
+	if(idx < dstar_heap_len)
+	{
+		dstar_node_t* last = dstar_heap[dstar_heap_len];
+		dstar_heap_set(idx, last);
+		dstar_heap_up(idx);
+		dstar_heap_down(last->heap_idx);
+	}
+}
+
+// Puts the node in the queue with its current key if it's inconsistent, takes it out if not.
+static void dstar_update(dstar_node_t* n)
+{
+	if(n->g != n->rhs)
+	{
+		dstar_key(n, &n->k1, &n->k2);
+		if(n->heap_idx < 0)
+			dstar_heap_push(n);
+		else
+		{
+			dstar_heap_up(n->heap_idx);
+			dstar_heap_down(n->heap_idx);
+		}
+	}
+	else if(n->heap_idx >= 0)
+		dstar_heap_remove(n);
+}
+
+// Cost of the step from (x,y) in the direction k, DSTAR_INF if the robot can't take it.
+static float dstar_cost(int x, int y, int k)
+{
+	int nx = x + step_dx[k], ny = y + step_dy[k];
+	if(!dstar_cell(nx, ny) || check_hit(nx, ny, k*4))
+		return DSTAR_INF;
+	if(x == dstar_start.x && y == dstar_start.y && !(dstar_start_steps & (1<<k)))
+		return DSTAR_INF;
+	return step_len(step_dx[k], step_dy[k]);
+}
+
+// The one step lookahead: the shortest distance to the goal through a neighbor. Sets *best_k to the step if given.
+static float dstar_lookahead(int x, int y, int* best_k)
+{
+	float best = DSTAR_INF;
+	for(int k = 0; k < 8; k++)
+	{
+		dstar_node_t* n = dstar_find(x + step_dx[k], y + step_dy[k]);
+		// Only the steps which could make it shorter are checked for collisions.
+		if(!n || n->g + step_len(step_dx[k], step_dy[k]) >= best)
+			continue;
+		float c = dstar_cost(x, y, k);
+		if(c + n->g < best)
+		{
+			best = c + n->g;
+			if(best_k)
+				*best_k = k;
+		}
+	}
+	return best;
+}
+
+// rhs of the unit recomputed, after the costs of its steps (or g of its neighbors) changed
+static void dstar_recompute(dstar_node_t* n)
+{
+	if(n->loc.x == dstar_goal.x && n->loc.y == dstar_goal.y)
+		return;
+	n->rhs = dstar_lookahead(n->loc.x, n->loc.y, NULL);
+	dstar_update(n);
+}
+
+// Marks the c-space tiles depending on the routing tiles dirty, for the next search.
+static void dstar_routing_changed(world_t* w, int pagex, int pagey, uint64_t tiles)
+{
+	if(!dstar_valid || w != dstar_world)
+		return;
+
+	uint64_t around[3][3];
+	tiles_around(tiles, 1, around);
+
+	int tiles_w = dstar_w/MAP_TILE_W, tiles_h = dstar_h/MAP_TILE_W;
+	for(int dx = -1; dx <= 1; dx++)
+	{
+		for(int dy = -1; dy <= 1; dy++)
+		{
+			uint64_t t = around[dx+1][dy+1];
+			while(t)
+			{
+				int tile = __builtin_ctzll(t);
+				t &= t-1;
+				int tx = (pagex+dx)*MAP_TILES_PER_ROW + tile/MAP_TILES_PER_ROW - dstar_x0/MAP_TILE_W;
+				int ty = (pagey+dy)*MAP_TILES_PER_ROW + tile%MAP_TILES_PER_ROW - dstar_y0/MAP_TILE_W;
+				if((unsigned)tx < (unsigned)tiles_w && (unsigned)ty < (unsigned)tiles_h)
+				{
+					dstar_dirty[tx*tiles_h + ty] = 1;
+					dstar_any_dirty = 1;
+				}
+			}
+		}
+	}
+}
+
+// Recomputes rhs of the units in and next to the dirty tiles: their steps into the tiles may cost differently now.
+static void dstar_apply_changes()
+{
+	if(!dstar_any_dirty)
+		return;
+
+	int tiles_w = dstar_w/MAP_TILE_W, tiles_h = dstar_h/MAP_TILE_W;
+	for(int tx = 0; tx < tiles_w; tx++)
+	{
+		for(int ty = 0; ty < tiles_h; ty++)
+		{
+			if(!dstar_dirty[tx*tiles_h + ty])
+				continue;
+			dstar_dirty[tx*tiles_h + ty] = 0;
+
+			int x0 = dstar_x0 + tx*MAP_TILE_W, y0 = dstar_y0 + ty*MAP_TILE_W;
+			for(int x = x0-1; x <= x0+MAP_TILE_W; x++)
+			{
+				for(int y = y0-1; y <= y0+MAP_TILE_W; y++)
+				{
+					dstar_node_t* n = dstar_find(x, y);
+					if(n)
+					{
+						dstar_recompute(n);
+						dstar_stats.units_updated++;
+					}
+				}
+			}
+		}
+	}
+	dstar_any_dirty = 0;
+}
+
+// Starts a fresh search from (s_x,s_y) to (e_x,e_y) in the current search mode.
+static int dstar_init(int s_x, int s_y, int e_x, int e_y)
+{
+	dstar_valid = 0;
+
+	int min_x = (s_x < e_x) ? s_x : e_x, max_x = (s_x > e_x) ? s_x : e_x;
+	int min_y = (s_y < e_y) ? s_y : e_y, max_y = (s_y > e_y) ? s_y : e_y;
+	min_x -= DSTAR_MARGIN; min_y -= DSTAR_MARGIN;
+	if(min_x < 0) min_x = 0;
+	if(min_y < 0) min_y = 0;
+	dstar_x0 = min_x - min_x%MAP_TILE_W;
+	dstar_y0 = min_y - min_y%MAP_TILE_W;
+	dstar_w = (max_x + DSTAR_MARGIN - dstar_x0)/MAP_TILE_W*MAP_TILE_W + MAP_TILE_W;
+	dstar_h = (max_y + DSTAR_MARGIN - dstar_y0)/MAP_TILE_W*MAP_TILE_W + MAP_TILE_W;
+
+	if(dstar_w*dstar_h > dstar_cells_alloc)
+	{
+		free(dstar_cells);
+		dstar_cells_alloc = dstar_w*dstar_h;
+		dstar_cells = calloc(dstar_cells_alloc, sizeof(uint32_t));
+		if(!dstar_cells)
+		{
+			printf("ERROR: out of memory for the incremental routing search area\n");
+			dstar_cells_alloc = 0;
+			return 1;
+		}
+	}
+
+	int n_tiles = (dstar_w/MAP_TILE_W)*(dstar_h/MAP_TILE_W);
+	if(n_tiles > dstar_dirty_alloc)
+	{
+		free(dstar_dirty);
+		dstar_dirty_alloc = n_tiles;
+		dstar_dirty = malloc(dstar_dirty_alloc);
+		if(!dstar_dirty)
+		{
+			printf("ERROR: out of memory for the incremental routing search area\n");
+			dstar_dirty_alloc = 0;
+			return 1;
+		}
+	}
+	memset(dstar_dirty, 0, n_tiles);
+	dstar_any_dirty = 0;
+
+	n_dstar_nodes = 0;
+	dstar_full = 0;
+	dstar_heap_len = 0;
+	dstar_km = 0.0;
+	dstar_goal.x = e_x; dstar_goal.y = e_y;
+	dstar_start.x = dstar_last.x = s_x;
+	dstar_start.y = dstar_last.y = s_y;
+
+	dstar_node_t* goal = dstar_get(e_x, e_y);
+	if(!goal)
+		return 1;
+	goal->rhs = 0.0;
+	dstar_update(goal);
+
+	dstar_world = routing_world;
+	dstar_mode = tight_shapes;
+	dstar_shapes_gen = cspace_shapes_gen[tight_shapes+1];
+	dstar_valid = 1;
+	dstar_stats.searches++;
+	return 0;
+}
+
+// Expands the queue until the start is consistent. Returns 3 if it takes more than SEARCH_MAX_ITERATIONS, or the
+// nodes run out.
+static int dstar_compute(dstar_node_t* start)
+{
+	int cnt = 0;
+	while(dstar_heap_len > 0)
+	{
+		dstar_node_t* u = dstar_heap[0];
+		float s1, s2;
+		dstar_key(start, &s1, &s2);
+		if(!dstar_key_less(u->k1, u->k2, s1, s2) && start->rhs <= start->g)
+			break;
+
+		if(++cnt > SEARCH_MAX_ITERATIONS || dstar_full)
+		{
+			printf("Giving up at cnt = %d\n", cnt);
+			return 3;
+		}
+		search_stats.expansions++;
+
+		float k1, k2;
+		dstar_key(u, &k1, &k2);
+		if(dstar_key_less(u->k1, u->k2, k1, k2))
+		{
+			// Queued before the robot moved
+			u->k1 = k1; u->k2 = k2;
+			dstar_heap_down(0);
+		}
+		else if(u->g > u->rhs)
+		{
+			u->g = u->rhs;
+			dstar_heap_remove(u);
+			for(int k = 0; k < 8; k++)
+			{
+				// The units stepping to u in the direction k
+				float len = step_len(step_dx[k], step_dy[k]);
+				dstar_node_t* p = dstar_get(u->loc.x - step_dx[k], u->loc.y - step_dy[k]);
+				if(!p || u->g + len >= p->rhs)
+					continue;
+				float c = dstar_cost(p->loc.x, p->loc.y, k);
+				if(c + u->g < p->rhs)
+				{
+					p->rhs = c + u->g;
+					dstar_update(p);
+				}
+			}
+		}
+		else
+		{
+			// Got longer: the units which went through u look again.
+			float g_old = u->g;
+			u->g = DSTAR_INF;
+			for(int k = 0; k < 8; k++)
+			{
+				float len = step_len(step_dx[k], step_dy[k]);
+				dstar_node_t* p = dstar_find(u->loc.x - step_dx[k], u->loc.y - step_dy[k]);
+				if(p && fabs(p->rhs - (g_old + len)) < 0.001)
+					dstar_recompute(p);
+			}
+			dstar_recompute(u);
+			dstar_update(u); // the goal isn't recomputed
+		}
+	}
+	return 0;
+}
+
+/*
+	Searches from (s_x,s_y) with the kept state, applying the map changes since the last search. Returns 0 with the
+	route, 2 if there is none, 3 if the search was given up (the state is dropped).
+*/
+static int dstar_search(route_unit_t **route, float start_ang, int s_x, int s_y)
+{
+	clear_route(route);
+
+	while(start_ang >= 2.0*M_PI) start_ang -= 2.0*M_PI;
+	while(start_ang < 0.0) start_ang += 2.0*M_PI;
+
+	dstar_start_steps = 0;
+	for(int k = 0; k < 8; k++)
+	{
+		if(test_robot_turn(s_x, s_y, start_ang, ((float)(k*4)/32.0)*2.0*M_PI))
+			dstar_start_steps |= 1<<k;
+	}
+
+	route_xy_t old_start = dstar_start;
+	dstar_km += octile(s_x-dstar_last.x, s_y-dstar_last.y);
+	dstar_last.x = dstar_start.x = s_x;
+	dstar_last.y = dstar_start.y = s_y;
+	search_stats.searches++;
+
+	// The old start can take any step now, the new one only those the robot can turn to.
+	dstar_node_t* n = dstar_find(old_start.x, old_start.y);
+	if(n)
+		dstar_recompute(n);
+	dstar_apply_changes();
+	dstar_node_t* start = dstar_get(s_x, s_y);
+	if(!start)
+	{
+		dstar_valid = 0;
+		return 3;
+	}
+	dstar_recompute(start);
+
+	if(dstar_compute(start))
+	{
+		dstar_valid = 0;
+		return 3;
+	}
+
+	if(start->rhs >= DSTAR_INF)
+		return 2;
+
+	search_stats.cost = start->rhs;
+
+	int x = s_x, y = s_y;
+	for(int i = 0; ; i++)
+	{
+		route_unit_t* point = malloc(sizeof(route_unit_t));
+		point->loc.x = x; point->loc.y = y;
+		point->backmode = 0;
+		DL_APPEND(*route, point);
+
+		if(x == dstar_goal.x && y == dstar_goal.y)
+			break;
+
+		int k = -1;
+		if(i > SEARCH_MAX_NODES || dstar_lookahead(x, y, &k) >= DSTAR_INF)
+		{
+			printf("ERROR: no way down the incremental routing search from (%d,%d)\n", x, y);
+			clear_route(route);
+			dstar_valid = 0;
+			return 3;
+		}
+		x += step_dx[k];
+		y += step_dy[k];
+	}
+
+	smooth_route(route);
+
+	// Remove the first, because it's the starting point.
+	route_unit_t *tm = *route;
+	DL_DELETE(*route, tm);
+	free(tm);
+
+	return 0;
+}
+
+static void search_mode(int mode)
+{
+	if(mode < 0)
+		wide_search_mode();
+	else if(mode == 0)
+		normal_search_mode();
+	else if(mode == 1)
+		tight_search_mode();
+	else
+		extra_tight_search_mode();
+}
+
+/*
+	The route with the state kept from the last search to the goal, if there is one, or searched fresh. Returns 0
+	with the route, nonzero if there is none this way (search_route() goes on with search2()).
+*/
+static int dstar_route(route_unit_t **route, float start_ang, int start_x_mm, int start_y_mm, int end_x_mm, int end_y_mm, int no_tight)
+{
+	int s_x, s_y, e_x, e_y;
+	unit_coords(start_x_mm, start_y_mm, &s_x, &s_y);
+	unit_coords(end_x_mm, end_y_mm, &e_x, &e_y);
+	if(s_x == e_x && s_y == e_y)
+		return 1;
+
+	if(dstar_valid && dstar_world == routing_world && dstar_goal.x == e_x && dstar_goal.y == e_y && dstar_cell(s_x, s_y))
+	{
+		search_mode(dstar_mode);
+		if(dstar_shapes_gen == cspace_shapes_gen[tight_shapes+1])
+		{
+			int expansions = search_stats.expansions;
+			if(!dstar_search(route, start_ang, s_x, s_y))
+			{
+				dstar_stats.repairs++;
+				printf("Repaired the route, %d units expanded\n", search_stats.expansions - expansions);
+				return 0;
+			}
+		}
+	}
+
+	for(int mode = -1; mode <= (no_tight ? 0 : 1); mode++)
+	{
+		search_mode(mode);
+		if(dstar_init(s_x, s_y, e_x, e_y))
+			return 1;
+
+		int ret = dstar_search(route, start_ang, s_x, s_y);
+		if(ret == 0)
+		{
+			printf("Found route with %s limits\n", (mode < 0) ? "WIDE" : (mode == 0) ? "normal" : "TIGHT");
+			return 0;
+		}
+		if(ret == 3)
+			break;
+	}
+	dstar_valid = 0;
+	return 1;
+}
+
+/*
+	Hierarchical routing
+
+	search() plans at full resolution, within SEARCH_AREA_PAGES around the start and SEARCH_MAX_ITERATIONS; a route
+	across a building needs more than either allows. Far goals are routed on an abstract graph first (HPA*), and only
+	the beginning of the route is searched at full resolution.
+
+	The clusters of the graph are the MAP_TILE_W*MAP_TILE_W tiles of the pages. Each run of units along the border of
+	two clusters where the robot can cross it both ways (judging by the c-space of the search mode, heading across the
+	border) is an entrance, with a node on both sides in the middle of the run. Within a cluster, the costs between
+	its nodes come from Dijkstra searches over its units, 8-connected: a step in the direction k is allowed if the
+	robot in the heading k*4 doesn't hit anything at the unit it steps to. A cluster is built when the abstract search
+	first reaches it, and kept in the page's hpa_page_t, separately for the normal and the tight search mode.
+
+	A cluster depends on the c-space of its tile and the border units of the four tiles around it, which depend on the
+	routing tiles around them: gen_routing_page() marks the clusters within two tiles of the routing tiles it changed
+	invalid (hpa_routing_changed()). Unloading a page doesn't, so the clusters of the pages the robot has been on stay
+	usable for planning routes through them; they are rebuilt only once the page is there again.
+
+	hierarchical_route() runs A* on the graph, with the start and the goal connected to the nodes of their clusters.
+	The path is unrolled into the units of the clusters (straight to the next node where the page isn't loaded) and
+	smoothed like search() does. The part within HPA_REFINE_DIST of the start is then replaced with a search2() to the
+	last node there, in the usual wide, normal, tight order.
+*/
+
+#ifndef HPA_MIN_DIST
+#define HPA_MIN_DIST (2*MAP_PAGE_W) // goals farther than this (in units, in x or y) are routed on the cluster graph
+#endif
+
+#define HPA_REFINE_DIST 128 // units from the start searched at full resolution
+#define HPA_MAX_ITERATIONS 100000
+#define HPA_MODES 2 // normal and tight search mode
+#define HPA_MAX_CLUSTER_NODES (4*MAP_TILE_W/2) // runs with a gap between them, on four sides
+#define HPA_NO_PATH -1.0
+
+#if HPA_REFINE_DIST < MAP_TILE_W
+#error HPA_REFINE_DIST must reach the nodes of the start cluster
+#endif
+
+// Sides of a cluster, by the direction of crossing them
+#define HPA_EAST  0
+#define HPA_NORTH 1
+#define HPA_WEST  2
+#define HPA_SOUTH 3
+
+typedef struct hpa_cluster_t hpa_cluster_t;
+typedef struct hpa_node_t hpa_node_t;
+
+struct hpa_node_t
+{
+	int32_t x, y;       // unit
+	int16_t idx;        // in the cluster
+	int16_t side;
+	hpa_cluster_t* cl;  // NULL for the start and the goal
+
+	// Abstract search state, valid if search == hpa_search_id
+	uint32_t search;
+	int32_t heap_idx;   // -1 when closed, -2 when not in the open set yet
+	float g;
+	float f;
+	hpa_node_t* parent;
+};
+
+struct hpa_cluster_t
+{
+	int n;
+	hpa_node_t* nodes;
+	float* cost; // n*n: cost[i*n+j] from node i to node j within the cluster, HPA_NO_PATH if there's no way
+};
+
+struct hpa_page_t
+{
+	uint64_t valid[HPA_MODES];      // clusters built and up to date
+	uint32_t shapes_gen[HPA_MODES]; // cspace_shapes_gen of the mode when they were built
+	hpa_cluster_t cl[HPA_MODES][MAP_TILES_PER_PAGE];
+};
+
+// One cluster at unit resolution, for the Dijkstra searches
+typedef struct
+{
+	int x0, y0;
+	uint32_t hit[8][MAP_TILE_W];   // c-space bits for the heading k*4, a word per unit column
+	uint32_t pass[4];              // border units the robot can cross both ways, per side, first unit in the MSb
+	float dist[MAP_TILE_W][MAP_TILE_W];
+	int8_t from[MAP_TILE_W][MAP_TILE_W]; // direction of the step the unit was reached with
+} hpa_cluster_map_t;
+
+typedef struct
+{
+	float d;
+	uint16_t u;
+} hpa_dijkstra_item_t;
+
+int hpa_min_dist = HPA_MIN_DIST;
+hpa_stats_t hpa_stats;
+
+static hpa_cluster_map_t hpa_map;
+static hpa_dijkstra_item_t hpa_dijkstra_heap[8*MAP_TILE_W*MAP_TILE_W+1];
+
+static uint32_t hpa_search_id;
+static hpa_node_t** hpa_heap;
+static int hpa_heap_len, hpa_heap_alloc;
+static hpa_node_t hpa_start, hpa_goal;
+static hpa_cluster_t *hpa_start_cl, *hpa_goal_cl;
+static float hpa_start_cost[HPA_MAX_CLUSTER_NODES], hpa_goal_cost[HPA_MAX_CLUSTER_NODES];
+static hpa_node_t** hpa_path;
+static int hpa_path_len, hpa_path_alloc;
+static route_xy_t* hpa_units;
+static int hpa_units_len, hpa_units_alloc;
+
+static void hpa_load_cluster_map(hpa_cluster_map_t* m, int x0, int y0)
+{
+	m->x0 = x0;
+	m->y0 = y0;
+	for(int k = 0; k < 8; k++)
+	{
+		for(int xx = 0; xx < MAP_TILE_W; xx++)
+			m->hit[k][xx] = cspace_word(x0+xx, y0, k*4);
+	}
+
+	// Crossing east, the robot heads east (0) on the neighbor's unit, and back west (16) on ours.
+	m->pass[HPA_EAST] = ~(m->hit[4][MAP_TILE_W-1] | cspace_word(x0+MAP_TILE_W, y0, 0));
+	m->pass[HPA_WEST] = ~(m->hit[0][0] | cspace_word(x0-1, y0, 16));
+
+	uint32_t north = 0, south = 0;
+	for(int xx = 0; xx < MAP_TILE_W; xx++)
+	{
+		north = (north<<1) | (m->hit[6][xx] & 1) | (cspace_word(x0+xx, y0+MAP_TILE_W, 8) >> 31);
+		south = (south<<1) | (m->hit[2][xx] >> 31) | (cspace_word(x0+xx, y0-MAP_TILE_W, 24) & 1);
+	}
+	m->pass[HPA_NORTH] = ~north;
+	m->pass[HPA_SOUTH] = ~south;
+}
+
+// Unit of the cluster on the side at the position along it
+static void hpa_side_unit(int side, int pos, int* xx, int* yy)
+{
+	switch(side)
+	{
+		case HPA_EAST:  *xx = MAP_TILE_W-1; *yy = pos; break;
+		case HPA_WEST:  *xx = 0;            *yy = pos; break;
+		case HPA_NORTH: *xx = pos;          *yy = MAP_TILE_W-1; break;
+		default:        *xx = pos;          *yy = 0; break;
+	}
+}
+
+// Distances from the unit (cluster coordinates) to the units of the cluster in m->dist, or with reverse, from the
+// units to it. HPA_NO_PATH where there's no way.
+static void hpa_dijkstra(hpa_cluster_map_t* m, int sx, int sy, int reverse)
+{
+	for(int xx = 0; xx < MAP_TILE_W; xx++)
+	{
+		for(int yy = 0; yy < MAP_TILE_W; yy++)
+		{
+			m->dist[xx][yy] = HPA_NO_PATH;
+			m->from[xx][yy] = -1;
+		}
+	}
+
+	hpa_dijkstra_item_t* heap = hpa_dijkstra_heap;
+	int len = 0;
+	m->dist[sx][sy] = 0.0;
+	heap[len++] = (hpa_dijkstra_item_t){0.0, sx*MAP_TILE_W + sy};
+
+	while(len > 0)
+	{
+		hpa_dijkstra_item_t cur = heap[0];
+		hpa_dijkstra_item_t last = heap[--len];
+		int i = 0;
+		while(2*i+1 < len)
+		{
+			int c = 2*i+1;
+			if(c+1 < len && heap[c+1].d < heap[c].d)
+				c++;
+			if(last.d <= heap[c].d)
+				break;
+			heap[i] = heap[c];
+			i = c;
+		}
+		heap[i] = last;
+
+		int x = cur.u / MAP_TILE_W, y = cur.u % MAP_TILE_W;
+		if(cur.d > m->dist[x][y])
+			continue; // already reached with less
+
+		for(int k = 0; k < 8; k++)
+		{
+			int nx = reverse ? (x-step_dx[k]) : (x+step_dx[k]);
+			int ny = reverse ? (y-step_dy[k]) : (y+step_dy[k]);
+			if((unsigned)nx >= MAP_TILE_W || (unsigned)ny >= MAP_TILE_W)
+				continue;
+
+			// The unit stepped to
+			int hx = reverse ? x : nx, hy = reverse ? y : ny;
+			if((m->hit[k][hx] >> (31-hy)) & 1)
+				continue;
+
+			float d = cur.d + ((k&1) ? 1.41421356 : 1.0);
+			if(m->dist[nx][ny] >= 0.0 && m->dist[nx][ny] <= d)
+				continue;
+			m->dist[nx][ny] = d;
+			m->from[nx][ny] = k;
+
+			i = len++;
+			while(i > 0 && heap[(i-1)/2].d > d)
+			{
+				heap[i] = heap[(i-1)/2];
+				i = (i-1)/2;
+			}
+			heap[i] = (hpa_dijkstra_item_t){d, nx*MAP_TILE_W + ny};
+		}
+	}
+}
+
+static int hpa_build_cluster(hpa_cluster_t* cl, int x0, int y0)
+{
+	hpa_cluster_map_t* m = &hpa_map;
+	hpa_load_cluster_map(m, x0, y0);
+
+	free(cl->nodes);
+	free(cl->cost);
+	cl->nodes = NULL;
+	cl->cost = NULL;
+	cl->n = 0;
+
+	hpa_node_t nodes[HPA_MAX_CLUSTER_NODES];
+	int n = 0;
+	for(int side = 0; side < 4; side++)
+	{
+		uint32_t p = m->pass[side];
+		while(p)
+		{
+			int a = __builtin_clz(p);
+			uint32_t rest = ~(p << a);
+			int len = rest ? __builtin_clz(rest) : 32;
+			if(a+len < 32)
+				p &= (1U << (32-a-len)) - 1;
+			else
+				p = 0;
+
+			int xx, yy;
+			hpa_side_unit(side, a + (len-1)/2, &xx, &yy);
+			memset(&nodes[n], 0, sizeof(hpa_node_t));
+			nodes[n].x = x0 + xx;
+			nodes[n].y = y0 + yy;
+			nodes[n].idx = n;
+			nodes[n].side = side;
+			nodes[n].cl = cl;
+			n++;
+		}
+	}
+
+	if(n > 0)
+	{
+		cl->nodes = malloc(n*sizeof(hpa_node_t));
+		cl->cost = malloc(n*n*sizeof(float));
+		if(!cl->nodes || !cl->cost)
+		{
+			printf("ERROR: out of memory for the cluster graph\n");
+			free(cl->nodes);
+			free(cl->cost);
+			cl->nodes = NULL;
+			cl->cost = NULL;
+			return 1;
+		}
+		memcpy(cl->nodes, nodes, n*sizeof(hpa_node_t));
+
+		for(int i = 0; i < n; i++)
+		{
+			hpa_dijkstra(m, nodes[i].x-x0, nodes[i].y-y0, 0);
+			for(int j = 0; j < n; j++)
+				cl->cost[i*n+j] = m->dist[nodes[j].x-x0][nodes[j].y-y0];
+		}
+	}
+	cl->n = n;
+	hpa_stats.clusters_built++;
+	return 0;
+}
+
+// The cluster of the unit in the current search mode, built if needed. NULL if it can't be: the page has no routing
+// page now, nor a cluster graph from when it had.
+static hpa_cluster_t* hpa_cluster(int x, int y)
+{
+	if(x < 0 || y < 0 || x >= MAP_W*MAP_PAGE_W || y >= MAP_W*MAP_PAGE_W)
+		return NULL;
+
+	int px, py, ox, oy;
+	page_coords_from_unit_coords(x, y, &px, &py, &ox, &oy);
+	world_page_t* wp = find_world_page(routing_world, px, py);
+	if(!wp)
+		return NULL;
+
+	int mode = tight_shapes;
+	int tile = map_tile_idx(ox, oy);
+	hpa_page_t* hp = wp->hpa;
+	if(hp && hp->shapes_gen[mode] != cspace_shapes_gen[mode+1])
+	{
+		hp->valid[mode] = 0;
+		hp->shapes_gen[mode] = cspace_shapes_gen[mode+1];
+	}
+	if(hp && (hp->valid[mode] & (1ULL << tile)))
+		return &hp->cl[mode][tile];
+
+	if(!wp->rpage)
+		return NULL;
+
+	if(!hp)
+	{
+		if(!(hp = wp->hpa = calloc(1, sizeof(hpa_page_t))))
+		{
+			printf("ERROR: out of memory for the cluster graph\n");
+			return NULL;
+		}
+		hp->shapes_gen[mode] = cspace_shapes_gen[mode+1];
+	}
+
+	hpa_cluster_t* cl = &hp->cl[mode][tile];
+	if(hpa_build_cluster(cl, x - ox%MAP_TILE_W, y - oy%MAP_TILE_W))
+		return NULL;
+	hp->valid[mode] |= 1ULL << tile;
+	return cl;
+}
+
+// Marks the clusters depending on the routing tiles invalid, on the page and its neighbors.
+static void hpa_routing_changed(world_t* w, int pagex, int pagey, uint64_t tiles)
+{
+	uint64_t inval[3][3];
+	tiles_around(tiles, 2, inval);
+	for(int dx = -1; dx <= 1; dx++)
+	{
+		for(int dy = -1; dy <= 1; dy++)
+		{
+			world_page_t* wp = find_world_page(w, pagex+dx, pagey+dy);
+			if(!wp || !wp->hpa)
+				continue;
+
+			for(int m = 0; m < HPA_MODES; m++)
+				wp->hpa->valid[m] &= ~inval[dx+1][dy+1];
+		}
+	}
+}
+
+// Costs between the unit and the nodes of its cluster, from it or with reverse, to it. Straight line distances if
+// the page isn't loaded.
+static void hpa_connect(hpa_cluster_t* cl, int x, int y, int reverse, float* cost)
+{
+	int px, py, ox, oy;
+	page_coords_from_unit_coords(x, y, &px, &py, &ox, &oy);
+	if(!routing_page(routing_world, px, py))
+	{
+		for(int i = 0; i < cl->n; i++)
+			cost[i] = sqrt((float)(sq(cl->nodes[i].x-x) + sq(cl->nodes[i].y-y)));
+		return;
+	}
+
+	hpa_cluster_map_t* m = &hpa_map;
+	hpa_load_cluster_map(m, x - ox%MAP_TILE_W, y - oy%MAP_TILE_W);
+	hpa_dijkstra(m, x - m->x0, y - m->y0, reverse);
+	for(int i = 0; i < cl->n; i++)
+		cost[i] = m->dist[cl->nodes[i].x - m->x0][cl->nodes[i].y - m->y0];
+}
+
+static inline void hpa_heap_set(int idx, hpa_node_t* p)
+{
+	hpa_heap[idx] = p;
+	p->heap_idx = idx;
+}
+
+static void hpa_heap_up(int idx)
+{
+	hpa_node_t* p = hpa_heap[idx];
+	while(idx > 0 && p->f < hpa_heap[(idx-1)/2]->f)
+	{
+		hpa_heap_set(idx, hpa_heap[(idx-1)/2]);
+		idx = (idx-1)/2;
+	}
+	hpa_heap_set(idx, p);
+}
+
+static void hpa_heap_push(hpa_node_t* p)
+{
+	if(hpa_heap_len >= hpa_heap_alloc)
+	{
+		int new_alloc = hpa_heap_alloc?(2*hpa_heap_alloc):1024;
+		hpa_node_t** new_heap = realloc(hpa_heap, new_alloc*sizeof(hpa_node_t*));
+		if(!new_heap)
+		{
+			printf("ERROR: out of memory for the cluster graph search\n");
+			exit(1);
+		}
+		hpa_heap = new_heap;
+		hpa_heap_alloc = new_alloc;
+	}
+	hpa_heap_set(hpa_heap_len, p);
+	hpa_heap_len++;
+	hpa_heap_up(hpa_heap_len-1);
+}
+
+static hpa_node_t* hpa_heap_pop()
+{
+	hpa_node_t* top = hpa_heap[0];
+	top->heap_idx = -1;
+	hpa_node_t* p = hpa_heap[--hpa_heap_len];
+	if(hpa_heap_len > 0)
+	{
+		int idx = 0;
+		while(1)
+		{
+			int child = 2*idx+1;
+			if(child >= hpa_heap_len)
+				break;
+			if(child+1 < hpa_heap_len && hpa_heap[child+1]->f < hpa_heap[child]->f)
+				child++;
+			if(!(hpa_heap[child]->f < p->f))
+				break;
+			hpa_heap_set(idx, hpa_heap[child]);
+			idx = child;
+		}
+		hpa_heap_set(idx, p);
+	}
+	return top;
+}
+
+static void hpa_relax(hpa_node_t* from, hpa_node_t* to, float cost)
+{
+	if(to->search != hpa_search_id)
+	{
+		to->search = hpa_search_id;
+		to->heap_idx = -2;
+		to->g = MAX_F;
+	}
+	if(to->heap_idx == -1)
+		return; // closed
+
+	float g = from->g + cost;
+	if(g >= to->g)
+		return;
+
+	to->g = g;
+	to->f = g + sqrt((float)(sq(hpa_goal.x-to->x) + sq(hpa_goal.y-to->y)));
+	to->parent = from;
+	if(to->heap_idx == -2)
+		hpa_heap_push(to);
+	else
+		hpa_heap_up(to->heap_idx);
+}
+
+/*
+	A* on the cluster graph. Returns 0 with the nodes from the start to the goal in hpa_path, 1 if the start connects
+	to no node, 3 if there's no path.
+*/
+static int hpa_search(int s_x, int s_y, int e_x, int e_y)
+{
+	hpa_search_id++;
+	hpa_heap_len = 0;
+
+	hpa_start_cl = hpa_cluster(s_x, s_y);
+	hpa_goal_cl = hpa_cluster(e_x, e_y);
+	if(!hpa_start_cl)
+		return 1;
+	if(!hpa_goal_cl)
+		return 3;
+
+	hpa_connect(hpa_start_cl, s_x, s_y, 0, hpa_start_cost);
+	hpa_connect(hpa_goal_cl, e_x, e_y, 1, hpa_goal_cost);
+
+	int connected = 0;
+	for(int i = 0; i < hpa_start_cl->n; i++)
+	{
+		if(hpa_start_cost[i] >= 0.0)
+			connected = 1;
+	}
+	if(!connected)
+		return 1;
+
+	memset(&hpa_goal, 0, sizeof(hpa_goal));
+	hpa_goal.x = e_x;
+	hpa_goal.y = e_y;
+
+	memset(&hpa_start, 0, sizeof(hpa_start));
+	hpa_start.x = s_x;
+	hpa_start.y = s_y;
+	hpa_start.search = hpa_search_id;
+	hpa_start.f = sqrt((float)(sq(e_x-s_x) + sq(e_y-s_y)));
+	hpa_heap_push(&hpa_start);
+
+	int cnt = 0;
+	while(hpa_heap_len > 0)
+	{
+		if(++cnt > HPA_MAX_ITERATIONS)
+		{
+			printf("Giving up the cluster graph search at cnt = %d\n", cnt);
+			return 3;
+		}
+
+		hpa_node_t* p_cur = hpa_heap_pop();
+		hpa_stats.nodes_expanded++;
+
+		if(p_cur == &hpa_goal)
+		{
+			hpa_path_len = 0;
+			for(hpa_node_t* p = p_cur; p; p = p->parent)
+				hpa_path_len++;
+			if(hpa_path_len > hpa_path_alloc)
+			{
+				free(hpa_path);
+				hpa_path_alloc = 2*hpa_path_len;
+				if(!(hpa_path = malloc(hpa_path_alloc*sizeof(hpa_node_t*))))
+				{
+					printf("ERROR: out of memory for the cluster graph search\n");
+					hpa_path_alloc = 0;
+					return 3;
+				}
+			}
+			int i = hpa_path_len;
+			for(hpa_node_t* p = p_cur; p; p = p->parent)
+				hpa_path[--i] = p;
+			return 0;
+		}
+
+		if(p_cur == &hpa_start)
+		{
+			for(int i = 0; i < hpa_start_cl->n; i++)
+			{
+				if(hpa_start_cost[i] >= 0.0)
+					hpa_relax(p_cur, &hpa_start_cl->nodes[i], hpa_start_cost[i]);
+			}
+			continue;
+		}
+
+		hpa_cluster_t* cl = p_cur->cl;
+		for(int j = 0; j < cl->n; j++)
+		{
+			float cost = cl->cost[p_cur->idx*cl->n + j];
+			if(j != p_cur->idx && cost >= 0.0)
+				hpa_relax(p_cur, &cl->nodes[j], cost);
+		}
+
+		if(cl == hpa_goal_cl && hpa_goal_cost[p_cur->idx] >= 0.0)
+			hpa_relax(p_cur, &hpa_goal, hpa_goal_cost[p_cur->idx]);
+
+		// Across the border, to the node on the other side of the entrance
+		int nx = p_cur->x + step_dx[2*p_cur->side], ny = p_cur->y + step_dy[2*p_cur->side];
+		hpa_cluster_t* ncl = hpa_cluster(nx, ny);
+		for(int j = 0; ncl && j < ncl->n; j++)
+		{
+			hpa_node_t* p = &ncl->nodes[j];
+			if(p->x == nx && p->y == ny && p->side == (p_cur->side^2))
+			{
+				hpa_relax(p_cur, p, 1.0);
+				break;
+			}
+		}
 	}
 
 	return 3;
-
 }
 
+static void hpa_add_unit(int x, int y)
+{
+	if(hpa_units_len >= hpa_units_alloc)
+	{
+		int new_alloc = hpa_units_alloc?(2*hpa_units_alloc):1024;
+		route_xy_t* new_units = realloc(hpa_units, new_alloc*sizeof(route_xy_t));
+		if(!new_units)
+		{
+			printf("ERROR: out of memory for the cluster graph search\n");
+			exit(1);
+		}
+		hpa_units = new_units;
+		hpa_units_alloc = new_alloc;
+	}
+	hpa_units[hpa_units_len].x = x;
+	hpa_units[hpa_units_len].y = y;
+	hpa_units_len++;
+}
 
-void gen_routing_page(world_t *w, int xpage, int ypage, int forgiveness)
+// Units from the node to the next one in the same cluster, not including the first, as the Dijkstra search goes.
+static void hpa_unroll_in_cluster(hpa_node_t* a, hpa_node_t* b)
 {
-	if(!w->pages[xpage][ypage])
+	int px, py, ox, oy;
+	page_coords_from_unit_coords(a->x, a->y, &px, &py, &ox, &oy);
+	if(!routing_page(routing_world, px, py))
 	{
+		hpa_add_unit(b->x, b->y);
 		return;
 	}
-	if(!w->rpages[xpage][ypage])
+
+	hpa_cluster_map_t* m = &hpa_map;
+	hpa_load_cluster_map(m, a->x - ox%MAP_TILE_W, a->y - oy%MAP_TILE_W);
+	hpa_dijkstra(m, a->x - m->x0, a->y - m->y0, 0);
+
+	int xx = b->x - m->x0, yy = b->y - m->y0;
+	if(m->dist[xx][yy] < 0.0)
 	{
-		w->rpages[xpage][ypage] = malloc(sizeof(routing_page_t));
+		hpa_add_unit(b->x, b->y);
+		return;
 	}
 
-	forgiveness = ROUTING_3D_FORGIVENESS;
-	if(forgiveness == 0)
+	int first = hpa_units_len;
+	while(m->from[xx][yy] >= 0)
 	{
-		for(int xx=0; xx < MAP_PAGE_W; xx++)
+		hpa_add_unit(m->x0 + xx, m->y0 + yy);
+		int k = m->from[xx][yy];
+		xx -= step_dx[k];
+		yy -= step_dy[k];
+	}
+
+	// Backwards from b: reverse
+	for(int i = first, j = hpa_units_len-1; i < j; i++, j--)
+	{
+		route_xy_t tmp = hpa_units[i];
+		hpa_units[i] = hpa_units[j];
+		hpa_units[j] = tmp;
+	}
+}
+
+// The path from hpa_path[first] to the goal as a route: the units of the path where it turns, smoothed.
+static route_unit_t* hpa_unroll(int first)
+{
+	hpa_units_len = 0;
+	hpa_add_unit(hpa_path[first]->x, hpa_path[first]->y);
+	for(int i = first; i < hpa_path_len-1; i++)
+	{
+		hpa_node_t* a = hpa_path[i];
+		hpa_node_t* b = hpa_path[i+1];
+		if(a->cl && (a->cl == b->cl || (b == &hpa_goal && a->cl == hpa_goal_cl)))
+			hpa_unroll_in_cluster(a, b);
+		else
+			hpa_add_unit(b->x, b->y);
+	}
+
+	route_unit_t* route = NULL;
+	for(int i = 0; i < hpa_units_len; i++)
+	{
+		if(i > 0 && i < hpa_units_len-1 &&
+		   hpa_units[i].x-hpa_units[i-1].x == hpa_units[i+1].x-hpa_units[i].x &&
+		   hpa_units[i].y-hpa_units[i-1].y == hpa_units[i+1].y-hpa_units[i].y)
+			continue; // straight on
+
+		route_unit_t* point = malloc(sizeof(route_unit_t));
+		point->loc = hpa_units[i];
+		point->backmode = 0;
+		DL_APPEND(route, point);
+	}
+
+	smooth_route(&route);
+	return route;
+}
+
+/*
+	Route to a far goal: see "Hierarchical routing" above. Returns like search2(), and 3 if the goal can't be reached
+	on the cluster graph.
+*/
+static int hierarchical_route(route_unit_t **route, float start_ang, int start_x_mm, int start_y_mm, int end_x_mm, int end_y_mm, int no_tight)
+{
+	clear_route(route);
+
+	int s_x, s_y, e_x, e_y;
+	unit_coords(start_x_mm, start_y_mm, &s_x, &s_y);
+	unit_coords(end_x_mm, end_y_mm, &e_x, &e_y);
+
+	hpa_stats.searches++;
+
+	// The graph is made in the mode the route may need at most.
+	if(no_tight)
+		normal_search_mode();
+	else
+		tight_search_mode();
+
+	int ret = hpa_search(s_x, s_y, e_x, e_y);
+	if(ret)
+		return ret;
+
+	// The last node before the path leaves HPA_REFINE_DIST; the search at full resolution goes there.
+	int last = 1;
+	while(last+1 < hpa_path_len-1 && abs(hpa_path[last+1]->x - s_x) <= HPA_REFINE_DIST && abs(hpa_path[last+1]->y - s_y) <= HPA_REFINE_DIST)
+		last++;
+
+	route_unit_t* rest = hpa_unroll(last);
+
+	int last_x_mm, last_y_mm;
+	mm_from_unit_coords(hpa_path[last]->x, hpa_path[last]->y, &last_x_mm, &last_y_mm);
+
+	const char* limits = "WIDE";
+	wide_search_mode();
+	if( (ret = search2(route, start_ang, start_x_mm, start_y_mm, last_x_mm, last_y_mm)) )
+	{
+		limits = "normal";
+		normal_search_mode();
+		if( (ret = search2(route, start_ang, start_x_mm, start_y_mm, last_x_mm, last_y_mm)) && !no_tight)
 		{
-			for(int yy=0; yy < MAP_PAGE_W/32; yy++)
-			{
-				uint32_t tmp = 0;
-				for(int i = 0; i < 32; i++)
-				{
-					tmp<<=1;
-					uint8_t res  = w->pages[xpage][ypage]->units[xx][yy*32+i].result;
-					uint8_t cons = w->pages[xpage][ypage]->units[xx][yy*32+i].constraints;
+			limits = "TIGHT";
+			tight_search_mode();
+			ret = search2(route, start_ang, start_x_mm, start_y_mm, last_x_mm, last_y_mm);
+		}
+	}
+
+	if(ret)
+	{
+		clear_route(&rest);
+		return ret;
+	}
+
+	printf("Found route on the cluster graph (%d nodes), with %s limits near the robot\n", hpa_path_len, limits);
+	DL_CONCAT(*route, rest);
+	hpa_stats.found++;
+	return 0;
+}
+
+#if MAP_TILE_W != 32
+#error gen_routing_page() assumes one map tile is one routing word wide
+#endif
+
+// True if nothing in the tile would be an obstacle on the routing page, judging by the page summary.
+static int tile_routing_free(page_summary_t* s, int tile, int forgiveness)
+{
+	if(!s)
+		return 0;
+	if(s->or_constraints[tile] & CONSTRAINT_FORBIDDEN)
+		return 0;
 #ifdef AVOID_3D_THINGS
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (res & UNIT_3D_WALL) || (res & UNIT_ITEM) || (res & UNIT_DROP) || (cons & CONSTRAINT_FORBIDDEN);
+	if(forgiveness == 0)
+		return !(s->or_result[tile] & (UNIT_WALL | UNIT_INVISIBLE_WALL | UNIT_3D_WALL | UNIT_ITEM | UNIT_DROP));
+	return !(s->or_result[tile] & (UNIT_WALL | UNIT_INVISIBLE_WALL)) && s->max_num_3d_obstacles[tile] <= forgiveness;
 #else
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
+	return !(s->or_result[tile] & (UNIT_WALL | UNIT_INVISIBLE_WALL));
 #endif
-				}
-				w->rpages[xpage][ypage]->obst_u32[xx][yy] = tmp;
-			}
-			if(w->pages[xpage][ypage+1])
-			{
-				uint32_t tmp = 0;
-				for(int i = 0; i < 32; i++)
-				{
-					tmp<<=1;
-					uint8_t res  = w->pages[xpage][ypage+1]->units[xx][0*32+i].result;
-					uint8_t cons = w->pages[xpage][ypage+1]->units[xx][0*32+i].constraints;
+}
+
+// Routing bits of the 32 units (xx, yoffs..yoffs+31) of the page, the first unit in the MSb.
+static uint32_t routing_word(map_page_t* page, int xx, int yoffs, int forgiveness)
+{
+	uint32_t tmp = 0;
+	if(forgiveness == 0)
+	{
+		for(int i = 0; i < 32; i++)
+		{
+			tmp<<=1;
+			uint8_t res  = PAGE_UNIT(page, xx, yoffs+i, result);
+			uint8_t cons = PAGE_UNIT(page, xx, yoffs+i, constraints);
 #ifdef AVOID_3D_THINGS
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (res & UNIT_3D_WALL) || (res & UNIT_ITEM) || (res & UNIT_DROP) || (cons & CONSTRAINT_FORBIDDEN);
+			tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (res & UNIT_3D_WALL) || (res & UNIT_ITEM) || (res & UNIT_DROP) || (cons & CONSTRAINT_FORBIDDEN);
 #else
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
-#endif				
-				}
-				w->rpages[xpage][ypage]->obst_u32[xx][MAP_PAGE_W/32] = tmp;
-			}
-			else
-			{
-				w->rpages[xpage][ypage]->obst_u32[xx][MAP_PAGE_W/32] = 0xffffffff;
-			}
+			tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
+#endif
 		}
 	}
 	else
 	{
-		for(int xx=0; xx < MAP_PAGE_W; xx++)
+		for(int i = 0; i < 32; i++)
 		{
-			for(int yy=0; yy < MAP_PAGE_W/32; yy++)
-			{
-				uint32_t tmp = 0;
-				for(int i = 0; i < 32; i++)
-				{
-					tmp<<=1;
-					uint8_t res =  w->pages[xpage][ypage]->units[xx][yy*32+i].result;
-					uint8_t cons = w->pages[xpage][ypage]->units[xx][yy*32+i].constraints;
+			tmp<<=1;
+			uint8_t res  = PAGE_UNIT(page, xx, yoffs+i, result);
+			uint8_t cons = PAGE_UNIT(page, xx, yoffs+i, constraints);
 #ifdef AVOID_3D_THINGS
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (w->pages[xpage][ypage]->units[xx][yy*32+i].num_3d_obstacles > forgiveness) || (cons & CONSTRAINT_FORBIDDEN);
+			tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (PAGE_UNIT(page, xx, yoffs+i, num_3d_obstacles) > forgiveness) || (cons & CONSTRAINT_FORBIDDEN);
 #else
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
+			tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
 #endif
-				}
-				w->rpages[xpage][ypage]->obst_u32[xx][yy] = tmp;
-			}
-			if(w->pages[xpage][ypage+1])
-			{
-				uint32_t tmp = 0;
-				for(int i = 0; i < 32; i++)
-				{
-					tmp<<=1;
-					uint8_t res  = w->pages[xpage][ypage+1]->units[xx][0*32+i].result;
-					uint8_t cons = w->pages[xpage][ypage+1]->units[xx][0*32+i].constraints;
+		}
+	}
+	return tmp;
+}
+
+/*
+	SIMD routing word kernels
+
+	A unit is an obstacle if any of (result & res_mask), (constraints & cons_mask) and the saturating
+	num_3d_obstacles - n3d_thresh is nonzero; with the masks from routing_masks() that's exactly routing_word()
+	above. The kernels evaluate it for a vector of units at a time, pack one "free" bit per unit (unit i in bit i)
+	and reverse the word to the MSb-first order of the routing page.
+
+	MAP_PAGE_PLANAR: a word is 32 consecutive bytes of each plane, one AVX2 or two SSE2/NEON vectors per field.
+	map_unit_t array: a word is 256 bytes, 2 units per SSE2/NEON vector (4 with AVX2). The whole units are masked
+	in place with unit_and/unit_sub, after which a unit is free if all of its 8 bytes are zero. The per-unit
+	results are reduced with _mm_sad_epu8 and signed/unsigned packs on x86, and with saturating narrows on NEON.
+
+	SSE2 is always there on x86-64 and NEON on 64-bit ARM. Build with -mavx2 for AVX2, and with -mfpu=neon on
+	32-bit ARM. -DROUTING_NO_SIMD leaves only the scalar code.
+*/
+
+#if !defined(ROUTING_NO_SIMD) && (defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define ROUTING_SIMD
+#endif
+
+typedef struct
+{
+	uint8_t res_mask;
+	uint8_t cons_mask;
+	uint8_t n3d_thresh; // 255: num_3d_obstacles doesn't matter
+	uint8_t unit_and[4*sizeof(map_unit_t)]; // the above for 4 whole map_unit_t's
+	uint8_t unit_sub[4*sizeof(map_unit_t)];
+} routing_masks_t;
+
+static void routing_masks(routing_masks_t* m, int forgiveness)
+{
+	m->res_mask = UNIT_WALL | UNIT_INVISIBLE_WALL;
+	m->cons_mask = CONSTRAINT_FORBIDDEN;
+	m->n3d_thresh = 255;
 #ifdef AVOID_3D_THINGS
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (w->pages[xpage][ypage+1]->units[xx][0*32+i].num_3d_obstacles > forgiveness) || (cons & CONSTRAINT_FORBIDDEN);
+	if(forgiveness == 0)
+		m->res_mask |= UNIT_3D_WALL | UNIT_ITEM | UNIT_DROP;
+	else
+		m->n3d_thresh = (forgiveness > 255) ? 255 : forgiveness;
+#endif
+
+	memset(m->unit_and, 0, sizeof(m->unit_and));
+	memset(m->unit_sub, 255, sizeof(m->unit_sub));
+	for(int i = 0; i < 4; i++)
+	{
+		m->unit_and[i*sizeof(map_unit_t) + offsetof(map_unit_t, result)] = m->res_mask;
+		m->unit_and[i*sizeof(map_unit_t) + offsetof(map_unit_t, constraints)] = m->cons_mask;
+		m->unit_sub[i*sizeof(map_unit_t) + offsetof(map_unit_t, num_3d_obstacles)] = m->n3d_thresh;
+	}
+}
+
+#ifdef ROUTING_SIMD
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+const char* routing_kernel_name = "avx2";
 #else
-					tmp |= (res & UNIT_FREE) || (res & UNIT_WALL) || (res & UNIT_INVISIBLE_WALL) || (cons & CONSTRAINT_FORBIDDEN);
+const char* routing_kernel_name = "sse2";
 #endif
-				}
-				w->rpages[xpage][ypage]->obst_u32[xx][MAP_PAGE_W/32] = tmp;
+#else
+#include <arm_neon.h>
+const char* routing_kernel_name = "neon";
+
+// _mm_movemask_epi8() for a comparison result: bit i is set if byte i is.
+static inline uint32_t neon_movemask(uint8x16_t v)
+{
+	static const uint8_t weights[16] = {1,2,4,8,16,32,64,128, 1,2,4,8,16,32,64,128};
+	uint8x16_t b = vandq_u8(v, vld1q_u8(weights));
+	uint8x8_t p = vpadd_u8(vget_low_u8(b), vget_high_u8(b));
+	p = vpadd_u8(p, p);
+	p = vpadd_u8(p, p);
+	return vget_lane_u16(vreinterpret_u16_u8(p), 0);
+}
+#endif
+
+static inline uint32_t reverse_bits32(uint32_t v)
+{
+	v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+	v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+	v = ((v >> 4) & 0x0f0f0f0f) | ((v & 0x0f0f0f0f) << 4);
+	v = ((v >> 8) & 0x00ff00ff) | ((v & 0x00ff00ff) << 8);
+	return (v >> 16) | (v << 16);
+}
+
+static uint32_t routing_word_simd(map_page_t* page, int xx, int yoffs, routing_masks_t* m)
+{
+	uint32_t free_bits = 0;
+
+#ifdef MAP_PAGE_PLANAR
+	const uint8_t* res  = &PAGE_UNIT(page, xx, yoffs, result);
+	const uint8_t* cons = &PAGE_UNIT(page, xx, yoffs, constraints);
+	const uint8_t* n3d  = &PAGE_UNIT(page, xx, yoffs, num_3d_obstacles);
+#if defined(__AVX2__)
+	__m256i t = _mm256_or_si256(
+		_mm256_or_si256(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)res), _mm256_set1_epi8(m->res_mask)),
+		                _mm256_and_si256(_mm256_loadu_si256((const __m256i*)cons), _mm256_set1_epi8(m->cons_mask))),
+		_mm256_subs_epu8(_mm256_loadu_si256((const __m256i*)n3d), _mm256_set1_epi8(m->n3d_thresh)));
+	free_bits = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(t, _mm256_setzero_si256()));
+#elif defined(__SSE2__)
+	for(int h = 0; h < 2; h++)
+	{
+		__m128i t = _mm_or_si128(
+			_mm_or_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*)(res+16*h)), _mm_set1_epi8(m->res_mask)),
+			             _mm_and_si128(_mm_loadu_si128((const __m128i*)(cons+16*h)), _mm_set1_epi8(m->cons_mask))),
+			_mm_subs_epu8(_mm_loadu_si128((const __m128i*)(n3d+16*h)), _mm_set1_epi8(m->n3d_thresh)));
+		free_bits |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_setzero_si128())) << (16*h);
+	}
+#else
+	for(int h = 0; h < 2; h++)
+	{
+		uint8x16_t t = vorrq_u8(
+			vorrq_u8(vandq_u8(vld1q_u8(res+16*h), vdupq_n_u8(m->res_mask)),
+			         vandq_u8(vld1q_u8(cons+16*h), vdupq_n_u8(m->cons_mask))),
+			vqsubq_u8(vld1q_u8(n3d+16*h), vdupq_n_u8(m->n3d_thresh)));
+		free_bits |= neon_movemask(vceqq_u8(t, vdupq_n_u8(0))) << (16*h);
+	}
+#endif
+
+#else // map_unit_t array
+	const uint8_t* u = (const uint8_t*)&page->units[xx][yoffs];
+#if defined(__SSE2__)
+#ifdef __AVX2__
+	__m256i and_v = _mm256_loadu_si256((const __m256i*)m->unit_and);
+	__m256i sub_v = _mm256_loadu_si256((const __m256i*)m->unit_sub);
+#else
+	__m128i and_v = _mm_loadu_si128((const __m128i*)m->unit_and);
+	__m128i sub_v = _mm_loadu_si128((const __m128i*)m->unit_sub);
+#endif
+	for(int h = 0; h < 2; h++)
+	{
+		// s[i]: byte sums of units 2i and 2i+1 of this half in the 64-bit lanes, nonzero for obstacles
+		__m128i s[8];
+#ifdef __AVX2__
+		for(int i = 0; i < 4; i++)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i*)(u + (h*16+i*4)*sizeof(map_unit_t)));
+			__m256i t = _mm256_or_si256(_mm256_and_si256(v, and_v), _mm256_subs_epu8(v, sub_v));
+			t = _mm256_sad_epu8(t, _mm256_setzero_si256());
+			s[2*i]   = _mm256_castsi256_si128(t);
+			s[2*i+1] = _mm256_extracti128_si256(t, 1);
+		}
+#else
+		for(int i = 0; i < 8; i++)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(u + (h*16+i*2)*sizeof(map_unit_t)));
+			__m128i t = _mm_or_si128(_mm_and_si128(v, and_v), _mm_subs_epu8(v, sub_v));
+			s[i] = _mm_sad_epu8(t, _mm_setzero_si128());
+		}
+#endif
+		// The sums fit in 16 bits, so the packs keep them nonzero, and in order: 8 units per vector, then 16.
+		__m128i a = _mm_packs_epi32(_mm_packs_epi32(s[0], s[1]), _mm_packs_epi32(s[2], s[3]));
+		__m128i b = _mm_packs_epi32(_mm_packs_epi32(s[4], s[5]), _mm_packs_epi32(s[6], s[7]));
+		free_bits |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_packus_epi16(a, b), _mm_setzero_si128())) << (16*h);
+	}
+#else
+	uint8x16_t and_v = vld1q_u8(m->unit_and);
+	uint8x16_t sub_v = vld1q_u8(m->unit_sub);
+	for(int h = 0; h < 2; h++)
+	{
+		// Saturating narrows keep nonzero units nonzero: 2 units per uint32x2_t, then 4, 8 and 16 per vector.
+		uint32x2_t d[8];
+		for(int i = 0; i < 8; i++)
+		{
+			uint8x16_t v = vld1q_u8(u + (h*16+i*2)*sizeof(map_unit_t));
+			uint8x16_t t = vorrq_u8(vandq_u8(v, and_v), vqsubq_u8(v, sub_v));
+			d[i] = vqmovn_u64(vreinterpretq_u64_u8(t));
+		}
+		uint16x4_t w[4];
+		for(int i = 0; i < 4; i++)
+			w[i] = vqmovn_u32(vcombine_u32(d[2*i], d[2*i+1]));
+		uint8x16_t n = vcombine_u8(vqmovn_u16(vcombine_u16(w[0], w[1])), vqmovn_u16(vcombine_u16(w[2], w[3])));
+		free_bits |= neon_movemask(vceqq_u8(n, vdupq_n_u8(0))) << (16*h);
+	}
+#endif
+#endif
+
+	return ~reverse_bits32(free_bits);
+}
+
+#else
+const char* routing_kernel_name = "scalar";
+#endif
+
+int routing_scalar_kernel;
+
+static uint32_t routing_word_kernel(map_page_t* page, int xx, int yoffs, int forgiveness, routing_masks_t* m)
+{
+#ifdef ROUTING_SIMD
+	if(!routing_scalar_kernel)
+		return routing_word_simd(page, xx, yoffs, m);
+#endif
+	return routing_word(page, xx, yoffs, forgiveness);
+}
+
+/*
+	Routing pages are regenerated incrementally: world_page_t.routing_stale collects the map tiles changed since
+	the routing page was generated (see page_tiles_changed()), and only their words are recomputed. The extra
+	column (obst_u32[][MAP_PAGE_W/32]) comes from the first tile row of the next page, so it's redone when
+	map_gen of that page has moved since - which also covers the next page being loaded or unloaded.
+	With no changes, this is a couple of compares per page.
+*/
+void gen_routing_page(world_t *w, int xpage, int ypage, int forgiveness)
+{
+	map_page_t* page = map_page(w, xpage, ypage);
+	if(!page)
+	{
+		return;
+	}
+	world_page_t* wp = find_world_page(w, xpage, ypage);
+	world_page_t* wp_next = find_world_page(w, xpage, ypage+1);
+	uint32_t next_gen = wp_next ? wp_next->map_gen : 0;
+
+	int fresh = 0;
+	if(!wp->rpage)
+	{
+		wp->rpage = pool_alloc(&routing_page_pool, 0);
+		if(!wp->rpage)
+		{
+			printf("ERROR: routing page pool exhausted, page (%d,%d) stays unroutable\n", xpage, ypage);
+			return;
+		}
+		wp->routing_stale = ~0ULL;
+		fresh = 1;
+	}
+	else if(!wp->routing_stale && wp->rpage_next_gen == next_gen)
+	{
+		return;
+	}
+
+	routing_page_t* rpage = wp->rpage;
+	map_page_t* next_page = wp_next ? wp_next->page : NULL;
+
+	forgiveness = ROUTING_3D_FORGIVENESS;
+	routing_masks_t masks;
+	routing_masks(&masks, forgiveness);
+
+	// Tiles with no obstacles at all (unknown or free areas) are skipped using the page summaries.
+	page_summary_t* sum = get_page_summary(w, xpage, ypage);
+
+	// Tiles whose routing words really changed, for the configuration space
+	uint64_t changed = fresh ? ~0ULL : 0;
+
+	uint64_t stale = wp->routing_stale;
+	while(stale)
+	{
+		int tile = __builtin_ctzll(stale);
+		stale &= stale-1;
+
+		int x0 = (tile/MAP_TILES_PER_ROW)*MAP_TILE_W;
+		int yy = tile%MAP_TILES_PER_ROW;
+		int free_tile = tile_routing_free(sum, tile, forgiveness);
+		for(int xx=x0; xx < x0+MAP_TILE_W; xx++)
+		{
+			uint32_t word = free_tile ? 0 : routing_word_kernel(page, xx, yy*32, forgiveness, &masks);
+			if(rpage->obst_u32[xx][yy] != word)
+			{
+				rpage->obst_u32[xx][yy] = word;
+				changed |= 1ULL << tile;
 			}
+		}
+	}
+	wp->routing_stale = 0;
+	if(changed)
+	{
+		cspace_routing_changed(w, xpage, ypage, changed);
+		hpa_routing_changed(w, xpage, ypage, changed);
+		dstar_routing_changed(w, xpage, ypage, changed);
+	}
+
+	if(fresh || wp->rpage_next_gen != next_gen)
+	{
+		page_summary_t* sum_next = get_page_summary(w, xpage, ypage+1);
+		int next_changed = fresh;
+		for(int xx=0; xx < MAP_PAGE_W; xx++)
+		{
+			uint32_t word;
+			if(tile_routing_free(sum_next, map_tile_idx(xx, 0), forgiveness))
+				word = 0;
+			else if(next_page)
+				word = routing_word_kernel(next_page, xx, 0, forgiveness, &masks);
 			else
+				word = 0xffffffff;
+
+			if(rpage->obst_u32[xx][MAP_PAGE_W/32] != word)
 			{
-				w->rpages[xpage][ypage]->obst_u32[xx][MAP_PAGE_W/32] = 0xffffffff;
+				rpage->obst_u32[xx][MAP_PAGE_W/32] = word;
+				next_changed = 1;
 			}
 		}
+		wp->rpage_next_gen = next_gen;
+		// The c-space reads the extra column only for a next page without a routing page
+		if(next_changed)
+		{
+			cspace_routing_changed(w, xpage, ypage+1, CSPACE_TILES_TY0);
+			hpa_routing_changed(w, xpage, ypage+1, CSPACE_TILES_TY0);
+			dstar_routing_changed(w, xpage, ypage+1, CSPACE_TILES_TY0);
+		}
 	}
-	
 }
 
+// Only the loaded pages have anything to generate; the block directory leads to them.
 void gen_all_routing_pages(world_t *w, int forgiveness)
 {
-	for(int xpage = 0; xpage < MAP_W; xpage++)
+	for(int bx = 0; bx < WORLD_BLOCKS; bx++)
 	{
-		for(int ypage = 0; ypage < MAP_W; ypage++)
+		for(int by = 0; by < WORLD_BLOCKS; by++)
 		{
-			gen_routing_page(w, xpage, ypage, forgiveness);
+			world_block_t* b = w->blocks[bx][by];
+			if(!b)
+				continue;
+
+			for(int ix = 0; ix < WORLD_BLOCK_W; ix++)
+			{
+				for(int iy = 0; iy < WORLD_BLOCK_W; iy++)
+				{
+					if(b->p[ix][iy].page)
+						gen_routing_page(w, bx*WORLD_BLOCK_W+ix, by*WORLD_BLOCK_W+iy, forgiveness);
+				}
+			}
 		}
 	}
 }
@@ -1444,6 +3956,7 @@ void gen_all_routing_pages(world_t *w, int forgiveness)
 int search_route(world_t *w, route_unit_t **route, float start_ang, int start_x_mm, int start_y_mm, int end_x_mm, int end_y_mm, int no_tight)
 {
 	routing_world = w;
+	cspace_clock++;
 
 	//printf("Searching for route...\n");
 
@@ -1451,6 +3964,31 @@ int search_route(world_t *w, route_unit_t **route, float start_ang, int start_x_
 	gen_all_routing_pages(w, 0);
 //	printf("done.\n");
 
+	int s_x, s_y, e_x, e_y;
+	unit_coords(start_x_mm, start_y_mm, &s_x, &s_y);
+	unit_coords(end_x_mm, end_y_mm, &e_x, &e_y);
+	int dist = abs(e_x-s_x) > abs(e_y-s_y) ? abs(e_x-s_x) : abs(e_y-s_y);
+	if(dist > hpa_min_dist && dist > HPA_REFINE_DIST)
+	{
+		int ret = hierarchical_route(route, start_ang, start_x_mm, start_y_mm, end_x_mm, end_y_mm, no_tight);
+		tight_search_mode();
+		if(ret == 0)
+			return 0;
+
+		// search() can still try if the goal is in its area.
+		if(abs(e_x/MAP_PAGE_W - s_x/MAP_PAGE_W) > SEARCH_AREA_PAGES/2 || abs(e_y/MAP_PAGE_W - s_y/MAP_PAGE_W) > SEARCH_AREA_PAGES/2)
+		{
+			printf("There is no route on the cluster graph.\n");
+			return ret;
+		}
+	}
+
+	if(routing_incremental && !dstar_route(route, start_ang, start_x_mm, start_y_mm, end_x_mm, end_y_mm, no_tight))
+	{
+		tight_search_mode();
+		return 0;
+	}
+
 	wide_search_mode();
 	if(search2(route, start_ang, start_x_mm, start_y_mm, end_x_mm, end_y_mm))
 	{
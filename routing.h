@@ -64,5 +64,71 @@ void routing_set_world(world_t *w);
 void gen_all_routing_pages(world_t *w, int forgiveness);
 void gen_routing_page(world_t *w, int xpage, int ypage, int forgiveness);
 
+// Full resolution search of the routes: search()'s Theta* by default, or A* over the 8-connected units, with or without
+// jump point pruning (same routes, fewer nodes), see search_grid() in routing.c
+#define SEARCH_THETA 0
+#define SEARCH_ASTAR 1
+#define SEARCH_JPS   2
+extern int routing_search_algo;
+
+typedef struct
+{
+	int searches;
+	int expansions; // nodes taken from the open set
+	float cost;     // length of the path (in units) the last successful search found, before smoothing
+} search_stats_t;
+
+extern search_stats_t search_stats;
+
+// Incremental replanning: search_route() keeps the search of the route and repairs it after map changes, when
+// routing to the same goal again (D* Lite, see routing.c)
+extern int routing_incremental;
+
+typedef struct
+{
+	int searches;      // fresh searches
+	int repairs;       // routes found again with the kept search
+	int units_updated; // by the map changes
+} dstar_stats_t;
+
+extern dstar_stats_t dstar_stats;
+
+// Routing word kernel of gen_routing_page(): "avx2", "sse2", "neon" or "scalar". Setting routing_scalar_kernel
+// makes it use the scalar code anyway, for checking and timing the SIMD kernel against it.
+extern const char* routing_kernel_name;
+extern int routing_scalar_kernel;
+
+// Configuration space: routing pages dilated with the robot shapes, see routing.c
+typedef struct
+{
+	int lookups;         // collision checks answered from the c-space
+	int fallbacks;       // checked against the routing pages instead (no routing page or out of memory)
+	int tiles_generated;
+	int planes;          // a plane is one page in one search mode and heading
+	int peak_planes;
+	int evictions;       // planes freed to stay in CSPACE_BUDGET_MB
+} cspace_stats_t;
+
+extern cspace_stats_t cspace_stats;
+
+// Hierarchical routing of far goals on a graph of the map tiles, see routing.c
+typedef struct
+{
+	int searches;       // routes searched on the cluster graph
+	int found;
+	int clusters_built;
+	int nodes_expanded; // by the searches on the graph
+} hpa_stats_t;
+
+extern hpa_stats_t hpa_stats;
+// Goals farther than this (in routing units, in x or y) are routed on the cluster graph. 0 to route everything beyond
+// the part searched at full resolution there.
+extern int hpa_min_dist;
+
+// Invalidates the c-space depending on the routing tiles of the page. gen_routing_page() does this by itself.
+void cspace_routing_changed(world_t* w, int pagex, int pagey, uint64_t tiles);
+// The page's routing page was freed: frees its c-space and invalidates the neighbors' tiles depending on it.
+void cspace_page_unloaded(world_t* w, int pagex, int pagey);
+
 
 #endif